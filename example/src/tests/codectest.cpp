@@ -0,0 +1,146 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include "hpcstream/codec.h"
+
+// encodes and decodes arrays block by block with every built-in lossless codec, and checks the values come back unchanged
+bool RoundTrip(uint8_t codec_id, uint8_t filter, const std::vector<float>& values, uint64_t block_size, HpcStream::WorkerPool *workers);
+// same with the quantize codec: finite values come back within the (absolute, or relative to the value range) error
+// bound, NaN and Inf unchanged
+template <typename T>
+bool QuantizeRoundTrip(const std::vector<uint32_t>& l_size, uint64_t block_size, double error_bound, bool relative);
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    uint64_t i;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> noise(-1.0f, 1.0f);
+    HpcStream::WorkerPool workers(4);
+
+    // smooth values compress, noise does not (encoded blocks then hold the raw bytes)
+    std::vector<float> smooth(100003);
+    std::vector<float> random(65536);
+    for (i = 0; i < smooth.size(); i++)
+    {
+        smooth[i] = sinf(0.001f * i);
+    }
+    for (i = 0; i < random.size(); i++)
+    {
+        random[i] = noise(rng);
+    }
+
+    uint64_t block_sizes[] = {8, 4096, 65536, 1048576};
+    for (uint64_t block_size : block_sizes)
+    {
+        failed += !RoundTrip(HpcStream::CodecId::FastLz, HpcStream::FilterId::NoFilter, smooth, block_size, &workers);
+        failed += !RoundTrip(HpcStream::CodecId::FastLz, HpcStream::FilterId::NoFilter, random, block_size, &workers);
+        failed += !RoundTrip(HpcStream::CodecId::FastLz, HpcStream::FilterId::NoFilter, smooth, block_size, NULL);
+    }
+    failed += !RoundTrip(HpcStream::CodecId::FastLz, HpcStream::FilterId::NoFilter, std::vector<float>(1, 1.0f), 4096, &workers);
+
+    // 1 to 3 dimensions, with blocks that end on a row and blocks that split rows (and planes)
+    struct {
+        std::vector<uint32_t> l_size;
+        uint64_t block_size;
+    } shapes[] = {
+        {{1000}, 4096}, {{1000}, 100},
+        {{64, 40}, 64 * 8}, {{37, 23}, 100},
+        {{16, 12, 10}, 16 * 12 * 8}, {{13, 11, 7}, 292},
+    };
+    for (auto const& shape : shapes)
+    {
+        failed += !QuantizeRoundTrip<float>(shape.l_size, shape.block_size, 1e-3, false);
+        failed += !QuantizeRoundTrip<double>(shape.l_size, shape.block_size, 1e-6, false);
+        failed += !QuantizeRoundTrip<float>(shape.l_size, shape.block_size, 1e-4, true);
+        failed += !QuantizeRoundTrip<double>(shape.l_size, shape.block_size, 1e-8, true);
+        failed += !QuantizeRoundTrip<double>(shape.l_size, shape.block_size, 0.0, false);
+    }
+
+    printf("codec round trip: %s\n", failed == 0 ? "passed" : "FAILED");
+    return failed == 0 ? 0 : 1;
+}
+
+bool RoundTrip(uint8_t codec_id, uint8_t filter, const std::vector<float>& values, uint64_t block_size, HpcStream::WorkerPool *workers)
+{
+    HpcStream::Codec *codec = HpcStream::GetCodec(codec_id);
+    uint32_t l_size[1] = {(uint32_t)values.size()};
+    HpcStream::CodecContext ctx = {HpcStream::DataType::Float, sizeof(float), filter, 1, l_size, 0, 0.0};
+    uint64_t length = values.size() * sizeof(float);
+    std::vector<uint8_t> encoded(HpcStream::MaxEncodedBlocksSize(codec, length, block_size));
+    std::vector<float> decoded(values.size());
+    uint64_t enc_size = HpcStream::EncodeBlocks(codec, ctx, reinterpret_cast<const uint8_t*>(values.data()), length, block_size, encoded.data(), workers);
+    bool ok = enc_size <= encoded.size()
+              && HpcStream::DecodeBlocks(codec, ctx, encoded.data(), enc_size, reinterpret_cast<uint8_t*>(decoded.data()), length)
+              && memcmp(values.data(), decoded.data(), length) == 0;
+    // truncated input is rejected rather than read past its end
+    ok = ok && (enc_size < 2 || !HpcStream::DecodeBlocks(codec, ctx, encoded.data(), enc_size / 2, reinterpret_cast<uint8_t*>(decoded.data()), length));
+    if (!ok)
+    {
+        fprintf(stderr, "codec %u, filter %u: %lu values in blocks of %lu bytes did not round trip\n", codec_id, filter,
+                (unsigned long)values.size(), (unsigned long)block_size);
+    }
+    return ok;
+}
+
+template <typename T>
+bool QuantizeRoundTrip(const std::vector<uint32_t>& l_size, uint64_t block_size, double error_bound, bool relative)
+{
+    uint64_t i;
+    uint64_t count = 1;
+    for (uint32_t n : l_size)
+    {
+        count *= n;
+    }
+    // smooth field over the array's coordinates with a little noise, and a few values no predictor can handle
+    std::mt19937 rng(count);
+    std::uniform_real_distribution<double> noise(-1e-3, 1e-3);
+    std::vector<T> values(count);
+    for (i = 0; i < count; i++)
+    {
+        uint64_t x = i % l_size[0];
+        uint64_t y = l_size.size() > 1 ? (i / l_size[0]) % l_size[1] : 0;
+        uint64_t z = l_size.size() > 2 ? i / (l_size[0] * l_size[1]) : 0;
+        values[i] = static_cast<T>(100.0 * sin(0.05 * x) * cos(0.07 * y) + 3.0 * z + noise(rng));
+    }
+    const T special[] = {std::numeric_limits<T>::quiet_NaN(), std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity()};
+    for (i = 0; i < count; i += 97)
+    {
+        values[i] = special[(i / 97) % 3];
+    }
+
+    HpcStream::DataType type = sizeof(T) == sizeof(double) ? HpcStream::DataType::Double : HpcStream::DataType::Float;
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(values.data());
+    double range = HpcStream::ValueRange(type, src, count);
+    double bound = relative ? error_bound * range : error_bound;
+    HpcStream::CodecContext ctx = {type, sizeof(T), HpcStream::FilterId::NoFilter, (uint32_t)l_size.size(), l_size.data(), 0, bound};
+    HpcStream::Codec *codec = HpcStream::GetCodec(HpcStream::CodecId::Quantize);
+    uint64_t length = count * sizeof(T);
+    // blocks hold whole elements, as the server sizes them
+    block_size -= block_size % sizeof(T);
+    std::vector<uint8_t> encoded(HpcStream::MaxEncodedBlocksSize(codec, length, block_size));
+    std::vector<T> decoded(count);
+    uint64_t enc_size = HpcStream::EncodeBlocks(codec, ctx, src, length, block_size, encoded.data(), NULL);
+    if (!std::isfinite(range) || range <= 0.0 || enc_size > encoded.size() ||
+        !HpcStream::DecodeBlocks(codec, ctx, encoded.data(), enc_size, reinterpret_cast<uint8_t*>(decoded.data()), length))
+    {
+        fprintf(stderr, "quantize: %lu values in blocks of %lu bytes did not decode\n", (unsigned long)count, (unsigned long)block_size);
+        return false;
+    }
+    for (i = 0; i < count; i++)
+    {
+        bool ok = std::isfinite(values[i]) ? std::fabs(static_cast<double>(decoded[i]) - values[i]) <= bound
+                                           : memcmp(&(decoded[i]), &(values[i]), sizeof(T)) == 0;
+        if (!ok)
+        {
+            fprintf(stderr, "quantize: %lu-d %s value %lu decoded as %g instead of %g (bound %g, blocks of %lu bytes)\n",
+                    (unsigned long)l_size.size(), sizeof(T) == sizeof(double) ? "double" : "float", (unsigned long)i,
+                    static_cast<double>(decoded[i]), static_cast<double>(values[i]), bound, (unsigned long)block_size);
+            return false;
+        }
+    }
+    return true;
+}
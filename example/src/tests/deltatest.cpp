@@ -0,0 +1,83 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include "hpcstream/region.h"
+#include "hpcstream/filter.h"
+
+// changes a few elements of a local array between steps, and checks that patching the previous value with the changed
+// tiles reproduces the new one (also across byte orders) and that malformed deltas are rejected
+bool RoundTrip(uint32_t dims, const uint32_t *l_size, uint32_t tile_size, int num_changes, std::mt19937& rng);
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    std::mt19937 rng(9012);
+    uint32_t size_1d[1] = {1000};
+    uint32_t size_2d[2] = {37, 29};
+    uint32_t size_3d[3] = {16, 15, 9};
+    uint32_t tile_sizes[] = {1, 4, 16, 64};
+    int changes[] = {0, 1, 10, 1000};
+    for (uint32_t tile_size : tile_sizes)
+    {
+        for (int num_changes : changes)
+        {
+            failed += !RoundTrip(1, size_1d, tile_size, num_changes, rng);
+            failed += !RoundTrip(2, size_2d, tile_size, num_changes, rng);
+            failed += !RoundTrip(3, size_3d, tile_size, num_changes, rng);
+        }
+    }
+
+    printf("delta tiles round trip: %s\n", failed == 0 ? "passed" : "FAILED");
+    return failed == 0 ? 0 : 1;
+}
+
+bool RoundTrip(uint32_t dims, const uint32_t *l_size, uint32_t tile_size, int num_changes, std::mt19937& rng)
+{
+    int i;
+    uint32_t d;
+    uint64_t length = 1;
+    for (d = 0; d < dims; d++)
+    {
+        length *= l_size[d];
+    }
+    std::vector<int32_t> prev(length);
+    for (i = 0; i < (int)length; i++)
+    {
+        prev[i] = rng();
+    }
+    std::vector<int32_t> val(prev);
+    for (i = 0; i < num_changes; i++)
+    {
+        val[rng() % length] = rng();
+    }
+    // server and client both hold the previous value, the client also in the other byte order
+    std::vector<int32_t> server_prev(prev);
+    std::vector<int32_t> client(prev);
+    std::vector<int32_t> client_swapped(length);
+    std::vector<int32_t> val_swapped(length);
+    HpcStream::SwapBytes(reinterpret_cast<const uint8_t*>(prev.data()), reinterpret_cast<uint8_t*>(client_swapped.data()), length, sizeof(int32_t));
+    HpcStream::SwapBytes(reinterpret_cast<const uint8_t*>(val.data()), reinterpret_cast<uint8_t*>(val_swapped.data()), length, sizeof(int32_t));
+
+    std::vector<uint8_t> delta(HpcStream::MaxDeltaTilesSize(dims, l_size, sizeof(int32_t), tile_size));
+    uint64_t delta_size = HpcStream::EncodeDeltaTiles(reinterpret_cast<const uint8_t*>(val.data()), reinterpret_cast<uint8_t*>(server_prev.data()),
+                                                      dims, l_size, sizeof(int32_t), tile_size, delta.data());
+    bool ok = delta_size <= delta.size() && server_prev == val
+              && (num_changes > 0 || delta_size == sizeof(uint32_t))
+              && HpcStream::ApplyDeltaTiles(delta.data(), delta_size, reinterpret_cast<uint8_t*>(client.data()), dims, l_size, sizeof(int32_t))
+              && client == val
+              && HpcStream::ApplyDeltaTiles(delta.data(), delta_size, reinterpret_cast<uint8_t*>(client_swapped.data()), dims, l_size, sizeof(int32_t), true)
+              && client_swapped == val_swapped;
+    // a delta cut short, or with a tile outside the array, is rejected
+    if (ok && delta_size > sizeof(uint32_t))
+    {
+        ok = !HpcStream::ApplyDeltaTiles(delta.data(), delta_size - 1, reinterpret_cast<uint8_t*>(client.data()), dims, l_size, sizeof(int32_t));
+        uint32_t bad_offset = htonl(l_size[0]);
+        memcpy(delta.data() + sizeof(uint32_t), &bad_offset, sizeof(uint32_t));
+        ok = ok && !HpcStream::ApplyDeltaTiles(delta.data(), delta_size, reinterpret_cast<uint8_t*>(client.data()), dims, l_size, sizeof(int32_t));
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "%u-d array, tiles of %u, %d changes: delta did not round trip\n", dims, tile_size, num_changes);
+    }
+    return ok;
+}
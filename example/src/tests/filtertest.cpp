@@ -0,0 +1,98 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include "hpcstream/codec.h"
+#include "hpcstream/filter.h"
+
+// applies and removes each pre-filter for every element size and for counts that do not fill whole vector blocks, and
+// checks that filtered values still encode and decode unchanged
+bool RoundTrip(uint8_t filter, const std::vector<uint8_t>& values, uint64_t count, uint32_t size);
+bool EncodedRoundTrip(uint8_t filter, const std::vector<double>& values);
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    uint64_t i;
+    std::mt19937 rng(5678);
+    std::vector<uint8_t> bytes(16 * 4099);
+    for (i = 0; i < bytes.size(); i++)
+    {
+        bytes[i] = rng() & 0xFF;
+    }
+
+    uint8_t filters[] = {HpcStream::FilterId::ByteShuffle, HpcStream::FilterId::BitShuffle};
+    uint32_t sizes[] = {1, 2, 3, 4, 8, 16};
+    uint64_t counts[] = {0, 1, 7, 8, 63, 64, 1000, 4099};
+    for (uint8_t filter : filters)
+    {
+        for (uint32_t size : sizes)
+        {
+            for (uint64_t count : counts)
+            {
+                failed += !RoundTrip(filter, bytes, count, size);
+            }
+        }
+    }
+
+    // reversing the byte order twice (in place) restores the values
+    for (uint32_t size : sizes)
+    {
+        std::vector<uint8_t> swapped(bytes);
+        HpcStream::SwapBytes(swapped.data(), swapped.data(), 4099, size);
+        HpcStream::SwapBytes(swapped.data(), swapped.data(), 4099, size);
+        if (swapped != bytes)
+        {
+            fprintf(stderr, "byte swap of %u byte elements did not round trip\n", size);
+            failed++;
+        }
+    }
+
+    std::vector<double> smooth(50001);
+    for (i = 0; i < smooth.size(); i++)
+    {
+        smooth[i] = 1000.0 * cos(0.0005 * i);
+    }
+    for (uint8_t filter : filters)
+    {
+        failed += !EncodedRoundTrip(filter, smooth);
+    }
+
+    printf("filter round trip: %s\n", failed == 0 ? "passed" : "FAILED");
+    return failed == 0 ? 0 : 1;
+}
+
+bool RoundTrip(uint8_t filter, const std::vector<uint8_t>& values, uint64_t count, uint32_t size)
+{
+    uint64_t length = count * size;
+    std::vector<uint8_t> filtered(length + 1, 0xAB);
+    std::vector<uint8_t> restored(length + 1, 0xCD);
+    HpcStream::ApplyFilter(filter, values.data(), filtered.data(), count, size);
+    HpcStream::RemoveFilter(filter, filtered.data(), restored.data(), count, size);
+    // nothing past the elements is written
+    bool ok = memcmp(values.data(), restored.data(), length) == 0 && filtered[length] == 0xAB && restored[length] == 0xCD;
+    if (!ok)
+    {
+        fprintf(stderr, "filter %u: %lu elements of %u bytes did not round trip\n", filter, (unsigned long)count, size);
+    }
+    return ok;
+}
+
+bool EncodedRoundTrip(uint8_t filter, const std::vector<double>& values)
+{
+    HpcStream::Codec *codec = HpcStream::GetCodec(HpcStream::CodecId::FastLz);
+    uint32_t l_size[1] = {(uint32_t)values.size()};
+    HpcStream::CodecContext ctx = {HpcStream::DataType::Double, sizeof(double), filter, 1, l_size, 0, 0.0};
+    uint64_t length = values.size() * sizeof(double);
+    uint64_t block_size = 65536;
+    std::vector<uint8_t> encoded(HpcStream::MaxEncodedBlocksSize(codec, length, block_size));
+    std::vector<double> decoded(values.size());
+    uint64_t enc_size = HpcStream::EncodeBlocks(codec, ctx, reinterpret_cast<const uint8_t*>(values.data()), length, block_size, encoded.data(), NULL);
+    bool ok = HpcStream::DecodeBlocks(codec, ctx, encoded.data(), enc_size, reinterpret_cast<uint8_t*>(decoded.data()), length)
+              && memcmp(values.data(), decoded.data(), length) == 0;
+    if (!ok)
+    {
+        fprintf(stderr, "filter %u: encoded values did not round trip\n", filter);
+    }
+    return ok;
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include "hpcstream.h"
+
+using HpcStream::MessageType;
+using HpcStream::MessageFlags;
+
+static int checks = 0;
+static int failures = 0;
+
+// counts the check and reports it when it does not hold
+#define CHECK(cond, what) \
+    do { \
+        checks++; \
+        if (!(cond)) \
+        { \
+            failures++; \
+            fprintf(stderr, "protocol: %s (%s:%d)\n", what, __FILE__, __LINE__); \
+        } \
+    } while (0)
+
+int main(int argc, char **argv)
+{
+    int t;
+    uint16_t f;
+    const MessageType last_type = MessageType::Refresh;
+    const uint16_t flag_sets[] = {0, MessageFlags::Encoded, MessageFlags::Delta, MessageFlags::Cropped, MessageFlags::Blocks,
+                                  MessageFlags::Encoded | MessageFlags::Cropped, MessageFlags::Delta | MessageFlags::Blocks};
+
+    // every message type and flag combination reads back as written, with its payload present
+    for (t = MessageType::VarData; t <= last_type; t++)
+    {
+        for (f = 0; f < sizeof(flag_sets) / sizeof(flag_sets[0]); f++)
+        {
+            std::vector<uint8_t> message(HPCSTREAM_HEADER_SIZE + 16, 0xAB);
+            HpcStream::MessageHeader header;
+            HpcStream::WriteMessageHeader(message.data(), static_cast<MessageType>(t), 0x01020304, 0x0A0B0C0D0E0F1011ULL, 16, flag_sets[f]);
+            bool valid = HpcStream::ReadMessageHeader(message.data(), message.size(), &header);
+            CHECK(valid, "header of a whole message rejected");
+            CHECK(header.version == HPCSTREAM_PROTOCOL_VERSION, "version not read back");
+            CHECK(header.type == t, "type not read back");
+            CHECK(header.flags == flag_sets[f], "flags not read back");
+            CHECK(header.var == 0x01020304 && header.step == 0x0A0B0C0D0E0F1011ULL && header.length == 16, "fields not read back");
+            CHECK(message[HPCSTREAM_HEADER_SIZE] == 0xAB, "header written past its size");
+        }
+    }
+
+    // fields go out in network byte order at fixed offsets
+    uint8_t wire[HPCSTREAM_HEADER_SIZE];
+    const uint8_t expected[HPCSTREAM_HEADER_SIZE] = {HPCSTREAM_PROTOCOL_VERSION, MessageType::McastRef, 0x00, 0x0C,
+                                                     0x01, 0x02, 0x03, 0x04,
+                                                     0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11,
+                                                     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10};
+    HpcStream::WriteMessageHeader(wire, MessageType::McastRef, 0x01020304, 0x0A0B0C0D0E0F1011ULL, 16, MessageFlags::Cropped | MessageFlags::Blocks);
+    CHECK(memcmp(wire, expected, HPCSTREAM_HEADER_SIZE) == 0, "wire layout differs");
+
+    // refresh requests and references carry no payload or a fixed one - both parse from exactly their size
+    HpcStream::MessageHeader header;
+    uint8_t refresh[HPCSTREAM_HEADER_SIZE];
+    HpcStream::WriteMessageHeader(refresh, MessageType::Refresh, 7, 0, 0);
+    CHECK(HpcStream::ReadMessageHeader(refresh, sizeof(refresh), &header) && header.type == MessageType::Refresh && header.var == 7,
+          "refresh request not read back");
+    uint8_t ref[HPCSTREAM_HEADER_SIZE + 2 * sizeof(uint64_t)];
+    HpcStream::WriteMessageHeader(ref, MessageType::McastRef, 3, 42, 2 * sizeof(uint64_t));
+    CHECK(HpcStream::ReadMessageHeader(ref, sizeof(ref), &header) && header.var == 3 && header.step == 42, "multicast reference not read back");
+    CHECK(!HpcStream::ReadMessageHeader(ref, sizeof(ref) - 1, &header), "reference missing a payload byte accepted");
+
+    // truncated headers, missing payloads, other protocol versions and lengths that overflow are rejected
+    std::vector<uint8_t> message(HPCSTREAM_HEADER_SIZE + 100);
+    HpcStream::WriteMessageHeader(message.data(), MessageType::VarData, 0, 1, 100);
+    for (uint64_t length = 0; length < HPCSTREAM_HEADER_SIZE; length++)
+    {
+        CHECK(!HpcStream::ReadMessageHeader(message.data(), length, &header), "truncated header accepted");
+    }
+    CHECK(!HpcStream::ReadMessageHeader(message.data(), HPCSTREAM_HEADER_SIZE + 99, &header), "missing payload byte accepted");
+    CHECK(HpcStream::ReadMessageHeader(message.data(), message.size() + 8, &header), "trailing bytes rejected");
+    message[0] = HPCSTREAM_PROTOCOL_VERSION - 1;
+    CHECK(!HpcStream::ReadMessageHeader(message.data(), message.size(), &header), "older protocol version accepted");
+    message[0] = HPCSTREAM_PROTOCOL_VERSION + 1;
+    CHECK(!HpcStream::ReadMessageHeader(message.data(), message.size(), &header), "newer protocol version accepted");
+    HpcStream::WriteMessageHeader(message.data(), MessageType::VarData, 0, 1, UINT64_MAX);
+    CHECK(!HpcStream::ReadMessageHeader(message.data(), message.size(), &header), "overflowing length accepted");
+
+    // 64 bit byte order conversion round trips
+    CHECK(HpcStream::NToHLL(HpcStream::HToNLL(0x0102030405060708ULL)) == 0x0102030405060708ULL, "64 bit conversion does not round trip");
+
+    printf("protocol headers: %d checks, %s\n", checks, failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include "hpcstream/shm.h"
+
+// a producer writes messages of varying sizes into a ring (waiting while it is full) and passes their positions to a
+// consumer mapping the same ring, which checks each message and releases its space - messages wrap around many times
+uint8_t MessageByte(uint64_t message, uint64_t i);
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    uint64_t i;
+    const uint64_t capacity = 65536;
+    const uint64_t num_messages = 5000;
+    std::string name = "/hpcstream_shmtest_" + std::to_string(getpid());
+    HpcStream::ShmRing *producer = HpcStream::ShmRing::Create(name, capacity);
+    HpcStream::ShmRing *consumer = producer != NULL ? HpcStream::ShmRing::Open(name) : NULL;
+    if (producer == NULL || consumer == NULL)
+    {
+        fprintf(stderr, "could not create and map shared memory %s\n", name.c_str());
+        delete producer;
+        return 1;
+    }
+    producer->Unlink();
+    if (HpcStream::ShmRing::Open(name) != NULL)
+    {
+        fprintf(stderr, "ring could be mapped after unlinking it\n");
+        failed++;
+    }
+
+    // positions and lengths take the place of the references sent through the socket
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::pair<uint64_t, uint64_t> > refs;
+    std::thread reader([&] {
+        uint64_t m, j;
+        for (m = 0; m < num_messages; m++)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&] {return !refs.empty();});
+            std::pair<uint64_t, uint64_t> ref = refs.front();
+            refs.pop_front();
+            lock.unlock();
+            const uint8_t *message = consumer->Data(ref.first, ref.second);
+            bool ok = message != NULL;
+            for (j = 0; j < ref.second && ok; j++)
+            {
+                ok = message[j] == MessageByte(m, j);
+            }
+            if (!ok)
+            {
+                fprintf(stderr, "message %lu (%lu bytes at %lu) did not arrive intact\n", (unsigned long)m, (unsigned long)ref.second,
+                        (unsigned long)ref.first);
+                failed++;
+            }
+            consumer->Release(ref.first + ref.second);
+        }
+    });
+
+    std::vector<uint8_t> message;
+    for (i = 0; i < num_messages; i++)
+    {
+        uint64_t length = 1 + (i * 7919) % (capacity / 3);
+        uint64_t position;
+        message.resize(length);
+        for (uint64_t j = 0; j < length; j++)
+        {
+            message[j] = MessageByte(i, j);
+        }
+        while (!producer->Write(message.data(), length, &position))
+        {
+            std::this_thread::yield();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            refs.push_back(std::make_pair(position, length));
+        }
+        cond.notify_one();
+    }
+    reader.join();
+
+    // messages larger than the ring never fit, and positions outside what was written are refused
+    uint64_t position;
+    std::vector<uint8_t> too_large(capacity + 1);
+    if (producer->Write(too_large.data(), too_large.size(), &position) || consumer->Data(0, capacity + 1) != NULL
+        || consumer->Data(capacity * num_messages, 1) != NULL)
+    {
+        fprintf(stderr, "ring accepted a message or position outside its bounds\n");
+        failed++;
+    }
+
+    delete consumer;
+    delete producer;
+    printf("shared memory ring round trip: %s\n", failed == 0 ? "passed" : "FAILED");
+    return failed == 0 ? 0 : 1;
+}
+
+uint8_t MessageByte(uint64_t message, uint64_t i)
+{
+    return (uint8_t)(message * 31 + i * 17 + (i >> 8));
+}
@@ -2,6 +2,7 @@
 #define __HPCSTREAM_H_
 
 #include <iostream>
+#include <cstring>
 #include <arpa/inet.h>
 
 #ifdef __APPLE__
@@ -12,17 +13,60 @@
 
 #define HPCSTREAM_FLOATTEST 1.9961090087890625e2 // IEEE 754 ==> 0x4068F38C80000000
 #define HPCSTREAM_FLOATBINARY 0x4068F38C80000000LL
+#define HPCSTREAM_INVALID_HANDLE 0xFFFFFFFF
+#define HPCSTREAM_PROTOCOL_VERSION 5
+#define HPCSTREAM_HANDSHAKE_SIZE 22
+#define HPCSTREAM_HEADER_SIZE 24
+#define HPCSTREAM_SEND_CHUNK 2147483648ULL // largest piece of a message handed to NetSocket at once (its lengths are 32 bit)
+#define HPCSTREAM_MPI_CHUNK 1073741824ULL // largest piece of a buffer passed to one MPI call (counts are int)
+#define HPCSTREAM_DATAGRAM_PAYLOAD 1400
+#define HPCSTREAM_MULTICAST_HISTORY 4
+#define HPCSTREAM_MULTICAST_WINDOW 64 // messages ahead of the one being received whose datagrams are kept
+#define HPCSTREAM_MULTICAST_UNCLAIMED 268435456ULL // bytes held for messages datagrams arrived for before they were asked for
 
 namespace HpcStream {
     enum DataType : uint8_t {Uint8, Uint16, Uint32, Uint64, Int8, Int16, Int32, Int64, Float, Double, ArraySize};
     enum Endian : uint8_t {Little, Big};
+    typedef uint32_t VarHandle;
+    enum MessageType : uint8_t {VarData, StepEnd, StepAck, StepFrame, Subscribe, Region, Subsample, StepWindow, ShmOpen, ShmRef, BulkOpen, BulkRef, McastOpen, McastRef, McastNack, Refresh};
+    enum MessageFlags : uint16_t {Encoded = 0x0001, Delta = 0x0002, Cropped = 0x0004, Blocks = 0x0008};
+
+    // fixed size header in front of every streamed message (network byte order on the wire)
+    typedef struct MessageHeader {
+        uint8_t version;                  // protocol version
+        MessageType type;                 // message type
+        uint16_t flags;                   // encoding flags for the payload
+        uint32_t var;                     // variable id (assigned with the variable definitions)
+        uint64_t step;                    // time step the message belongs to
+        uint64_t length;                  // payload length (bytes)
+    } MessageHeader;
+
+    typedef struct ServerOptions {
+        uint32_t write_buffers; // number of buffers per variable (steps that can be in flight at once - at least send_queue_depth + 2 when dropping frames)
+        bool async_write;       // send data and handle client events on a background thread
+        bool step_frames;       // pack all scalars and the end of step into one message per connection
+        int codec_threads;      // threads used to encode blocks of compressed variables
+        uint64_t codec_block_size; // bytes per independently encoded block
+        uint32_t send_queue_depth; // steps queued per connection still sending an earlier step when dropping frames (older ones are dropped)
+        bool aggregate;         // gather values of ranks sharing a node to one rank that sends them for the node
+        uint64_t shm_size;      // bytes of the shared-memory ring used for each client on the same node (0: always use the socket)
+        bool uring;             // send large values over a data socket per client driven by io_uring (Linux, socket only if unavailable)
+        uint64_t zerocopy_threshold; // values at least this large are sent over the data socket without a kernel copy (0: always copy)
+        uint32_t bulk_streams;  // data sockets per client that large values are striped across (with uring)
+        uint64_t stripe_size;   // bytes of a value sent on one data socket before moving on to the next
+        const char *multicast_group; // IPv4 multicast group large values are sent to once for all clients that join (NULL: unicast only)
+        uint16_t multicast_port; // UDP port of the first sender (the others use the ports following it)
+    } ServerOptions;
 
     class Server;
     class Client;
 
+    ServerOptions CreateServerOptions();
     uint32_t GetDataTypeSize(DataType type);
     uint64_t HToNLL(uint64_t val);
     uint64_t NToHLL(uint64_t val);
+    void WriteMessageHeader(uint8_t *buffer, MessageType type, uint32_t var, uint64_t step, uint64_t length, uint16_t flags = 0);
+    bool ReadMessageHeader(const uint8_t *buffer, uint64_t buffer_length, MessageHeader *header);
 }
 
 #endif // __HPCSTREAM_H_
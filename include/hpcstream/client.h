@@ -6,16 +6,30 @@
 #include <vector>
 #include <map>
 #include <thread>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <mpi.h>
 extern "C" {
 #include <ddr.h>
 }
 #include <netsocket/client.h>
 #include "hpcstream.h"
+#include "hpcstream/codec.h"
+#include "hpcstream/region.h"
+#include "hpcstream/shm.h"
+#include "hpcstream/multicast.h"
 
 class HpcStream::Client {
 private:
+    enum SizeRole : uint8_t {GlobalSize, LocalSize, LocalOffset};
+    typedef struct SizeDep {
+        HpcStream::VarHandle var;         // array whose size or offset is defined by the ArraySize variable
+        SizeRole role;
+        uint32_t dim;
+    } SizeDep;
     typedef struct SharedVar {
+        std::string name;                 // variable name
         HpcStream::DataType type;         // base data type for each element
         uint32_t dims;                    // array dimensions
         std::vector<std::string> gs_vars; // names of vars to define global size of array
@@ -24,14 +38,41 @@ private:
         uint32_t *g_size;                 // array of global array sizes
         uint32_t *l_size;                 // array of local array sizes
         uint32_t *l_offset;               // array of local array offsets
+        uint32_t *r_size;                 // sizes of the box held in val (local block, or the part within the requested region)
+        uint32_t *r_offset;               // global offsets of the box held in val
         uint8_t *val;                     // byte buffer for variable value(s)
         uint32_t size;                    // size of single element (bytes)
         int64_t length;                   // number of local elements
+        std::vector<SizeDep> size_deps;   // arrays that depend on this ArraySize variable
+        bool resize_pending;              // local size changed, value reallocated before next use
+        bool stale;                       // a value was lost - changed tiles are skipped until it arrives whole
+        uint8_t codec;                    // codec id the server uses to encode array values
+        uint8_t filter;                   // filter the server applies to array values before encoding
+        std::vector<uint32_t> sample;     // subsampling factor per dimension requested from the server (empty: full resolution)
     } SharedVar;
     typedef struct Connection {
-        NetSocket::Client* client;
-        std::map<std::string, SharedVar> vars;
+        NetSocket::Client* client;        // shared by the blocks of one sender
+        std::vector<SharedVar> vars;
+        uint64_t step;                    // most recent time step received
+        bool swap_bytes;                  // whether values arrive in the opposite byte order
+        uint32_t source;                  // block within the sender's group (one per server rank sending through it)
+        uint32_t group_size;              // blocks the sender streams
+        HpcStream::ShmRing *shm;          // ring a server on the same node copies values into (NULL: socket only)
+        std::string host;                 // address of the sender
+        std::vector<std::string> rails;   // addresses of each of the sender's interfaces
+        uint32_t rail;                    // interface the connection goes through (data sockets continue from it)
+        std::vector<int> bulk_fds;        // data sockets the sender stripes large values over (empty: socket only)
+        uint64_t stripe_size;             // bytes of a value sent on one data socket before moving on to the next
+        HpcStream::WorkerPool *bulk_readers; // threads reading the data sockets, started with them
+        HpcStream::McastReceiver *mcast;  // sender's multicast group the client joined (NULL: not joined)
     } Connection;
+    typedef struct HeldValue {
+        int connection;                   // connection (block) the value belongs to
+        HpcStream::VarHandle var;
+        const uint8_t *data;
+        uint64_t length;
+        uint16_t flags;
+    } HeldValue;
 
     int _rank;
     int _num_ranks;
@@ -39,22 +80,43 @@ private:
     MPI_Comm _comm;
     HpcStream::Endian _endianness;
     std::vector<Connection> _connections;
+    std::map<std::string, HpcStream::VarHandle> _var_handles;
 
+    void BuildSizeDependencies(std::vector<SharedVar>& vars);
+    void CopyVars(const std::vector<SharedVar>& vars, std::vector<SharedVar>& copy);
+    void ResizeArray(SharedVar& var);
+    void SetReceivedBox(SharedVar& var, const uint32_t *offset, const uint32_t *size);
     void ConnectionRead(int connection_idx);
+    uint8_t* ReceiveMessage(Connection& conn, uint64_t *length);
+    void OpenBulkSocket(Connection& conn, const uint8_t *offer, uint64_t length);
+    uint8_t* ReadBulk(Connection& conn, uint64_t length);
+    void JoinMulticast(Connection& conn, const uint8_t *offer, uint64_t length);
+    uint8_t* ReadMulticast(Connection& conn, uint64_t id, uint64_t length);
+    void StoreValue(std::vector<SharedVar>& vars, SharedVar& var, const uint8_t *data, uint64_t length, uint16_t flags, bool swap_bytes);
 
 public:
     typedef struct GlobalSelection {
         std::string var_name;
+        HpcStream::VarHandle var;
         DDR_DataDescriptor *desc;
+        std::vector<uint32_t> own_offsets; // global box needed from each connection's block (offsets, then sizes)
+        std::vector<uint32_t> own_sizes;
     } GlobalSelection;
 
-    Client(const char *iface, uint16_t port, MPI_Comm comm);
+    Client(const char *iface, uint16_t port, MPI_Comm comm, const std::vector<std::string>& subscriptions = std::vector<std::string>());
     ~Client();
 
+    void Subscribe(const std::vector<std::string>& var_names);
+    void SetSubsampling(std::string var_name, const uint32_t *factors, HpcStream::SampleFilter filter = HpcStream::SampleFilter::Nearest);
+    void SetSubsampling(HpcStream::VarHandle var, const uint32_t *factors, HpcStream::SampleFilter filter = HpcStream::SampleFilter::Nearest);
+    void SetStepWindow(uint32_t steps);
     void Read();
     void ReleaseTimeStep();
+    HpcStream::VarHandle GetVarHandle(std::string var_name);
     void GetGlobalSizeForVariable(std::string var_name, uint32_t *size);
+    void GetGlobalSizeForVariable(HpcStream::VarHandle var, uint32_t *size);
     GlobalSelection CreateGlobalArraySelection(std::string var_name, int32_t *sizes, int32_t *offsets);
+    GlobalSelection CreateGlobalArraySelection(HpcStream::VarHandle var, int32_t *sizes, int32_t *offsets);
     void FillSelection(GlobalSelection& selection, void *data);
 };
 
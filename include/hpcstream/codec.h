@@ -0,0 +1,74 @@
+#ifndef __HPCSTREAM_CODEC_H_
+#define __HPCSTREAM_CODEC_H_
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include "hpcstream.h"
+#include "hpcstream/filter.h"
+
+#define HPCSTREAM_CUSTOM_CODEC_MIN 128
+
+namespace HpcStream {
+    enum CodecId : uint8_t {NoCodec = 0, FastLz = 1, Quantize = 2};
+    enum ErrorMode : uint8_t {Absolute, Relative};
+
+    // information about the variable being encoded / decoded
+    typedef struct CodecContext {
+        HpcStream::DataType type;         // base data type for each element
+        uint32_t size;                    // size of single element (bytes)
+        uint8_t filter;                   // filter applied to each block before encoding
+        uint32_t dims;                    // array dimensions
+        const uint32_t *l_size;           // local array sizes (first dimension varies fastest)
+        uint64_t first;                   // index of the block's first element within the local array
+        double error_bound;               // absolute error allowed by lossy codecs
+    } CodecContext;
+
+    class Codec {
+    public:
+        virtual ~Codec() {}
+        // upper bound of encoded size for 'length' bytes of input
+        virtual uint64_t MaxEncodedSize(uint64_t length) = 0;
+        // encode 'length' bytes from 'src' into 'dst' - returns encoded size
+        virtual uint64_t Encode(const CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst) = 0;
+        // decode 'length' bytes from 'src' into exactly 'dst_length' bytes of 'dst' - returns success
+        virtual bool Decode(const CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t dst_length) = 0;
+    };
+
+    class WorkerPool {
+    private:
+        std::vector<std::thread> _threads;
+        std::function<void(int)> _job;
+        int _job_count;
+        int _next;
+        int _done;
+        uint64_t _generation;
+        bool _stop;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::condition_variable _done_cond;
+
+        void Worker();
+        void RunJobs(std::function<void(int)>& job, int count, uint64_t generation);
+
+    public:
+        WorkerPool(int num_threads);
+        ~WorkerPool();
+
+        void ParallelFor(int count, std::function<void(int)> job);
+    };
+
+    void RegisterCodec(uint8_t id, Codec *codec);
+    Codec* GetCodec(uint8_t id);
+    double ValueRange(HpcStream::DataType type, const uint8_t *src, uint64_t count);
+    uint64_t MaxEncodedBlocksSize(Codec *codec, uint64_t length, uint64_t block_size);
+    uint64_t EncodeBlocks(Codec *codec, const CodecContext& ctx, const uint8_t *src, uint64_t length, uint64_t block_size, uint8_t *dst, WorkerPool *workers);
+    bool DecodeBlocks(Codec *codec, const CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t dst_length);
+}
+
+#endif // __HPCSTREAM_CODEC_H_
@@ -0,0 +1,24 @@
+#ifndef __HPCSTREAM_FILTER_H_
+#define __HPCSTREAM_FILTER_H_
+
+#include <iostream>
+#include <cstring>
+#include "hpcstream.h"
+
+namespace HpcStream {
+    enum FilterId : uint8_t {NoFilter = 0, ByteShuffle = 1, BitShuffle = 2};
+
+    // reorder 'count' elements of 'size' bytes so that bytes of equal significance are stored together
+    void ShuffleBytes(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+    void UnshuffleBytes(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+    // byte shuffle followed by grouping bits of equal significance within each byte plane
+    void ShuffleBits(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+    void UnshuffleBits(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+    // reverse the byte order of 'count' elements of 'size' bytes ('src' and 'dst' may be the same buffer)
+    void SwapBytes(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+    // apply or undo filter 'id' ('dst' and 'src' must not overlap)
+    void ApplyFilter(uint8_t id, const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+    void RemoveFilter(uint8_t id, const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size);
+}
+
+#endif // __HPCSTREAM_FILTER_H_
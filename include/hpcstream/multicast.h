@@ -0,0 +1,78 @@
+#ifndef __HPCSTREAM_MULTICAST_H_
+#define __HPCSTREAM_MULTICAST_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <netinet/in.h>
+#include "hpcstream.h"
+
+namespace HpcStream {
+    // datagram: [uint64 message id][uint32 fragment][uint32 fragment count][payload] (payload of every fragment but the
+    // last is HPCSTREAM_DATAGRAM_PAYLOAD bytes)
+    // sends each message once to a UDP multicast group - a copy is kept for a few steps to resend fragments clients missed
+    class McastSender {
+    private:
+        typedef struct SentMessage {
+            uint64_t step;
+            std::vector<uint8_t> data;
+        } SentMessage;
+
+        int _fd;
+        struct sockaddr_in _group;
+        uint64_t _next_id;
+        std::map<uint64_t, SentMessage> _history;
+
+        McastSender(int fd, const struct sockaddr_in& group);
+        void SendFragments(uint64_t id, const std::vector<uint8_t>& data, const std::vector<uint32_t>& fragments);
+
+    public:
+        ~McastSender();
+
+        // socket sending to 'group':'port' from the interface with address 'iface' (all zero: system default) - NULL on failure
+        static McastSender* Create(const char *group, uint16_t port, const uint8_t iface[4]);
+
+        // multicast a message belonging to 'step' - returns the id clients receive it by
+        uint64_t Send(const uint8_t *message, uint64_t length, uint64_t step);
+        // multicast the listed fragments of a message again - false if it is no longer held
+        bool Resend(uint64_t id, const std::vector<uint32_t>& fragments);
+        // let go of the messages of steps before 'step'
+        void Forget(uint64_t step);
+    };
+
+    // member of a multicast group reassembling the messages it is told about
+    class McastReceiver {
+    private:
+        typedef struct Partial {
+            uint8_t *data;
+            uint32_t count;
+            uint32_t remaining;
+            std::vector<bool> have;
+            bool claimed;                 // asked for by Receive() (otherwise counted in _unclaimed)
+        } Partial;
+
+        int _fd;
+        uint64_t _next_id;
+        uint64_t _unclaimed;
+        std::map<uint64_t, Partial> _partial;
+
+        McastReceiver(int fd);
+        void ReadDatagrams();
+        void Forget(std::map<uint64_t, Partial>::iterator partial);
+
+    public:
+        ~McastReceiver();
+
+        // join 'group' on 'port' through the interface with address 'iface' - NULL on failure
+        static McastReceiver* Join(const std::string& group, uint16_t port, const std::string& iface);
+
+        // message 'id' once all its fragments arrived (caller frees it) - NULL if some are still missing after 'timeout'
+        // milliseconds without new datagrams, with their indices in 'missing'
+        uint8_t* Receive(uint64_t id, uint64_t length, int timeout, std::vector<uint32_t>& missing);
+        // stop waiting for message 'id' (and every earlier one)
+        void Skip(uint64_t id);
+    };
+}
+
+#endif // __HPCSTREAM_MULTICAST_H_
@@ -0,0 +1,40 @@
+#ifndef __HPCSTREAM_REGION_H_
+#define __HPCSTREAM_REGION_H_
+
+#include <iostream>
+#include <cstring>
+#include <functional>
+#include "hpcstream.h"
+#include "hpcstream/filter.h"
+
+namespace HpcStream {
+    enum SampleFilter : uint8_t {Nearest, Box, Linear};
+
+    // whether 'length' bytes at 'a' and 'b' differ
+    bool BytesDiffer(const uint8_t *a, const uint8_t *b, uint64_t length);
+    // call 'row' with the byte offset and byte length of each contiguous row of a box within a local array
+    // (first dimension varies fastest)
+    void ForEachBoxRow(uint32_t dims, const uint32_t *l_size, uint32_t size, const uint32_t *box_offset, const uint32_t *box_size,
+                       std::function<void(uint64_t, uint64_t)> row);
+    // copy a box of a local array into contiguous 'dst'
+    void CopyBox(const uint8_t *src, uint32_t dims, const uint32_t *l_size, uint32_t size, const uint32_t *box_offset, const uint32_t *box_size, uint8_t *dst);
+    // intersect two boxes (offsets and sizes in global coordinates) - returns false if they do not overlap
+    bool IntersectBoxes(uint32_t dims, const uint32_t *a_offset, const uint32_t *a_size, const uint32_t *b_offset, const uint32_t *b_size,
+                        uint32_t *offset, uint32_t *size);
+    // box (global offset and size) of the samples taken from a box of a local array when keeping elements whose global index
+    // is a multiple of 'factor' in each dimension
+    void SubsampledBox(uint32_t dims, const uint32_t *l_offset, const uint32_t *box_offset, const uint32_t *box_size, const uint32_t *factor,
+                       uint32_t *offset, uint32_t *size);
+    // write the samples of a box of a local array to contiguous 'dst', averaging the elements up to the next sample (Box) or
+    // weighting the elements up to the neighboring samples (Linear)
+    void SubsampleBox(const uint8_t *src, HpcStream::DataType type, uint32_t dims, const uint32_t *l_size, const uint32_t *l_offset,
+                      const uint32_t *box_offset, const uint32_t *box_size, const uint32_t *factor, SampleFilter filter, uint8_t *dst);
+    // delta tiles: [uint32 num tiles] then for each changed tile [uint32 offset per dim][uint32 size per dim][tile values]
+    uint64_t MaxDeltaTilesSize(uint32_t dims, const uint32_t *l_size, uint32_t size, uint32_t tile_size);
+    // write tiles of 'val' that differ from 'prev' to 'dst' and copy them into 'prev' - returns delta size
+    uint64_t EncodeDeltaTiles(const uint8_t *val, uint8_t *prev, uint32_t dims, const uint32_t *l_size, uint32_t size, uint32_t tile_size, uint8_t *dst);
+    // patch tiles from 'src' into 'val' (reversing the byte order of each element if 'swap_bytes') - returns success
+    bool ApplyDeltaTiles(const uint8_t *src, uint64_t length, uint8_t *val, uint32_t dims, const uint32_t *l_size, uint32_t size, bool swap_bytes = false);
+}
+
+#endif // __HPCSTREAM_REGION_H_
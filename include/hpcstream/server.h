@@ -8,18 +8,43 @@
 #include <map>
 #include <algorithm>
 #include <random>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
 #include <ifaddrs.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <mpi.h>
 #include <netsocket/server.h>
 #include "hpcstream.h"
+#include "hpcstream/codec.h"
+#include "hpcstream/region.h"
+#include "hpcstream/shm.h"
+#include "hpcstream/uring.h"
+#include "hpcstream/multicast.h"
 
 class HpcStream::Server {
 public:
     enum StreamBehavior : uint8_t {WaitForAll, DropFrames};
+    typedef uint64_t WriteRequest;
 
 private:
-    enum ClientState : uint8_t {Connecting, Handshake, Streaming, Finished};
+    enum ClientState : uint8_t {Connecting, Handshake, Subscribing, Streaming, Finished};
+    enum SizeRole : uint8_t {GlobalSize, LocalSize, LocalOffset};
+    typedef struct SizeDep {
+        HpcStream::VarHandle var;         // array whose size or offset is defined by the ArraySize variable
+        SizeRole role;
+        uint32_t dim;
+    } SizeDep;
     typedef struct SharedVar {
+        std::string name;                 // variable name
         HpcStream::DataType type;         // base data type for each element
         uint32_t dims;                    // array dimensions
         std::vector<std::string> gs_vars; // names of vars to define global size of array
@@ -28,12 +53,48 @@ private:
         uint32_t *g_size;                 // array of global array sizes
         uint32_t *l_size;                 // array of local array sizes
         uint32_t *l_offset;               // array of local array offsets
-        uint8_t *send_buf;                // byte buffer for variable name and value(s)
-        uint8_t *val;                     // byte buffer for variable value(s)
+        uint8_t *send_buf;                // byte buffer for variable name and value(s) (current slot)
+        uint8_t *val;                     // byte buffer for variable value(s) (current slot)
         uint32_t size;                    // size of single element (bytes)
         int64_t length;                   // number of local elements
         bool updated;                     // whether or not the variable has been updated since last send
+        std::vector<uint8_t*> send_bufs;  // ring of send buffers, one per step that may be in flight
+        std::vector<int> sends_pending;   // number of unfinished sends (and queued steps) using each slot
+        int slot;                         // ring slot holding the most recently set value
+        std::vector<SizeDep> size_deps;   // arrays that depend on this ArraySize variable
+        bool resize_pending;              // local size changed, buffers reallocated before next use
+        uint8_t codec;                    // codec id used to encode array values
+        uint8_t filter;                   // filter applied to array values before encoding
+        HpcStream::ErrorMode error_mode;  // whether the error bound of lossy codecs is absolute or relative to the value range
+        double error_bound;               // error allowed by lossy codecs
+        std::vector<uint8_t*> enc_bufs;   // encoded copy of each ring slot (header followed by encoded blocks)
+        std::vector<int64_t> enc_sizes;   // encoded message size per slot (-1: not encoded yet, 0: send raw)
+        uint32_t tile_size;               // edge length (elements) of tiles sent when changed (0: always send whole value)
+        uint8_t *prev_val;                // copy of the value most recently sent to connections
+        bool prev_valid;                  // whether prev_val holds a value connections have received
+        std::vector<uint8_t*> delta_bufs; // changed tiles of each ring slot (header followed by tiles)
     } SharedVar;
+    typedef struct BufferOwner {
+        HpcStream::VarHandle var;
+        int slot;
+    } BufferOwner;
+    typedef struct StepVar {
+        HpcStream::VarHandle var;
+        int slot;
+        uint64_t send_size;
+        bool updated;
+        uint8_t *blocks;                  // values of every rank in the sender's group (NULL: sent from the ring slot)
+        std::vector<uint32_t> l_size;     // local array sizes when the step was written (sizes may change before it is sent)
+        std::vector<uint32_t> l_offset;   // local array offsets when the step was written
+    } StepVar;
+    typedef struct Step {
+        WriteRequest id;
+        std::vector<StepVar> vars;
+    } Step;
+    typedef struct StepProgress {
+        int markers_pending;
+        int acks_pending;
+    } StepProgress;
     typedef struct Connection {
         uint64_t id;
         ClientState state;
@@ -42,39 +103,179 @@ private:
         int num_remote_ranks;
         bool is_new;
         bool has_same_endianness;
+        std::deque<WriteRequest> unacked; // steps sent but not yet released by the client when waiting for all
+        uint32_t window;                  // steps the client lets the server run ahead (credits granted)
+        std::vector<bool> subscribed;     // variables the client receives (empty until the client subscribes)
+        std::vector<bool> refresh;        // variables sent whole on the next step (newly subscribed, dropped or lost)
+        std::map<HpcStream::VarHandle, std::vector<uint32_t> > regions; // global box the client needs per array (offsets, then sizes)
+        std::map<HpcStream::VarHandle, std::vector<uint32_t> > samples; // subsampling factor per dimension, then filter, per array
+        WriteRequest sending_step;        // step whose end has not been sent yet when dropping frames (0: idle)
+        bool step_end_sent;               // end of that step went out (it is done once its data socket sends are too)
+        std::deque<Step> queued;          // newest steps waiting for the connection to finish sending (bounded, oldest dropped)
+        uint64_t dropped;                 // steps the connection never received
+        std::multimap<uint8_t*, uint8_t*> sends; // unfinished sends holding a message (pointer NetSocket reports when done -> message)
+        HpcStream::ShmRing *shm;          // ring offered to a client on the same node (NULL: socket only)
+        bool shm_ready;                   // whether the client mapped the ring
+        std::vector<int> bulk_fds;        // data sockets large values are striped over with io_uring (empty: socket only)
+        bool bulk_ready;                  // whether every data socket is connected
+        uint64_t bulk_token;              // identifies the client's data sockets when they connect (0: not offered)
+        std::chrono::steady_clock::time_point bulk_reported; // when the client reported its data sockets connected (epoch: not yet)
+        uint32_t bulk_pending;            // data socket sends not completed yet
+        bool mcast_ready;                 // whether the client joined the sender's multicast group
     } Connection;
+    typedef struct EventQueue {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<NetSocket::Server::Event> events; // client events read by the event thread
+        bool wake;                        // progress thread has work besides events (a queued step, stopping)
+        bool stop;                        // server stopped - events read from now on are dropped
+    } EventQueue;
+    typedef struct BulkHello {
+        int fd;                           // accepted data socket, not yet matched to a client
+        uint8_t data[sizeof(uint64_t) + sizeof(uint32_t)]; // [uint64 token][uint32 stream]
+        uint32_t received;
+        std::chrono::steady_clock::time_point accepted;
+    } BulkHello;
+    typedef struct BulkSend {
+        uint8_t *message;
+        std::string client_id;
+    } BulkSend;
 
     int _rank;
     int _num_ranks;
     uint16_t _port;
     MPI_Comm _comm;
+    MPI_Comm _group_comm;
+    int _group_rank;
+    int _group_size;
+    int _num_senders;
     uint8_t *_ip_address_list;
     uint16_t *_port_list;
+    uint32_t *_group_size_list;
+    uint8_t _ip_address[4];
+    int _num_rails;
+    std::vector<uint8_t> _rail_addresses;
+    uint64_t _shm_size;
+    uint32_t _shm_count;
+    HpcStream::UringSender *_uring;
+    int _bulk_listener;
+    uint16_t _bulk_port;
+    uint64_t _zerocopy_threshold;
+    uint32_t _bulk_streams;
+    uint64_t _stripe_size;
+    std::map<uint64_t, BulkSend> _bulk_sends; // data socket sends holding a message, by tag
+    std::vector<BulkHello> _bulk_hellos;
+    uint64_t _next_bulk_send;
+    HpcStream::McastSender *_mcast;
+    std::string _mcast_group;
+    uint16_t _mcast_port;
+    WriteRequest _mcast_step;
+    std::map<const uint8_t*, uint64_t> _mcast_sent;
     StreamBehavior _stream_behavior;
     int _initial_client_count;
     int _num_connections;
     HpcStream::Endian _endianness;
     uint32_t _vars_buffer_size;
     uint8_t *_vars_buffer;
-    std::map<std::string, SharedVar> _vars;
+    std::vector<SharedVar> _vars;
+    std::map<std::string, HpcStream::VarHandle> _var_handles;
     std::map<std::string, Connection> _connections;
+    std::map<uint8_t*, BufferOwner> _send_buf_owners;
+    std::map<uint8_t*, int> _shared_bufs;
     NetSocket::Server *_server;
+    uint32_t _num_write_buffers;
+    bool _async_write;
+    bool _step_frames;
+    uint32_t _send_queue_depth;
+    std::atomic<uint64_t> _dropped_frames;
+    WriteRequest _write_count;
+    std::atomic<WriteRequest> _write_complete;
+    std::deque<Step> _step_queue;
+    std::map<WriteRequest, StepProgress> _steps_in_flight;
+    std::map<uint8_t*, WriteRequest> _step_markers;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::thread _progress_thread;
+    std::thread _event_thread;
+    std::shared_ptr<EventQueue> _events;
+    bool _progress_stop;
+    bool _size_deps_built;
+    int _codec_threads;
+    uint64_t _codec_block_size;
+    HpcStream::WorkerPool *_codec_pool;
 
     void GenerateVarsBuffer();
+    void BuildSizeDependencies();
+    void ResizeArray(HpcStream::VarHandle handle);
+    void FreeVarBuffers(HpcStream::VarHandle handle);
+    void AllocateSendBuffers(HpcStream::VarHandle handle);
+    void AllocateDeltaBuffers(HpcStream::VarHandle handle);
+    void EncodeSlot(const StepVar& sv);
+    uint64_t CreateDeltaMessage(const StepVar& sv, WriteRequest step_id, bool delta_wanted);
+    uint64_t CodecBlockSize(const SharedVar& var);
+    void SendStep(Step& step);
+    void QueueStep(Connection& c, const Step& step);
+    void ReserveQueuedSlots();
+    void ReleaseQueuedStep(const Step& step);
+    void SendQueuedStep(Connection& c);
+    void DeliverStep(Step& step, const std::vector<Connection*>& targets, bool late);
+    bool GatherGroup(Step& step);
+    uint8_t* CreateStepFrame(Step& step, const std::vector<bool>& scalars, uint32_t *frame_size);
+    bool SendsVar(const Connection& c, HpcStream::VarHandle handle, bool updated);
+    bool SendsWholeVar(const Connection& c, HpcStream::VarHandle handle);
+    bool CropBox(const Connection& c, const StepVar& sv, std::vector<uint32_t>& box);
+    uint8_t* CreateCroppedMessage(const StepVar& sv, WriteRequest step_id, const std::vector<uint32_t>& box, uint64_t *message_size);
+    void SendMessage(Connection& c, uint8_t *buffer, uint64_t size);
+    void ShareBuffer(Connection& c, uint8_t *buffer, uint64_t size);
+    WriteRequest FinishSend(uint8_t *message);
+    void ReleaseBuffer(uint8_t *buffer);
+    void CompleteStep(WriteRequest id);
+    void ProgressThread();
+    void WakeProgressThread();
+    static void ReadEvents(NetSocket::Server *server, std::shared_ptr<EventQueue> queue);
+    bool ReadyForNextStep();
+    NetSocket::Server::Event NextEvent();
+    void ProcessEvent(NetSocket::Server::Event& event);
     bool HandleNewConnection(NetSocket::Server::Event& event);
+    void RemoveConnection(const std::string& client_id);
+    void OfferSharedMemory(const std::string& client_id, Connection& c);
+    bool SendShared(Connection& c, const uint8_t *message, uint64_t size);
+    void OpenBulkListener();
+    void OfferBulkSocket(Connection& c);
+    void AcceptBulkSockets();
+    bool SendBulk(Connection& c, const uint8_t *message, uint64_t size);
+    void ReapBulk();
+    bool OfferMulticast(Connection& c);
+    bool SendMulticast(Connection& c, const uint8_t *message, uint64_t size);
+    void ResendMulticast(const uint8_t *nack, uint64_t length);
+    void UpdateSubscriptions(const std::string& client_id, Connection& c, const uint8_t *ids, uint64_t length);
+    void StartStreaming(const std::string& client_id, Connection& c);
+    void UpdateRegion(Connection& c, HpcStream::VarHandle handle, const uint8_t *box, uint64_t length);
+    void UpdateSubsampling(Connection& c, HpcStream::VarHandle handle, const uint8_t *sample, uint64_t length);
+    void UpdateStepWindow(Connection& c, const uint8_t *window, uint64_t length);
+    void WaitForPendingSends(HpcStream::VarHandle handle, int slot);
     void GetIpAddress(const char *iface, uint8_t ip_address[4]);
     std::vector<std::string> ParseVarCounts(std::string counts);
 
 public:
-    Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm);
+    Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm, const HpcStream::ServerOptions& options = HpcStream::CreateServerOptions());
     ~Server();
 
     char* GetMasterIpAddress();
     uint16_t GetMasterPort();
-    void DefineVar(std::string name, HpcStream::DataType base_type, std::string global_size, std::string local_size, std::string local_offset);
+    HpcStream::VarHandle DefineVar(std::string name, HpcStream::DataType base_type, std::string global_size, std::string local_size, std::string local_offset, uint8_t codec = HpcStream::CodecId::NoCodec, uint8_t filter = HpcStream::FilterId::NoFilter);
+    HpcStream::VarHandle GetVarHandle(std::string name);
     void VarDefinitionsComplete(StreamBehavior behavior, int initial_wait_count);
+    void SetErrorBound(std::string name, HpcStream::ErrorMode mode, double bound);
+    void SetErrorBound(HpcStream::VarHandle handle, HpcStream::ErrorMode mode, double bound);
+    void SetDeltaTiles(std::string name, uint32_t tile_size);
+    void SetDeltaTiles(HpcStream::VarHandle handle, uint32_t tile_size);
     void SetValue(std::string name, void *value);
-    void Write();
+    void SetValue(HpcStream::VarHandle handle, void *value);
+    WriteRequest Write();
+    bool TestWrite(WriteRequest request);
+    void WaitWrite(WriteRequest request);
+    uint64_t GetDroppedFrameCount();
     void AdvanceTimeStep();
 };
 
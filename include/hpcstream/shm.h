@@ -0,0 +1,48 @@
+#ifndef __HPCSTREAM_SHM_H_
+#define __HPCSTREAM_SHM_H_
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include "hpcstream.h"
+
+namespace HpcStream {
+    // single producer, single consumer ring of messages in POSIX shared memory - the producer copies each message in
+    // whole and sends its position through the socket, the consumer releases space once done with it
+    class ShmRing {
+    private:
+        typedef struct Header {
+            uint64_t capacity;                // bytes of message space following the header
+            std::atomic<uint64_t> write_pos;  // end of the last message written (producer)
+            std::atomic<uint64_t> read_pos;   // end of the last message released (consumer)
+        } Header;
+
+        std::string _name;
+        Header *_header;
+        uint8_t *_data;
+        uint64_t _map_size;
+        bool _linked;
+
+        ShmRing(const std::string& name, void *map, uint64_t map_size, bool linked);
+
+    public:
+        ~ShmRing();
+
+        // create a ring holding 'capacity' bytes (producer) - NULL on failure
+        static ShmRing* Create(const std::string& name, uint64_t capacity);
+        // map a ring created by another process (consumer) - NULL on failure
+        static ShmRing* Open(const std::string& name);
+
+        const std::string& Name();
+        // remove the name once both processes have mapped the ring
+        void Unlink();
+        // copy a message into the ring - returns false if there is not enough free space
+        bool Write(const uint8_t *message, uint64_t length, uint64_t *position);
+        // message written at 'position' - NULL if it does not lie within the ring
+        const uint8_t* Data(uint64_t position, uint64_t length);
+        // free the space of every message up to 'position'
+        void Release(uint64_t position);
+    };
+}
+
+#endif // __HPCSTREAM_SHM_H_
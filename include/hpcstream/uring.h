@@ -0,0 +1,94 @@
+#ifndef __HPCSTREAM_URING_H_
+#define __HPCSTREAM_URING_H_
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <linux/io_uring.h>
+#include "hpcstream.h"
+
+namespace HpcStream {
+    // sends on sockets through a Linux io_uring - submitted right away, completions are reaped by a thread of its own
+    class UringSender {
+    public:
+        typedef struct Completion {
+            uint64_t tag;
+            bool failed;
+        } Completion;
+
+    private:
+        typedef struct PendingSend {
+            int fd;
+            const uint8_t *data;
+            uint64_t length;
+            uint64_t sent;
+            bool zerocopy;
+            bool in_flight;
+            bool failed;
+            uint32_t notifs;              // zero-copy notifications still to come (buffer still pinned)
+            uint64_t tag;
+        } PendingSend;
+
+        int _ring_fd;
+        void *_sq_map;
+        void *_cq_map;
+        size_t _sq_map_size;
+        size_t _cq_map_size;
+        struct io_uring_sqe *_sqes;
+        size_t _sqes_size;
+        uint32_t *_sq_head;
+        uint32_t *_sq_tail;
+        uint32_t *_sq_mask;
+        uint32_t *_sq_array;
+        uint32_t _sq_entries;
+        uint32_t *_cq_head;
+        uint32_t *_cq_tail;
+        uint32_t *_cq_mask;
+        struct io_uring_cqe *_cqes;
+        bool _zerocopy;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::thread _thread;
+        std::map<uint64_t, PendingSend> _sends;
+        std::map<int, std::deque<uint64_t> > _queues; // unfinished sends per socket (the first one in flight)
+        std::set<int> _closing;           // sockets closed once their send in flight completes
+        uint64_t _next_id;
+        uint32_t _completions_due;        // completions the kernel still owes (bounded by the ring size)
+        std::vector<Completion> _done;
+        std::function<void()> _on_complete;
+
+        UringSender();
+        void SubmitReady();
+        bool Submit(uint64_t id);
+        void FailQueue(int fd);
+        void Finish(uint64_t id);
+        void ReapThread();
+
+    public:
+        ~UringSender();
+
+        // set up a ring with room for 'entries' sends in flight - NULL if io_uring is not available
+        static UringSender* Create(uint32_t entries);
+
+        // called (from the reaping thread) whenever sends complete
+        void OnComplete(std::function<void()> callback);
+        // send 'length' bytes on 'fd' after those queued before - 'data' stays in use until 'tag' is reaped
+        void Send(int fd, const uint8_t *data, uint64_t length, bool zerocopy, uint64_t tag);
+        // fail the sends queued for 'fd' and close it (once the kernel let go of it)
+        void Close(int fd);
+        // sends completed since the last call - false if none
+        bool Reap(std::vector<Completion>& done);
+        // whether any send has not been reaped yet
+        bool Pending();
+        // wait up to 'timeout' milliseconds for a send to complete
+        void Wait(int timeout);
+    };
+}
+
+#endif // __HPCSTREAM_URING_H_
@@ -1,6 +1,6 @@
 #include "hpcstream/client.h"
 
-HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
+HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm, const std::vector<std::string>& subscriptions)
 {
     MPI_Comm_dup(comm, &_comm);
     int rc = MPI_Comm_rank(_comm, &_rank);
@@ -33,15 +33,20 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
     options.secure = false;
     // rank 0 receives host/port info for all other ranks
     int i;
+    HpcStream::Endian remote_endianness;
     uint8_t *remote_ip_addresses;
+    uint64_t remote_ip_length;
+    int num_rails;
     uint16_t *remote_ports;
+    uint32_t *remote_group_sizes;
     if (_rank == 0)
     {
         Connection c;
         c.client = new NetSocket::Client(host, port, options);
+        c.host = host;
         _connections.push_back(c);
         int received_server_info = 0;
-        while (received_server_info < 3)
+        while (received_server_info < 4)
         {
             NetSocket::Client::Event event = c.client->WaitForNextEvent();
             switch (event.type)
@@ -49,22 +54,20 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
                 case NetSocket::Client::EventType::ReceiveBinary:
                     if (received_server_info == 0)      // endianness
                     {
-                        HpcStream::Endian remote_endianness = (HpcStream::Endian)(*((uint8_t*)event.binary_data));
-                        if (remote_endianness != _endianness)
-                        {
-                            fprintf(stderr, "Warning: remote machine's endianness does not match\n");
-                        }
+                        remote_endianness = (HpcStream::Endian)(*((uint8_t*)event.binary_data));
                         delete[] event.binary_data;
                         received_server_info++;
                     }
-                    else if (received_server_info == 1) // ip addresses
+                    else if (received_server_info == 1) // ip addresses (one per rail)
                     {
-                        _num_remote_ranks = event.data_length / 4;
                         remote_ip_addresses = (uint8_t*)event.binary_data;
+                        remote_ip_length = event.data_length;
                         received_server_info++;
                     }
-                    else                                // ports
+                    else if (received_server_info == 2) // ports
                     {
+                        _num_remote_ranks = event.data_length / sizeof(uint16_t);
+                        num_rails = std::max(remote_ip_length / (4 * std::max(_num_remote_ranks, 1)), (uint64_t)1);
                         remote_ports = (uint16_t*)event.binary_data;
                         for (i = 0; i<_num_remote_ranks; i++)
                         {
@@ -72,6 +75,15 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
                         }
                         received_server_info++;
                     }
+                    else                                // server ranks sending through each
+                    {
+                        remote_group_sizes = (uint32_t*)event.binary_data;
+                        for (i = 0; i<_num_remote_ranks; i++)
+                        {
+                            remote_group_sizes[i] = ntohl(remote_group_sizes[i]);
+                        }
+                        received_server_info++;
+                    }
                     break;
                 default:
                     break;
@@ -79,25 +91,30 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
         }
     }
     // share info with other ranks
-    MPI_Bcast(&_num_remote_ranks, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&remote_endianness, 1, MPI_UINT8_T, 0, _comm);
+    MPI_Bcast(&_num_remote_ranks, 1, MPI_INT, 0, _comm);
+    MPI_Bcast(&num_rails, 1, MPI_INT, 0, _comm);
     if (_rank != 0)
     {
-        remote_ip_addresses = new uint8_t[4 * _num_remote_ranks];
+        remote_ip_addresses = new uint8_t[4 * num_rails * _num_remote_ranks];
         remote_ports = new uint16_t[_num_remote_ranks];
+        remote_group_sizes = new uint32_t[_num_remote_ranks];
     }
-    MPI_Bcast(remote_ip_addresses, 4 * _num_remote_ranks, MPI_UINT8_T, 0, MPI_COMM_WORLD);
-    MPI_Bcast(remote_ports, _num_remote_ranks, MPI_UINT16_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(remote_ip_addresses, 4 * num_rails * _num_remote_ranks, MPI_UINT8_T, 0, _comm);
+    MPI_Bcast(remote_ports, _num_remote_ranks, MPI_UINT16_T, 0, _comm);
+    MPI_Bcast(remote_group_sizes, _num_remote_ranks, MPI_UINT32_T, 0, _comm);
     // determine which ranks connect to which
     int connections_per_rank = _num_remote_ranks / _num_ranks;
     int connections_extra = _num_remote_ranks % _num_ranks;
     int num_connections = connections_per_rank + (_rank < connections_extra ? 1 : 0);
     int connection_offset = _rank * connections_per_rank + std::min(_rank, connections_extra);
-    // make connections
+    // make connections - spread over the senders' rails (the first sender is reached through the given host)
     for (i = std::max(connection_offset, 1); i < connection_offset + num_connections; i++)
     {
-        struct in_addr addr = {*((in_addr_t*)(&(remote_ip_addresses[4*i])))};
+        struct in_addr addr = {*((in_addr_t*)(&(remote_ip_addresses[4 * (i * num_rails + i % num_rails)])))};
         Connection c;
         c.client = new NetSocket::Client(inet_ntoa(addr), remote_ports[i], options);
+        c.host = inet_ntoa(addr);
         NetSocket::Client::Event event = c.client->WaitForNextEvent();
         while (event.type != NetSocket::Client::EventType::Connect)
         {
@@ -110,7 +127,7 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
         _connections.push_back(c);
     }
     // create handshake data
-    uint8_t info_received[21];
+    uint8_t info_received[HPCSTREAM_HANDSHAKE_SIZE];
     if (_rank == 0)
     {
         uint32_t *info_remote_ranks = (uint32_t*)info_received;
@@ -122,13 +139,29 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
         *info_id = HpcStream::HToNLL(((uint64_t)ip.s_addr << 32) + (uint64_t)_connections[0].client->LocalPort());
         *info_ranks = htonl(_num_ranks);
     }
-    MPI_Bcast(info_received, 21, MPI_UINT8_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(info_received, HPCSTREAM_HANDSHAKE_SIZE, MPI_UINT8_T, 0, _comm);
     uint32_t *info_rank = (uint32_t*)info_received + 3;
     *info_rank = htonl(_rank);
     info_received[20] = _endianness;
+    info_received[21] = HPCSTREAM_PROTOCOL_VERSION;
     for (i = 0; i < num_connections; i++)
     {
-        _connections[i].client->Send(info_received, 21, NetSocket::CopyMode::MemCopy);
+        _connections[i].step = 0;
+        _connections[i].source = 0;
+        _connections[i].shm = NULL;
+        _connections[i].stripe_size = 0;
+        _connections[i].mcast = NULL;
+        _connections[i].bulk_readers = NULL;
+        _connections[i].rail = (connection_offset + i) % num_rails;
+        for (int r = 0; r < num_rails; r++)
+        {
+            struct in_addr addr = {*((in_addr_t*)(&(remote_ip_addresses[4 * ((connection_offset + i) * num_rails + r)])))};
+            _connections[i].rails.push_back(inet_ntoa(addr));
+        }
+        _connections[i].group_size = std::max(remote_group_sizes[connection_offset + i], 1u);
+        // receiver makes right - values are sent in the server's byte order and converted on arrival
+        _connections[i].swap_bytes = remote_endianness != _endianness;
+        _connections[i].client->Send(info_received, HPCSTREAM_HANDSHAKE_SIZE, NetSocket::CopyMode::MemCopy);
     }
     // receive variable declarations
     for (i = 0; i < num_connections; i++)
@@ -149,12 +182,22 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
                         SharedVar v;
                         uint32_t var_name_len = ntohl(*((uint32_t*)(data + vars_offset)));
                         vars_offset += sizeof(uint32_t);
-                        std::string var_name = std::string((char*)(data + vars_offset), var_name_len);
+                        v.name = std::string((char*)(data + vars_offset), var_name_len);
                         vars_offset += var_name_len;
+                        HpcStream::VarHandle var_id = ntohl(*((uint32_t*)(data + vars_offset)));
+                        vars_offset += sizeof(uint32_t);
                         v.dims = ntohl(*((uint32_t*)(data + vars_offset)));
                         vars_offset += sizeof(uint32_t);
                         v.type = (HpcStream::DataType)(*((uint8_t*)(data + vars_offset)));
                         vars_offset += sizeof(uint8_t);
+                        v.codec = *((uint8_t*)(data + vars_offset));
+                        vars_offset += sizeof(uint8_t);
+                        v.filter = *((uint8_t*)(data + vars_offset));
+                        vars_offset += sizeof(uint8_t);
+                        if (v.codec != HpcStream::CodecId::NoCodec && HpcStream::GetCodec(v.codec) == NULL)
+                        {
+                            fprintf(stderr, "[HpcStream] Error: no codec registered with id %u (%s)\n", v.codec, v.name.c_str());
+                        }
                         v.size = ntohl(*((uint32_t*)(data + vars_offset)));
                         vars_offset += sizeof(uint32_t);
                         v.length = HpcStream::NToHLL(*((int64_t*)(data + vars_offset)));
@@ -166,9 +209,13 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
                             v.g_size = new uint32_t[v.dims];
                             v.l_size = new uint32_t[v.dims];
                             v.l_offset = new uint32_t[v.dims];
+                            v.r_size = new uint32_t[v.dims];
+                            v.r_offset = new uint32_t[v.dims];
                             memset(v.g_size, 0, v.dims * sizeof(uint32_t));
                             memset(v.l_size, 0, v.dims * sizeof(uint32_t));
                             memset(v.l_offset, 0, v.dims * sizeof(uint32_t));
+                            memset(v.r_size, 0, v.dims * sizeof(uint32_t));
+                            memset(v.r_offset, 0, v.dims * sizeof(uint32_t));
                             for (j = 0; j < v.dims; j++)
                             {
                                 len = ntohl(*((uint32_t*)(data + vars_offset)));
@@ -199,8 +246,17 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
                         {
                             v.val = new uint8_t[v.size];
                         }
-                        _connections[i].vars[var_name] = v;
+                        v.resize_pending = false;
+                        v.stale = false;
+                        // variables are indexed by the id the server uses in message headers
+                        if (_connections[i].vars.size() <= var_id)
+                        {
+                            _connections[i].vars.resize(var_id + 1);
+                        }
+                        _connections[i].vars[var_id] = v;
+                        _var_handles[v.name] = var_id;
                     }
+                    BuildSizeDependencies(_connections[i].vars);
                     received_vars = true;
                     break;
                 default:
@@ -208,12 +264,152 @@ HpcStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm)
             }
         }
     }
+    // blocks of a sender aggregating several server ranks share its connection, each with its own copy of the variables
+    std::vector<Connection> blocks;
+    for (i = 0; i < num_connections; i++)
+    {
+        uint32_t b;
+        blocks.push_back(_connections[i]);
+        for (b = 1; b < _connections[i].group_size; b++)
+        {
+            Connection c = _connections[i];
+            c.source = b;
+            CopyVars(_connections[i].vars, c.vars);
+            blocks.push_back(c);
+        }
+    }
+    _connections = blocks;
+    // servers start streaming once the subscription set is known
+    Subscribe(subscriptions);
 }
 
 HpcStream::Client::~Client()
 {
 }
 
+void HpcStream::Client::Subscribe(const std::vector<std::string>& var_names)
+{
+    // empty list subscribes to every variable, arrays bring along the ArraySize variables that define them
+    int i;
+    if (_connections.empty())
+    {
+        return;
+    }
+    std::map<HpcStream::VarHandle, bool> subscribed;
+    for (auto const& h : _var_handles)
+    {
+        subscribed[h.second] = var_names.empty();
+    }
+    for (i = 0; i < var_names.size(); i++)
+    {
+        HpcStream::VarHandle h = GetVarHandle(var_names[i]);
+        if (h == HPCSTREAM_INVALID_HANDLE)
+        {
+            continue;
+        }
+        subscribed[h] = true;
+        const SharedVar& x = _connections[0].vars[h];
+        const std::vector<std::string> *count_vars[3] = {&(x.gs_vars), &(x.ls_vars), &(x.lo_vars)};
+        for (auto const& counts : count_vars)
+        {
+            for (auto const& name : *counts)
+            {
+                std::map<std::string, HpcStream::VarHandle>::iterator it = _var_handles.find(name);
+                if (it != _var_handles.end())
+                {
+                    subscribed[it->second] = true;
+                }
+            }
+        }
+    }
+    // message payload: [var id] for each subscribed variable
+    std::vector<uint32_t> ids;
+    for (auto const& h : subscribed)
+    {
+        if (h.second)
+        {
+            ids.push_back(htonl(h.first));
+        }
+    }
+    uint64_t payload_size = ids.size() * sizeof(uint32_t);
+    uint8_t *message = new uint8_t[HPCSTREAM_HEADER_SIZE + payload_size];
+    HpcStream::WriteMessageHeader(message, MessageType::Subscribe, 0, 0, payload_size);
+    memcpy(message + HPCSTREAM_HEADER_SIZE, ids.data(), payload_size);
+    for (i = 0; i < _connections.size(); i++)
+    {
+        if (_connections[i].source == 0)
+        {
+            _connections[i].client->Send(message, HPCSTREAM_HEADER_SIZE + payload_size, NetSocket::CopyMode::MemCopy);
+        }
+    }
+    delete[] message;
+}
+
+void HpcStream::Client::SetSubsampling(std::string var_name, const uint32_t *factors, HpcStream::SampleFilter filter)
+{
+    HpcStream::VarHandle var = GetVarHandle(var_name);
+    if (var != HPCSTREAM_INVALID_HANDLE)
+    {
+        SetSubsampling(var, factors, filter);
+    }
+}
+
+void HpcStream::Client::SetSubsampling(HpcStream::VarHandle var, const uint32_t *factors, HpcStream::SampleFilter filter)
+{
+    // every rank requests the same factors - servers then keep every factors[i]-th element in each dimension, and
+    // global sizes and selections refer to the reduced array
+    int i, j;
+    if (_connections.empty() || _connections[0].vars[var].gs_vars.size() == 0)
+    {
+        return;
+    }
+    if (std::any_of(_connections.begin(), _connections.end(), [](const Connection& c) {return c.group_size > 1;}))
+    {
+        fprintf(stderr, "[HpcStream] Warning: subsampling is not supported by servers aggregating ranks (%s)\n", _connections[0].vars[var].name.c_str());
+        return;
+    }
+    uint32_t dims = _connections[0].vars[var].dims;
+    uint64_t payload_size = dims * sizeof(uint32_t) + sizeof(uint8_t);
+    std::vector<uint8_t> request(HPCSTREAM_HEADER_SIZE + payload_size);
+    HpcStream::WriteMessageHeader(request.data(), MessageType::Subsample, var, 0, payload_size);
+    for (j = 0; j < dims; j++)
+    {
+        uint32_t net_factor = htonl(std::max(factors[j], 1u));
+        memcpy(request.data() + HPCSTREAM_HEADER_SIZE + j * sizeof(uint32_t), &net_factor, sizeof(uint32_t));
+    }
+    request[HPCSTREAM_HEADER_SIZE + dims * sizeof(uint32_t)] = filter;
+    for (i = 0; i < _connections.size(); i++)
+    {
+        _connections[i].vars[var].sample.assign(factors, factors + dims);
+        for (j = 0; j < dims; j++)
+        {
+            _connections[i].vars[var].sample[j] = std::max(factors[j], 1u);
+        }
+        if (_connections[i].source == 0)
+        {
+            _connections[i].client->Send(request.data(), request.size(), NetSocket::CopyMode::MemCopy);
+        }
+    }
+}
+
+void HpcStream::Client::SetStepWindow(uint32_t steps)
+{
+    // servers waiting for all clients may send this many steps before the oldest is released (default 1) - later
+    // steps wait in the connection until read, hiding the round trip of each release
+    int i;
+    uint8_t request[HPCSTREAM_HEADER_SIZE + sizeof(uint32_t)];
+    uint32_t net_steps = htonl(std::max(steps, 1u));
+    HpcStream::WriteMessageHeader(request, MessageType::StepWindow, 0, 0, sizeof(uint32_t));
+    memcpy(request + HPCSTREAM_HEADER_SIZE, &net_steps, sizeof(uint32_t));
+    for (i = 0; i < _connections.size(); i++)
+    {
+        if (_connections[i].source == 0)
+        {
+            _connections[i].client->Send(request, HPCSTREAM_HEADER_SIZE + sizeof(uint32_t), NetSocket::CopyMode::MemCopy);
+        }
+    }
+}
+
 void HpcStream::Client::Read()
 {
     int i, j;
@@ -222,15 +418,22 @@ void HpcStream::Client::Read()
     memset(receive_data, 0, num_connections * sizeof(bool));
     bool all_received = false;
 
+    // one thread per sender, reading the blocks of every server rank it sends for
     std::thread *read_threads = new std::thread[num_connections];
     for (i = 0; i < num_connections; i++)
     {
-        read_threads[i] = std::thread(&HpcStream::Client::ConnectionRead, this, i); 
+        if (_connections[i].source == 0)
+        {
+            read_threads[i] = std::thread(&HpcStream::Client::ConnectionRead, this, i); 
+        }
     }
 
     for (i = 0; i < num_connections; i++)
     {
-        read_threads[i].join(); 
+        if (read_threads[i].joinable())
+        {
+            read_threads[i].join(); 
+        }
     }
 
     delete[] read_threads;
@@ -308,101 +511,650 @@ void HpcStream::Client::Read()
     delete[] receive_data;
 }
 
+void HpcStream::Client::BuildSizeDependencies(std::vector<SharedVar>& vars)
+{
+    int role;
+    uint32_t i;
+    HpcStream::VarHandle h;
+    for (h = 0; h < vars.size(); h++)
+    {
+        const std::vector<std::string> *count_vars[3] = {&(vars[h].gs_vars), &(vars[h].ls_vars), &(vars[h].lo_vars)};
+        for (role = 0; role < 3; role++)
+        {
+            for (i = 0; i < count_vars[role]->size(); i++)
+            {
+                std::map<std::string, HpcStream::VarHandle>::iterator it = _var_handles.find((*count_vars[role])[i]);
+                if (it != _var_handles.end())
+                {
+                    vars[it->second].size_deps.push_back({h, static_cast<SizeRole>(role), i});
+                }
+            }
+        }
+    }
+}
+
+void HpcStream::Client::CopyVars(const std::vector<SharedVar>& vars, std::vector<SharedVar>& copy)
+{
+    // copies own their sizes and values
+    uint32_t i;
+    copy = vars;
+    for (auto& x : copy)
+    {
+        if (x.gs_vars.size() > 0)
+        {
+            uint32_t **sizes[5] = {&(x.g_size), &(x.l_size), &(x.l_offset), &(x.r_size), &(x.r_offset)};
+            for (i = 0; i < 5; i++)
+            {
+                uint32_t *size = new uint32_t[x.dims];
+                memcpy(size, *(sizes[i]), x.dims * sizeof(uint32_t));
+                *(sizes[i]) = size;
+            }
+            x.val = NULL;
+            x.length = 0;
+        }
+        else if (x.val != NULL)
+        {
+            uint8_t *val = new uint8_t[x.size];
+            memcpy(val, x.val, x.size);
+            x.val = val;
+        }
+    }
+}
+
+void HpcStream::Client::ResizeArray(SharedVar& var)
+{
+    int i;
+    int64_t length = 1;
+    for (i = 0; i < var.dims; i++)
+    {
+        length *= var.l_size[i];
+    }
+    var.resize_pending = false;
+    // only allocate local value array once all local sizes are non-zero
+    if (length > 0)
+    {
+        SetReceivedBox(var, var.l_offset, var.l_size);
+    }
+}
+
+void HpcStream::Client::SetReceivedBox(SharedVar& var, const uint32_t *offset, const uint32_t *size)
+{
+    int i;
+    int64_t length = 1;
+    for (i = 0; i < var.dims; i++)
+    {
+        var.r_offset[i] = offset[i];
+        var.r_size[i] = size[i];
+        length *= size[i];
+    }
+    if (var.val == NULL || length != var.length)
+    {
+        if (var.val != NULL) delete[] var.val;
+        var.length = length;
+        var.val = new uint8_t[std::max(var.size * var.length, (int64_t)1)];
+    }
+}
+
 void HpcStream::Client::ConnectionRead(int connection_idx)
 {
+    // reads the step for every block the connection's sender streams
     int i;
+    uint32_t b;
     bool receive_data = false;
+    Connection& conn = _connections[connection_idx];
+    std::vector<SharedVar>& vars = conn.vars;
+    bool swap_bytes = conn.swap_bytes;
+    // arrays are held until the end of the step, once the scalars defining their sizes are known
+    std::vector<HeldValue> held_arrays;
+    std::vector<uint8_t*> held_messages;
+    uint64_t shm_end = 0;
     while (!receive_data)
     {
-        NetSocket::Client::Event event;
-        do
-        {
-            event = _connections[connection_idx].client->WaitForNextEvent();
-        } while (event.type != NetSocket::Client::EventType::ReceiveBinary);
-        
-        if (event.data_length > 4) // variable value
-        {
-            uint32_t name_len = *((uint32_t*)event.binary_data);
-            std::string name = std::string((char*)event.binary_data + sizeof(uint32_t), name_len);
-            int offset = sizeof(uint32_t) + name_len;
-            memcpy(_connections[connection_idx].vars[name].val, (uint8_t*)event.binary_data + offset, event.data_length - offset);
-            // if array size, copy value to respective arrays
-            if (_connections[connection_idx].vars[name].dims == 1 && _connections[connection_idx].vars[name].length == 1 
-                && _connections[connection_idx].vars[name].type == HpcStream::DataType::ArraySize)
+        uint64_t received_length;
+        uint8_t *received = ReceiveMessage(conn, &received_length);
+        const uint8_t *data = received;
+        bool hold = false;
+        bool lost = false;
+        HpcStream::MessageHeader header;
+        bool valid = HpcStream::ReadMessageHeader(data, received_length, &header);
+        if (valid && header.type == MessageType::BulkRef)
+        {
+            // message sent over the data socket, in the order of the references: [uint64 length]
+            uint64_t length = header.length == sizeof(uint64_t) ? HpcStream::NToHLL(*((uint64_t*)(data + HPCSTREAM_HEADER_SIZE))) : 0;
+            delete[] received;
+            received = ReadBulk(conn, length);
+            data = received;
+            valid = data != NULL && HpcStream::ReadMessageHeader(data, length, &header);
+        }
+        else if (valid && header.type == MessageType::McastRef)
+        {
+            // message multicast by the sender: [uint64 message id][uint64 length]
+            uint64_t id = 0;
+            uint64_t length = 0;
+            if (header.length == 2 * sizeof(uint64_t))
+            {
+                id = HpcStream::NToHLL(*((uint64_t*)(data + HPCSTREAM_HEADER_SIZE)));
+                length = HpcStream::NToHLL(*((uint64_t*)(data + HPCSTREAM_HEADER_SIZE + sizeof(uint64_t))));
+            }
+            HpcStream::VarHandle ref_var = header.var;
+            delete[] received;
+            received = ReadMulticast(conn, id, length);
+            data = received;
+            valid = data != NULL && HpcStream::ReadMessageHeader(data, length, &header);
+            if (data == NULL && ref_var < vars.size())
+            {
+                // value is lost - changed tiles are skipped until the sender, asked here, sends it whole again
+                fprintf(stderr, "[HpcStream] Warning: lost multicast value of %s, requesting it whole\n", vars[ref_var].name.c_str());
+                vars[ref_var].stale = true;
+                uint8_t refresh[HPCSTREAM_HEADER_SIZE];
+                HpcStream::WriteMessageHeader(refresh, MessageType::Refresh, ref_var, 0, 0);
+                conn.client->Send(refresh, HPCSTREAM_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+                lost = true;
+            }
+        }
+        if (valid && header.type == MessageType::ShmRef)
+        {
+            // message copied into the shared-memory ring by a server on the same node: [uint64 ring position][uint64 length]
+            uint64_t position = 0;
+            uint64_t length = 0;
+            if (header.length == 2 * sizeof(uint64_t))
+            {
+                position = HpcStream::NToHLL(*((uint64_t*)(data + HPCSTREAM_HEADER_SIZE)));
+                length = HpcStream::NToHLL(*((uint64_t*)(data + HPCSTREAM_HEADER_SIZE + sizeof(uint64_t))));
+            }
+            data = conn.shm != NULL ? conn.shm->Data(position, length) : NULL;
+            valid = data != NULL && HpcStream::ReadMessageHeader(data, length, &header);
+            shm_end = position + length;
+        }
+        if (!valid)
+        {
+            if (!lost)
             {
-                for (auto& x : _connections[connection_idx].vars)
+                fprintf(stderr, "[HpcStream] Error: received malformed message\n");
+            }
+        }
+        else if (header.type == MessageType::ShmOpen)
+        {
+            // ring offered by a server on the same node - the server uses it once told it is mapped
+            if (conn.shm == NULL)
+            {
+                conn.shm = HpcStream::ShmRing::Open(std::string((const char*)(data + HPCSTREAM_HEADER_SIZE), header.length));
+            }
+            if (conn.shm != NULL)
+            {
+                uint8_t mapped[HPCSTREAM_HEADER_SIZE];
+                HpcStream::WriteMessageHeader(mapped, MessageType::ShmOpen, 0, 0, 0);
+                conn.client->Send(mapped, HPCSTREAM_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+            }
+        }
+        else if (header.type == MessageType::BulkOpen)
+        {
+            OpenBulkSocket(conn, data + HPCSTREAM_HEADER_SIZE, header.length);
+        }
+        else if (header.type == MessageType::McastOpen)
+        {
+            JoinMulticast(conn, data + HPCSTREAM_HEADER_SIZE, header.length);
+        }
+        else if (header.type == MessageType::VarData && (header.flags & MessageFlags::Blocks) && header.var < vars.size())
+        {
+            // values of every server rank in the sender's group: [uint32 block count][uint64 length per block][values]
+            uint32_t count = header.length >= sizeof(uint32_t) ? ntohl(*((uint32_t*)(data + HPCSTREAM_HEADER_SIZE))) : 0;
+            uint64_t offset = HPCSTREAM_HEADER_SIZE + sizeof(uint32_t) + (uint64_t)count * sizeof(uint64_t);
+            bool valid = count == conn.group_size && offset <= HPCSTREAM_HEADER_SIZE + header.length;
+            for (b = 0; b < count && valid; b++)
+            {
+                uint64_t length = HpcStream::NToHLL(*((uint64_t*)(data + HPCSTREAM_HEADER_SIZE + sizeof(uint32_t) + b * sizeof(uint64_t))));
+                valid = offset + length <= HPCSTREAM_HEADER_SIZE + header.length;
+                if (valid && length > 0)
                 {
-                    uint32_t pos = find(x.second.gs_vars.begin(), x.second.gs_vars.end(), name) - x.second.gs_vars.begin();
-                    if (pos < x.second.gs_vars.size())
+                    std::vector<SharedVar>& block_vars = _connections[connection_idx + b].vars;
+                    if (block_vars[header.var].gs_vars.size() > 0)
                     {
-                        x.second.g_size[pos] = *((uint32_t*)_connections[connection_idx].vars[name].val);
+                        held_arrays.push_back({connection_idx + (int)b, header.var, data + offset, length, 0});
                     }
-                    pos = find(x.second.ls_vars.begin(), x.second.ls_vars.end(), name) - x.second.ls_vars.begin();
-                    if (pos < x.second.ls_vars.size())
+                    else
                     {
-                        x.second.l_size[pos] = *((uint32_t*)_connections[connection_idx].vars[name].val);
-                        // allocate local value array if all local sizes are non-zero
-                        bool non_zero = true;
-                        uint32_t length = 1;
-                        for (i = 0; i < x.second.dims; i++)
-                        {
-                            non_zero &= x.second.l_size[i] != 0;
-                            length *= x.second.l_size[i];
-                        }
-                        if (non_zero)
-                        {
-                            if (x.second.val != NULL) delete[] x.second.val;
-                            x.second.length = length;
-                            x.second.val = new uint8_t[x.second.size * x.second.length];
-                        }
+                        StoreValue(block_vars, block_vars[header.var], data + offset, length, 0, swap_bytes);
                     }
-                    pos = find(x.second.lo_vars.begin(), x.second.lo_vars.end(), name) - x.second.lo_vars.begin();
-                    if (pos < x.second.lo_vars.size())
+                    offset += length;
+                }
+            }
+            if (!valid)
+            {
+                fprintf(stderr, "[HpcStream] Error: received malformed blocks of %s\n", vars[header.var].name.c_str());
+            }
+            hold = true;
+        }
+        else if (header.type == MessageType::VarData && header.var < vars.size()) // variable value
+        {
+            if (vars[header.var].gs_vars.size() > 0)
+            {
+                held_arrays.push_back({connection_idx, header.var, data + HPCSTREAM_HEADER_SIZE, header.length, header.flags});
+                hold = true;
+            }
+            else
+            {
+                StoreValue(vars, vars[header.var], data + HPCSTREAM_HEADER_SIZE, header.length, header.flags, swap_bytes);
+            }
+        }
+        else if (header.type == MessageType::StepEnd || header.type == MessageType::StepFrame) // end notification
+        {
+            // step frame: [var id][value] for each scalar
+            uint64_t offset = HPCSTREAM_HEADER_SIZE;
+            while (header.type == MessageType::StepFrame && offset + sizeof(uint32_t) <= HPCSTREAM_HEADER_SIZE + header.length)
+            {
+                HpcStream::VarHandle id = ntohl(*((uint32_t*)(data + offset)));
+                offset += sizeof(uint32_t);
+                if (id >= vars.size() || offset + vars[id].size > HPCSTREAM_HEADER_SIZE + header.length)
+                {
+                    fprintf(stderr, "[HpcStream] Error: received malformed step frame\n");
+                    break;
+                }
+                StoreValue(vars, vars[id], data + offset, vars[id].size, 0, swap_bytes);
+                offset += vars[id].size;
+            }
+            for (b = 0; b < conn.group_size; b++)
+            {
+                _connections[connection_idx + b].step = header.step;
+                for (auto& x : _connections[connection_idx + b].vars)
+                {
+                    if (x.resize_pending)
                     {
-                        x.second.l_offset[pos] = *((uint32_t*)_connections[connection_idx].vars[name].val);
+                        ResizeArray(x);
                     }
                 }
             }
+            for (i = 0; i < held_arrays.size(); i++)
+            {
+                std::vector<SharedVar>& block_vars = _connections[held_arrays[i].connection].vars;
+                StoreValue(block_vars, block_vars[held_arrays[i].var], held_arrays[i].data, held_arrays[i].length, held_arrays[i].flags, swap_bytes);
+            }
+            for (i = 0; i < held_messages.size(); i++)
+            {
+                delete[] held_messages[i];
+            }
+            if (conn.shm != NULL && shm_end > 0)
+            {
+                conn.shm->Release(shm_end);
+            }
+            receive_data = true;
         }
-        else if (event.data_length == 1 && *((uint8_t*)event.binary_data) == 255) // end notification
+        // held messages are freed at the end of the step (those in the ring are released with it)
+        if (hold && data == received)
         {
-            receive_data = true;
+            held_messages.push_back(received);
+        }
+        else
+        {
+            delete[] received;
+        }
+    }
+}
+
+uint8_t* HpcStream::Client::ReceiveMessage(Connection& conn, uint64_t *length)
+{
+    // messages larger than NetSocket sends at once arrive in pieces (HPCSTREAM_SEND_CHUNK bytes each but the last),
+    // joined here by the length in their header
+    NetSocket::Client::Event event;
+    do
+    {
+        event = conn.client->WaitForNextEvent();
+    } while (event.type != NetSocket::Client::EventType::ReceiveBinary);
+    uint8_t *message = (uint8_t*)event.binary_data;
+    *length = event.data_length;
+    HpcStream::MessageHeader header;
+    if (*length < HPCSTREAM_HEADER_SIZE || message[0] != HPCSTREAM_PROTOCOL_VERSION || HpcStream::ReadMessageHeader(message, *length, &header))
+    {
+        return message;
+    }
+    uint64_t total = HPCSTREAM_HEADER_SIZE + header.length;
+    uint8_t *whole = new uint8_t[total];
+    memcpy(whole, message, *length);
+    delete[] message;
+    while (*length < total)
+    {
+        event = conn.client->WaitForNextEvent();
+        if (event.type == NetSocket::Client::EventType::ReceiveBinary)
+        {
+            uint64_t piece = std::min((uint64_t)event.data_length, total - *length);
+            memcpy(whole + *length, event.binary_data, piece);
+            *length += piece;
+            delete[] (uint8_t*)event.binary_data;
+        }
+    }
+    return whole;
+}
+
+void HpcStream::Client::OpenBulkSocket(Connection& conn, const uint8_t *offer, uint64_t length)
+{
+    // data sockets offered by the sender: [uint16 port][uint64 token][uint32 stream count][uint64 stripe size] - connects
+    // each, identifies it with the token and its index, then tells the sender it can use them (values keep arriving
+    // through the connection if any fails)
+    uint32_t i;
+    if (!conn.bulk_fds.empty() || length != sizeof(uint16_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t))
+    {
+        return;
+    }
+    uint32_t streams = ntohl(*((uint32_t*)(offer + sizeof(uint16_t) + sizeof(uint64_t))));
+    uint64_t stripe_size = HpcStream::NToHLL(*((uint64_t*)(offer + sizeof(uint16_t) + sizeof(uint64_t) + sizeof(uint32_t))));
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    std::string port = std::to_string(ntohs(*((uint16_t*)offer)));
+    if (streams == 0 || stripe_size == 0)
+    {
+        return;
+    }
+    // data sockets take turns over the sender's rails, starting with the one the connection uses
+    std::vector<int> fds;
+    std::string host = conn.host;
+    for (i = 0; i < streams; i++)
+    {
+        uint8_t hello[sizeof(uint64_t) + sizeof(uint32_t)];
+        uint32_t net_stream = htonl(i);
+        memcpy(hello, offer + sizeof(uint16_t), sizeof(uint64_t));
+        memcpy(hello + sizeof(uint64_t), &net_stream, sizeof(uint32_t));
+        struct addrinfo *addrs = NULL;
+        host = (conn.rails.size() > 1) ? conn.rails[(conn.rail + i) % conn.rails.size()] : conn.host;
+        int fd = -1;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) == 0)
+        {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd >= 0 && (connect(fd, addrs->ai_addr, addrs->ai_addrlen) != 0 || send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)))
+            {
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(addrs);
+        }
+        if (fd < 0)
+        {
+            break;
+        }
+        fds.push_back(fd);
+    }
+    if (fds.size() < streams)
+    {
+        fprintf(stderr, "[HpcStream] Warning: could not connect data socket to %s\n", host.c_str());
+        for (int fd : fds)
+        {
+            close(fd);
+        }
+        return;
+    }
+    conn.bulk_fds = fds;
+    conn.stripe_size = stripe_size;
+    conn.bulk_readers = new HpcStream::WorkerPool(streams);
+    uint8_t connected[HPCSTREAM_HEADER_SIZE];
+    HpcStream::WriteMessageHeader(connected, MessageType::BulkOpen, 0, 0, 0);
+    conn.client->Send(connected, HPCSTREAM_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+}
+
+uint8_t* HpcStream::Client::ReadBulk(Connection& conn, uint64_t length)
+{
+    // reads one message striped over the data sockets, one reader thread per socket - NULL if a socket closed
+    if (conn.bulk_fds.empty() || length < HPCSTREAM_HEADER_SIZE)
+    {
+        return NULL;
+    }
+    uint8_t *message = new uint8_t[length];
+    uint32_t streams = std::min((uint64_t)conn.bulk_fds.size(), (length + conn.stripe_size - 1) / conn.stripe_size);
+    std::vector<char> complete(streams, 0);
+    auto read_stream = [&](uint32_t stream)
+    {
+        uint64_t start;
+        for (start = stream * conn.stripe_size; start < length; start += streams * conn.stripe_size)
+        {
+            uint64_t end = std::min(start + conn.stripe_size, length);
+            uint64_t offset = start;
+            while (offset < end)
+            {
+                ssize_t size = recv(conn.bulk_fds[stream], message + offset, end - offset, MSG_WAITALL);
+                if (size <= 0 && !(size < 0 && errno == EINTR))
+                {
+                    return;
+                }
+                offset += std::max(size, (ssize_t)0);
+            }
+        }
+        complete[stream] = 1;
+    };
+    conn.bulk_readers->ParallelFor(streams, read_stream);
+    if (std::find(complete.begin(), complete.end(), 0) != complete.end())
+    {
+        delete[] message;
+        return NULL;
+    }
+    return message;
+}
+
+void HpcStream::Client::JoinMulticast(Connection& conn, const uint8_t *offer, uint64_t length)
+{
+    // multicast group offered by the sender: [uint16 port][group address] - joined through the interface the connection
+    // uses, then the sender is told whether it can multicast: [uint8 joined]
+    if (conn.mcast != NULL)
+    {
+        return;
+    }
+    if (length > sizeof(uint16_t))
+    {
+        std::string group = std::string((const char*)(offer + sizeof(uint16_t)), length - sizeof(uint16_t));
+        conn.mcast = HpcStream::McastReceiver::Join(group, ntohs(*((uint16_t*)offer)), conn.client->LocalIpAddress());
+        if (conn.mcast == NULL)
+        {
+            fprintf(stderr, "[HpcStream] Warning: could not join multicast group %s\n", group.c_str());
+        }
+    }
+    uint8_t reply[HPCSTREAM_HEADER_SIZE + sizeof(uint8_t)];
+    HpcStream::WriteMessageHeader(reply, MessageType::McastOpen, 0, 0, sizeof(uint8_t));
+    reply[HPCSTREAM_HEADER_SIZE] = conn.mcast != NULL ? 1 : 0;
+    conn.client->Send(reply, sizeof(reply), NetSocket::CopyMode::MemCopy);
+}
+
+uint8_t* HpcStream::Client::ReadMulticast(Connection& conn, uint64_t id, uint64_t length)
+{
+    // reassembles a multicast message - fragments that do not arrive are asked for again over the connection (a few
+    // times, then the message is given up on) - NULL if it never completes
+    const int attempts = 20;
+    const int timeout = 20;
+    int i;
+    uint64_t j;
+    if (conn.mcast == NULL || length < HPCSTREAM_HEADER_SIZE)
+    {
+        return NULL;
+    }
+    std::vector<uint32_t> missing;
+    for (i = 0; i < attempts; i++)
+    {
+        uint8_t *message = conn.mcast->Receive(id, length, timeout, missing);
+        if (message != NULL || missing.empty())
+        {
+            return message;
+        }
+        // payload: [uint64 message id][uint32 fragment] for each missing fragment
+        uint64_t payload_size = sizeof(uint64_t) + missing.size() * sizeof(uint32_t);
+        std::vector<uint8_t> nack(HPCSTREAM_HEADER_SIZE + payload_size);
+        uint64_t net_id = HpcStream::HToNLL(id);
+        HpcStream::WriteMessageHeader(nack.data(), MessageType::McastNack, 0, 0, payload_size);
+        memcpy(nack.data() + HPCSTREAM_HEADER_SIZE, &net_id, sizeof(uint64_t));
+        for (j = 0; j < missing.size(); j++)
+        {
+            uint32_t net_fragment = htonl(missing[j]);
+            memcpy(nack.data() + HPCSTREAM_HEADER_SIZE + sizeof(uint64_t) + j * sizeof(uint32_t), &net_fragment, sizeof(uint32_t));
+        }
+        conn.client->Send(nack.data(), nack.size(), NetSocket::CopyMode::MemCopy);
+    }
+    fprintf(stderr, "[HpcStream] Error: gave up on multicast message %llu\n", (unsigned long long)id);
+    conn.mcast->Skip(id);
+    return NULL;
+}
+
+void HpcStream::Client::StoreValue(std::vector<SharedVar>& vars, SharedVar& var, const uint8_t *data, uint64_t length, uint16_t flags, bool swap_bytes)
+{
+    if (var.resize_pending)
+    {
+        ResizeArray(var);
+    }
+    // changed tiles cannot be applied to a value that was lost
+    if ((flags & MessageFlags::Delta) && var.stale)
+    {
+        return;
+    }
+    var.stale = false;
+    if (flags & MessageFlags::Cropped)
+    {
+        // payload: [uint32 global offset per dim][uint32 size per dim][values within the box]
+        int i;
+        uint64_t box_length = 1;
+        std::vector<uint32_t> box(2 * var.dims);
+        for (i = 0; i < 2 * var.dims && (i + 1) * sizeof(uint32_t) <= length; i++)
+        {
+            box[i] = ntohl(*((uint32_t*)(data + i * sizeof(uint32_t))));
+        }
+        for (i = 0; i < var.dims; i++)
+        {
+            box_length *= box[var.dims + i];
+        }
+        if (var.gs_vars.size() == 0 || length != 2 * var.dims * sizeof(uint32_t) + box_length * var.size)
+        {
+            fprintf(stderr, "[HpcStream] Error: size of %s does not match its cropped dimensions\n", var.name.c_str());
+            return;
+        }
+        SetReceivedBox(var, box.data(), box.data() + var.dims);
+        data += 2 * var.dims * sizeof(uint32_t);
+        length -= 2 * var.dims * sizeof(uint32_t);
+    }
+    else if (var.gs_vars.size() > 0 && var.val != NULL)
+    {
+        // whole local block (replacing a cropped box held from earlier steps)
+        SetReceivedBox(var, var.l_offset, var.l_size);
+    }
+    if (flags & MessageFlags::Encoded)
+    {
+        // decode straight into the variable's value (filter is undone block by block)
+        HpcStream::CodecContext ctx = {var.type, var.size, var.filter, var.dims, var.l_size, 0, 0.0};
+        if (var.val == NULL || !HpcStream::DecodeBlocks(HpcStream::GetCodec(var.codec), ctx, data, length, var.val, var.size * var.length))
+        {
+            fprintf(stderr, "[HpcStream] Error: could not decode value of %s\n", var.name.c_str());
+        }
+        // quantize codec reconstructs values in this machine's byte order
+        else if (swap_bytes && var.size > 1 && var.codec != HpcStream::CodecId::Quantize)
+        {
+            HpcStream::SwapBytes(var.val, var.val, var.length, var.size);
+        }
+        return;
+    }
+    if (flags & MessageFlags::Delta)
+    {
+        // patch changed tiles into the value kept from the previous step
+        if (var.val == NULL || !HpcStream::ApplyDeltaTiles(data, length, var.val, var.dims, var.l_size, var.size, swap_bytes && var.size > 1))
+        {
+            fprintf(stderr, "[HpcStream] Error: could not apply changed tiles of %s\n", var.name.c_str());
+        }
+        return;
+    }
+    if (length != var.size * var.length)
+    {
+        fprintf(stderr, "[HpcStream] Error: size of %s does not match its local dimensions\n", var.name.c_str());
+        return;
+    }
+    // conversion to this machine's byte order costs no more than the copy
+    if (swap_bytes && var.size > 1)
+    {
+        HpcStream::SwapBytes(data, var.val, var.length, var.size);
+    }
+    else
+    {
+        memcpy(var.val, data, length);
+    }
+    // if array size, copy value to dependent arrays (values are reallocated once all sizes are known)
+    if (var.dims == 1 && var.length == 1 && var.type == HpcStream::DataType::ArraySize)
+    {
+        uint32_t size_val = *((uint32_t*)var.val);
+        for (auto const& dep : var.size_deps)
+        {
+            SharedVar& x = vars[dep.var];
+            switch (dep.role)
+            {
+                case SizeRole::GlobalSize:
+                    x.g_size[dep.dim] = size_val;
+                    break;
+                case SizeRole::LocalSize:
+                    if (x.l_size[dep.dim] != size_val)
+                    {
+                        x.l_size[dep.dim] = size_val;
+                        x.resize_pending = true;
+                    }
+                    break;
+                case SizeRole::LocalOffset:
+                    x.l_offset[dep.dim] = size_val;
+                    break;
+            }
         }
-        delete[] event.binary_data;
     }
 }
 
 void HpcStream::Client::ReleaseTimeStep()
 {
     int i;
-    uint8_t complete = 255;
+    uint8_t complete[HPCSTREAM_HEADER_SIZE];
     for (i = 0; i < _connections.size(); i++)
     {
-        _connections[i].client->Send(&complete, 1, NetSocket::CopyMode::MemCopy);
+        if (_connections[i].source == 0)
+        {
+            HpcStream::WriteMessageHeader(complete, MessageType::StepAck, 0, _connections[i].step, 0);
+            _connections[i].client->Send(complete, HPCSTREAM_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+        }
     }
 }
 
+HpcStream::VarHandle HpcStream::Client::GetVarHandle(std::string var_name)
+{
+    std::map<std::string, HpcStream::VarHandle>::iterator it = _var_handles.find(var_name);
+    if (it == _var_handles.end())
+    {
+        fprintf(stderr, "[HpcStream] Error: no variable named %s\n", var_name.c_str());
+        return HPCSTREAM_INVALID_HANDLE;
+    }
+    return it->second;
+}
+
 void HpcStream::Client::GetGlobalSizeForVariable(std::string var_name, uint32_t *size)
 {
-    if (_connections[0].vars[var_name].gs_vars.size() == 0)
+    GetGlobalSizeForVariable(GetVarHandle(var_name), size);
+}
+
+void HpcStream::Client::GetGlobalSizeForVariable(HpcStream::VarHandle var, uint32_t *size)
+{
+    if (var == HPCSTREAM_INVALID_HANDLE || _connections[0].vars[var].gs_vars.size() == 0)
     {
         *size = 0;
     }
     else
     {
         int i;
-        for (i = 0; i < _connections[0].vars[var_name].dims; i++)
+        const SharedVar& x = _connections[0].vars[var];
+        for (i = 0; i < x.dims; i++)
         {
-            size[i] = _connections[0].vars[var_name].g_size[i];
+            // subsampled arrays keep elements whose global index is a multiple of the factor
+            uint32_t factor = x.sample.empty() ? 1 : x.sample[i];
+            size[i] = (x.g_size[i] + factor - 1) / factor;
         }
     }
 }
 
 HpcStream::Client::GlobalSelection HpcStream::Client::CreateGlobalArraySelection(std::string var_name, int32_t *sizes, int32_t *offsets)
+{
+    return CreateGlobalArraySelection(GetVarHandle(var_name), sizes, offsets);
+}
+
+HpcStream::Client::GlobalSelection HpcStream::Client::CreateGlobalArraySelection(HpcStream::VarHandle var, int32_t *sizes, int32_t *offsets)
 {
     GlobalSelection selection;
-    selection.var_name = var_name;
-    uint32_t dims = _connections[0].vars[var_name].dims;
+    selection.var = var;
+    selection.var_name = _connections[0].vars[var].name;
+    uint32_t dims = _connections[0].vars[var].dims;
     int problem_type;
     if (dims == 1)
     {
@@ -421,7 +1173,7 @@ HpcStream::Client::GlobalSelection HpcStream::Client::CreateGlobalArraySelection
         fprintf(stderr, "[HpcStream] Error: currently only support 1D, 2D, and 3D arrays\n");
     }
     MPI_Datatype type;
-    switch (_connections[0].vars[var_name].type)
+    switch (_connections[0].vars[var].type)
     {
         case DataType::Int8:
             type = MPI_SIGNED_CHAR;
@@ -457,18 +1209,66 @@ HpcStream::Client::GlobalSelection HpcStream::Client::CreateGlobalArraySelection
             type = MPI_DOUBLE;
             break; 
     }
-    selection.desc = DDR_NewDataDescriptor(_num_ranks, problem_type, type, HpcStream::GetDataTypeSize(_connections[0].vars[var_name].type));
+    selection.desc = DDR_NewDataDescriptor(_num_ranks, problem_type, type, HpcStream::GetDataTypeSize(_connections[0].vars[var].type));
 
     int i, j;
+    // servers only send the part of each block within the union of all ranks' selections (bounding box)
+    // selections of subsampled arrays are in reduced coordinates, regions requested from servers are not
+    std::vector<int32_t> all_sizes(_num_ranks * dims);
+    std::vector<int32_t> all_offsets(_num_ranks * dims);
+    MPI_Allgather(sizes, dims, MPI_INT32_T, all_sizes.data(), dims, MPI_INT32_T, _comm);
+    MPI_Allgather(offsets, dims, MPI_INT32_T, all_offsets.data(), dims, MPI_INT32_T, _comm);
+    std::vector<uint32_t> region(2 * dims);
+    for (j = 0; j < dims; j++)
+    {
+        int64_t start = INT64_MAX;
+        int64_t end = 0;
+        for (i = 0; i < _num_ranks; i++)
+        {
+            if (all_sizes[i * dims + j] > 0)
+            {
+                start = std::min(start, (int64_t)std::max(all_offsets[i * dims + j], 0));
+                end = std::max(end, (int64_t)all_offsets[i * dims + j] + all_sizes[i * dims + j]);
+            }
+        }
+        region[j] = start < end ? start : 0;
+        region[dims + j] = start < end ? end - start : 0;
+    }
+    const std::vector<uint32_t>& sample = _connections.empty() ? std::vector<uint32_t>() : _connections[0].vars[var].sample;
+    std::vector<uint8_t> request(HPCSTREAM_HEADER_SIZE + 2 * dims * sizeof(uint32_t));
+    HpcStream::WriteMessageHeader(request.data(), MessageType::Region, var, 0, 2 * dims * sizeof(uint32_t));
+    for (j = 0; j < 2 * dims; j++)
+    {
+        uint64_t full = (uint64_t)region[j] * (sample.empty() ? 1 : sample[j % dims]);
+        uint32_t net_val = htonl(std::min(full, (uint64_t)UINT32_MAX));
+        memcpy(request.data() + HPCSTREAM_HEADER_SIZE + j * sizeof(uint32_t), &net_val, sizeof(uint32_t));
+    }
+
     int chunks_own = _connections.size();
     int *dims_own = new int[chunks_own * dims];
     int *offsets_own = new int[chunks_own * dims];
+    selection.own_offsets.resize(chunks_own * dims);
+    selection.own_sizes.resize(chunks_own * dims);
     for (i = 0; i < _connections.size(); i++)
     {
+        SharedVar& x = _connections[i].vars[var];
+        if (_connections[i].source == 0)
+        {
+            _connections[i].client->Send(request.data(), request.size(), NetSocket::CopyMode::MemCopy);
+        }
+        std::vector<uint32_t> block(2 * dims, 0);
+        std::vector<uint32_t> factors(dims, 1);
+        if (!x.sample.empty())
+        {
+            factors = x.sample;
+        }
+        HpcStream::SubsampledBox(dims, x.l_offset, block.data(), x.l_size, factors.data(), block.data(), block.data() + dims);
+        HpcStream::IntersectBoxes(dims, region.data(), region.data() + dims, block.data(), block.data() + dims,
+                                  selection.own_offsets.data() + i * dims, selection.own_sizes.data() + i * dims);
         for (j = 0; j < dims; j++)
         {
-            dims_own[i * dims + j] = _connections[i].vars[var_name].l_size[j];
-            offsets_own[i * dims + j] = _connections[i].vars[var_name].l_offset[j];
+            dims_own[i * dims + j] = selection.own_sizes[i * dims + j];
+            offsets_own[i * dims + j] = selection.own_offsets[i * dims + j];
         }
     }
 
@@ -479,18 +1279,44 @@ HpcStream::Client::GlobalSelection HpcStream::Client::CreateGlobalArraySelection
 
 void HpcStream::Client::FillSelection(GlobalSelection& selection, void *data)
 {
-    int i;
-    uint32_t data_size = 0;
+    int i, j;
+    uint32_t dims = _connections.empty() ? 0 : _connections[0].vars[selection.var].dims;
+    uint64_t data_size = 0;
+    std::vector<uint64_t> own_lengths(_connections.size());
     for (i = 0; i < _connections.size(); i++)
     {
-        data_size += _connections[i].vars[selection.var_name].length * _connections[i].vars[selection.var_name].size;
+        own_lengths[i] = _connections[i].vars[selection.var].size;
+        for (j = 0; j < dims; j++)
+        {
+            own_lengths[i] *= selection.own_sizes[i * dims + j];
+        }
+        data_size += own_lengths[i];
     }
     uint8_t *d_own = new uint8_t[data_size];
-    uint32_t offset = 0;
+    uint64_t offset = 0;
     for (i = 0; i < _connections.size(); i++)
     {
-        memcpy(d_own + offset, _connections[i].vars[selection.var_name].val, _connections[i].vars[selection.var_name].length * _connections[i].vars[selection.var_name].size);
-        offset += _connections[i].vars[selection.var_name].length * _connections[i].vars[selection.var_name].size;
+        // selected box is copied out of the box held for the connection (whole block or cropped region)
+        SharedVar& x = _connections[i].vars[selection.var];
+        std::vector<uint32_t> box_offset(dims);
+        bool contained = true;
+        for (j = 0; j < dims; j++)
+        {
+            uint32_t own_offset = selection.own_offsets[i * dims + j];
+            contained &= own_offset >= x.r_offset[j] && own_offset + selection.own_sizes[i * dims + j] <= x.r_offset[j] + x.r_size[j];
+            box_offset[j] = own_offset - std::min(own_offset, x.r_offset[j]);
+        }
+        if (own_lengths[i] > 0 && contained)
+        {
+            HpcStream::CopyBox(x.val, dims, x.r_size, x.size, box_offset.data(), selection.own_sizes.data() + i * dims, d_own + offset);
+        }
+        else if (own_lengths[i] > 0)
+        {
+            fprintf(stderr, "[HpcStream] Error: %s has not been received for the selected region\n", x.name.c_str());
+            memset(d_own + offset, 0, own_lengths[i]);
+        }
+        offset += own_lengths[i];
     }
     DDR_ReorganizeData(_num_ranks, d_own, data, selection.desc);
+    delete[] d_own;
 }
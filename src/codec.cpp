@@ -0,0 +1,695 @@
+#include <cmath>
+#include "hpcstream/codec.h"
+
+namespace {
+    // LZ77 block codec using the LZ4 block format (4 bit literal / match length token, 16 bit offsets)
+    class FastLzCodec : public HpcStream::Codec {
+    private:
+        static const int HASH_LOG = 16;
+        static const uint64_t MIN_MATCH = 4;
+        static const uint64_t LAST_LITERALS = 5;
+        static const uint64_t MATCH_SEARCH_LIMIT = 12;
+        static const uint64_t MAX_OFFSET = 65535;
+
+        static uint32_t Read32(const uint8_t *p)
+        {
+            uint32_t val;
+            memcpy(&val, p, sizeof(uint32_t));
+            return val;
+        }
+
+        static uint8_t* WriteLength(uint8_t *op, uint64_t length)
+        {
+            while (length >= 255)
+            {
+                *op++ = 255;
+                length -= 255;
+            }
+            *op++ = static_cast<uint8_t>(length);
+            return op;
+        }
+
+        static bool ReadLength(const uint8_t **ip, const uint8_t *iend, uint64_t *length)
+        {
+            uint8_t b;
+            do
+            {
+                if (*ip >= iend) return false;
+                b = *((*ip)++);
+                *length += b;
+            } while (b == 255);
+            return true;
+        }
+
+        static uint8_t* WriteSequence(uint8_t *op, const uint8_t *literals, uint64_t literal_length, uint32_t offset, uint64_t match_length, bool last)
+        {
+            uint8_t *token = op++;
+            *token = (literal_length >= 15 ? 15 : literal_length) << 4;
+            if (literal_length >= 15)
+            {
+                op = WriteLength(op, literal_length - 15);
+            }
+            memcpy(op, literals, literal_length);
+            op += literal_length;
+            if (!last)
+            {
+                *op++ = offset & 0xFF;
+                *op++ = (offset >> 8) & 0xFF;
+                *token |= (match_length >= 15 ? 15 : match_length);
+                if (match_length >= 15)
+                {
+                    op = WriteLength(op, match_length - 15);
+                }
+            }
+            return op;
+        }
+
+    public:
+        uint64_t MaxEncodedSize(uint64_t length)
+        {
+            return length + (length / 255) + 16;
+        }
+
+        uint64_t Encode(const HpcStream::CodecContext&, const uint8_t *src, uint64_t length, uint8_t *dst)
+        {
+            const uint8_t *ip = src;
+            const uint8_t *anchor = src;
+            const uint8_t *iend = src + length;
+            uint8_t *op = dst;
+            if (length > MATCH_SEARCH_LIMIT)
+            {
+                std::vector<uint32_t> table(1 << HASH_LOG, 0);
+                const uint8_t *search_end = iend - MATCH_SEARCH_LIMIT;
+                const uint8_t *match_end = iend - LAST_LITERALS;
+                ip++;
+                while (ip < search_end)
+                {
+                    uint32_t seq = Read32(ip);
+                    uint32_t hash = (seq * 2654435761U) >> (32 - HASH_LOG);
+                    const uint8_t *ref = src + table[hash];
+                    table[hash] = static_cast<uint32_t>(ip - src);
+                    if (ref >= ip || ip - ref > MAX_OFFSET || Read32(ref) != seq)
+                    {
+                        ip++;
+                        continue;
+                    }
+                    // extend match forward, 8 bytes at a time while possible
+                    const uint8_t *mp = ip + MIN_MATCH;
+                    const uint8_t *rp = ref + MIN_MATCH;
+                    bool mismatch = false;
+                    while (!mismatch && mp + sizeof(uint64_t) <= match_end)
+                    {
+                        uint64_t a, b;
+                        memcpy(&a, mp, sizeof(uint64_t));
+                        memcpy(&b, rp, sizeof(uint64_t));
+                        if (a != b)
+                        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                            mp += __builtin_ctzll(a ^ b) >> 3;
+#else
+                            mp += __builtin_clzll(a ^ b) >> 3;
+#endif
+                            mismatch = true;
+                        }
+                        else
+                        {
+                            mp += sizeof(uint64_t);
+                            rp += sizeof(uint64_t);
+                        }
+                    }
+                    while (!mismatch && mp < match_end && *mp == *rp)
+                    {
+                        mp++;
+                        rp++;
+                    }
+                    op = WriteSequence(op, anchor, ip - anchor, static_cast<uint32_t>(ip - ref), (mp - ip) - MIN_MATCH, false);
+                    ip = mp;
+                    anchor = ip;
+                }
+            }
+            op = WriteSequence(op, anchor, iend - anchor, 0, 0, true);
+            return op - dst;
+        }
+
+        bool Decode(const HpcStream::CodecContext&, const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t dst_length)
+        {
+            const uint8_t *ip = src;
+            const uint8_t *iend = src + length;
+            uint8_t *op = dst;
+            uint8_t *oend = dst + dst_length;
+            while (ip < iend)
+            {
+                uint8_t token = *ip++;
+                uint64_t literal_length = token >> 4;
+                if (literal_length == 15 && !ReadLength(&ip, iend, &literal_length)) return false;
+                if (literal_length > static_cast<uint64_t>(iend - ip) || literal_length > static_cast<uint64_t>(oend - op)) return false;
+                memcpy(op, ip, literal_length);
+                op += literal_length;
+                ip += literal_length;
+                if (ip == iend) break; // last sequence has no match
+
+                if (iend - ip < 2) return false;
+                uint32_t offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                uint64_t match_length = token & 0x0F;
+                if (match_length == 15 && !ReadLength(&ip, iend, &match_length)) return false;
+                match_length += MIN_MATCH;
+                if (offset == 0 || offset > op - dst || match_length > static_cast<uint64_t>(oend - op)) return false;
+                const uint8_t *match = op - offset;
+                if (offset >= sizeof(uint64_t))
+                {
+                    uint64_t i;
+                    for (i = 0; i + sizeof(uint64_t) <= match_length; i += sizeof(uint64_t))
+                    {
+                        memcpy(op + i, match + i, sizeof(uint64_t));
+                    }
+                    for (; i < match_length; i++)
+                    {
+                        op[i] = match[i];
+                    }
+                }
+                else
+                {
+                    uint64_t i;
+                    for (i = 0; i < match_length; i++)
+                    {
+                        op[i] = match[i];
+                    }
+                }
+                op += match_length;
+            }
+            return op == oend;
+        }
+    };
+
+    FastLzCodec fast_lz_codec;
+
+    // error bounded lossy codec for Float / Double arrays - each value is predicted from already reconstructed
+    // neighbors (Lorenzo predictor over the first three dimensions) and the prediction error is quantized to
+    // multiples of twice the error bound, values that cannot be predicted within the bound are stored as is
+    // encoded block: [uint64 error bound bits][uint64 num unpredictable][uint64 codes size][codes][unpredictable values]
+    class QuantizeCodec : public HpcStream::Codec {
+    private:
+        static const uint64_t HEADER_SIZE = 3 * sizeof(uint64_t);
+        static const int64_t MAX_QUANT = 1 << 30;
+
+        // walks the elements of a block, tracking each element's position in the local array
+        class Predictor {
+        private:
+            uint64_t _stride[3];
+            uint64_t _extent[3];
+            uint64_t _coord[3];
+            uint64_t _index;
+
+        public:
+            Predictor(const HpcStream::CodecContext& ctx) : _index(0)
+            {
+                int d;
+                uint32_t i;
+                for (d = 0; d < 3; d++)
+                {
+                    _extent[d] = 1;
+                }
+                // higher dimensions are folded into the third
+                for (i = 0; ctx.l_size != NULL && i < ctx.dims; i++)
+                {
+                    _extent[std::min(i, 2u)] *= std::max(ctx.l_size[i], 1u);
+                }
+                if (ctx.l_size == NULL || ctx.dims <= 1)
+                {
+                    _extent[0] = UINT64_MAX;
+                }
+                _stride[0] = 1;
+                _stride[1] = _extent[0];
+                _stride[2] = _extent[0] * _extent[1];
+                _coord[0] = ctx.first % _extent[0];
+                _coord[1] = (ctx.first / _extent[0]) % _extent[1];
+                _coord[2] = ctx.first / (_extent[0] * _extent[1]);
+            }
+
+            template <typename T>
+            double Predict(const T *recon)
+            {
+                int n, d;
+                double pred = 0.0;
+                // sum over non-empty subsets of the axes with a previous neighbor, sign alternating with subset size
+                for (n = 1; n < 8; n++)
+                {
+                    uint64_t offset = 0;
+                    int bits = 0;
+                    bool valid = true;
+                    for (d = 0; d < 3; d++)
+                    {
+                        if (n & (1 << d))
+                        {
+                            valid &= _coord[d] > 0;
+                            offset += _stride[d];
+                            bits++;
+                        }
+                    }
+                    if (valid && offset <= _index)
+                    {
+                        pred += (bits % 2 == 1 ? 1.0 : -1.0) * recon[_index - offset];
+                    }
+                }
+                return pred;
+            }
+
+            void Next()
+            {
+                _index++;
+                if (++_coord[0] == _extent[0])
+                {
+                    _coord[0] = 0;
+                    if (++_coord[1] == _extent[1])
+                    {
+                        _coord[1] = 0;
+                        _coord[2]++;
+                    }
+                }
+            }
+        };
+
+        static void WriteValue(uint8_t *dst, float val)
+        {
+            uint32_t bits;
+            memcpy(&bits, &val, sizeof(uint32_t));
+            bits = htonl(bits);
+            memcpy(dst, &bits, sizeof(uint32_t));
+        }
+
+        static void WriteValue(uint8_t *dst, double val)
+        {
+            uint64_t bits;
+            memcpy(&bits, &val, sizeof(uint64_t));
+            bits = HpcStream::HToNLL(bits);
+            memcpy(dst, &bits, sizeof(uint64_t));
+        }
+
+        static void ReadValue(const uint8_t *src, float *val)
+        {
+            uint32_t bits;
+            memcpy(&bits, src, sizeof(uint32_t));
+            bits = ntohl(bits);
+            memcpy(val, &bits, sizeof(uint32_t));
+        }
+
+        static void ReadValue(const uint8_t *src, double *val)
+        {
+            uint64_t bits;
+            memcpy(&bits, src, sizeof(uint64_t));
+            bits = HpcStream::NToHLL(bits);
+            memcpy(val, &bits, sizeof(uint64_t));
+        }
+
+        template <typename T>
+        uint64_t EncodeValues(const HpcStream::CodecContext& ctx, const uint8_t *src, uint64_t count, uint8_t *dst)
+        {
+            uint64_t i;
+            double bound = std::max(ctx.error_bound, 0.0);
+            std::vector<T> values(count);
+            std::vector<T> recon(count);
+            std::vector<uint32_t> codes(count);
+            std::vector<T> unpredictable;
+            memcpy(values.data(), src, count * sizeof(T));
+            Predictor predictor(ctx);
+            for (i = 0; i < count; i++)
+            {
+                double pred = predictor.Predict(recon.data());
+                double quant = bound > 0.0 ? std::round((values[i] - pred) / (2.0 * bound)) : 0.0;
+                bool predicted = std::isfinite(quant) && std::fabs(quant) < MAX_QUANT;
+                if (predicted)
+                {
+                    recon[i] = static_cast<T>(pred + 2.0 * bound * quant);
+                    // rounding to the element type may push the value out of bounds
+                    predicted = std::fabs(static_cast<double>(recon[i]) - values[i]) <= bound;
+                }
+                if (predicted)
+                {
+                    // zig-zag encoded quantization code, 0 marks an unpredictable value
+                    int64_t q = static_cast<int64_t>(quant);
+                    codes[i] = htonl(static_cast<uint32_t>(q >= 0 ? 2 * q : -2 * q - 1) + 1);
+                }
+                else
+                {
+                    recon[i] = values[i];
+                    codes[i] = 0;
+                    unpredictable.push_back(values[i]);
+                }
+                predictor.Next();
+            }
+            // codes are mostly small, so their byte planes compress well
+            std::vector<uint8_t> planes(count * sizeof(uint32_t));
+            HpcStream::ShuffleBytes(reinterpret_cast<const uint8_t*>(codes.data()), planes.data(), count, sizeof(uint32_t));
+            uint64_t codes_size = fast_lz_codec.Encode(ctx, planes.data(), planes.size(), dst + HEADER_SIZE);
+            uint8_t *op = dst + HEADER_SIZE + codes_size;
+            for (i = 0; i < unpredictable.size(); i++)
+            {
+                WriteValue(op, unpredictable[i]);
+                op += sizeof(T);
+            }
+            uint64_t header[3];
+            memcpy(&(header[0]), &bound, sizeof(uint64_t));
+            header[0] = HpcStream::HToNLL(header[0]);
+            header[1] = HpcStream::HToNLL(unpredictable.size());
+            header[2] = HpcStream::HToNLL(codes_size);
+            memcpy(dst, header, HEADER_SIZE);
+            return op - dst;
+        }
+
+        template <typename T>
+        bool DecodeValues(const HpcStream::CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t count)
+        {
+            uint64_t i;
+            if (length < HEADER_SIZE)
+            {
+                return false;
+            }
+            uint64_t header[3];
+            memcpy(header, src, HEADER_SIZE);
+            header[0] = HpcStream::NToHLL(header[0]);
+            double bound;
+            memcpy(&bound, &(header[0]), sizeof(uint64_t));
+            uint64_t num_unpredictable = HpcStream::NToHLL(header[1]);
+            uint64_t codes_size = HpcStream::NToHLL(header[2]);
+            if (codes_size > length - HEADER_SIZE || num_unpredictable > count ||
+                num_unpredictable * sizeof(T) != length - HEADER_SIZE - codes_size)
+            {
+                return false;
+            }
+            std::vector<uint8_t> planes(count * sizeof(uint32_t));
+            std::vector<uint32_t> codes(count);
+            if (!fast_lz_codec.Decode(ctx, src + HEADER_SIZE, codes_size, planes.data(), planes.size()))
+            {
+                return false;
+            }
+            HpcStream::UnshuffleBytes(planes.data(), reinterpret_cast<uint8_t*>(codes.data()), count, sizeof(uint32_t));
+            const uint8_t *unpredictable = src + HEADER_SIZE + codes_size;
+            const uint8_t *unpredictable_end = unpredictable + num_unpredictable * sizeof(T);
+            std::vector<T> recon(count);
+            Predictor predictor(ctx);
+            for (i = 0; i < count; i++)
+            {
+                uint32_t code = ntohl(codes[i]);
+                if (code == 0)
+                {
+                    if (unpredictable >= unpredictable_end)
+                    {
+                        return false;
+                    }
+                    ReadValue(unpredictable, &(recon[i]));
+                    unpredictable += sizeof(T);
+                }
+                else
+                {
+                    code--;
+                    int64_t q = (code & 1) ? -static_cast<int64_t>((code + 1) / 2) : static_cast<int64_t>(code / 2);
+                    recon[i] = static_cast<T>(predictor.Predict(recon.data()) + 2.0 * bound * q);
+                }
+                predictor.Next();
+            }
+            memcpy(dst, recon.data(), count * sizeof(T));
+            return unpredictable == unpredictable_end;
+        }
+
+    public:
+        uint64_t MaxEncodedSize(uint64_t length)
+        {
+            // codes take at most as many bytes as the values, plus every value may be unpredictable
+            return HEADER_SIZE + fast_lz_codec.MaxEncodedSize(length) + length;
+        }
+
+        uint64_t Encode(const HpcStream::CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst)
+        {
+            if (ctx.type == HpcStream::DataType::Double)
+            {
+                return EncodeValues<double>(ctx, src, length / sizeof(double), dst);
+            }
+            return EncodeValues<float>(ctx, src, length / sizeof(float), dst);
+        }
+
+        bool Decode(const HpcStream::CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t dst_length)
+        {
+            if (ctx.type == HpcStream::DataType::Double)
+            {
+                return dst_length % sizeof(double) == 0 && DecodeValues<double>(ctx, src, length, dst, dst_length / sizeof(double));
+            }
+            return ctx.type == HpcStream::DataType::Float && dst_length % sizeof(float) == 0 &&
+                   DecodeValues<float>(ctx, src, length, dst, dst_length / sizeof(float));
+        }
+    };
+
+    QuantizeCodec quantize_codec;
+    HpcStream::Codec *codec_registry[256] = {NULL, &fast_lz_codec, &quantize_codec};
+    std::mutex codec_registry_mutex;
+
+    // encoded blocks: [uint32 num blocks][uint64 block size][uint64 encoded size per block][block data]
+    const uint64_t BLOCKS_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+}
+
+void HpcStream::RegisterCodec(uint8_t id, Codec *codec)
+{
+    if (id < HPCSTREAM_CUSTOM_CODEC_MIN)
+    {
+        fprintf(stderr, "[HpcStream] Error: codec ids below %d are reserved for built-in codecs\n", HPCSTREAM_CUSTOM_CODEC_MIN);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(codec_registry_mutex);
+    codec_registry[id] = codec;
+}
+
+HpcStream::Codec* HpcStream::GetCodec(uint8_t id)
+{
+    std::lock_guard<std::mutex> lock(codec_registry_mutex);
+    return codec_registry[id];
+}
+
+double HpcStream::ValueRange(DataType type, const uint8_t *src, uint64_t count)
+{
+    uint64_t i;
+    double min_val = INFINITY;
+    double max_val = -INFINITY;
+    for (i = 0; i < count; i++)
+    {
+        double val;
+        if (type == DataType::Double)
+        {
+            double d;
+            memcpy(&d, src + i * sizeof(double), sizeof(double));
+            val = d;
+        }
+        else
+        {
+            float f;
+            memcpy(&f, src + i * sizeof(float), sizeof(float));
+            val = f;
+        }
+        // non-finite values are stored as is, so they do not widen the range
+        if (std::isfinite(val))
+        {
+            min_val = std::min(min_val, val);
+            max_val = std::max(max_val, val);
+        }
+    }
+    return max_val >= min_val ? max_val - min_val : 0.0;
+}
+
+uint64_t HpcStream::MaxEncodedBlocksSize(Codec *codec, uint64_t length, uint64_t block_size)
+{
+    uint64_t num_blocks = (length + block_size - 1) / block_size;
+    return BLOCKS_HEADER_SIZE + num_blocks * (sizeof(uint64_t) + codec->MaxEncodedSize(block_size));
+}
+
+uint64_t HpcStream::EncodeBlocks(Codec *codec, const CodecContext& ctx, const uint8_t *src, uint64_t length, uint64_t block_size, uint8_t *dst, WorkerPool *workers)
+{
+    uint64_t i;
+    uint32_t num_blocks = (length + block_size - 1) / block_size;
+    uint64_t max_block = codec->MaxEncodedSize(block_size);
+    uint64_t data_start = BLOCKS_HEADER_SIZE + num_blocks * sizeof(uint64_t);
+    std::vector<uint64_t> encoded_size(num_blocks);
+    std::vector<uint8_t> filtered(ctx.filter != HpcStream::FilterId::NoFilter ? length : 0);
+    // each block is (filtered and) encoded into its own worst case sized region, then regions are compacted
+    std::function<void(int)> encode = [&](int b) {
+        uint64_t offset = b * block_size;
+        uint64_t size = std::min(block_size, length - offset);
+        const uint8_t *block = src + offset;
+        HpcStream::CodecContext block_ctx = ctx;
+        block_ctx.first = offset / ctx.size;
+        if (ctx.filter != HpcStream::FilterId::NoFilter)
+        {
+            HpcStream::ApplyFilter(ctx.filter, block, filtered.data() + offset, size / ctx.size, ctx.size);
+            block = filtered.data() + offset;
+        }
+        encoded_size[b] = codec->Encode(block_ctx, block, size, dst + data_start + b * max_block);
+    };
+    if (workers != NULL)
+    {
+        workers->ParallelFor(num_blocks, encode);
+    }
+    else
+    {
+        for (i = 0; i < num_blocks; i++)
+        {
+            encode(i);
+        }
+    }
+    uint32_t net_num_blocks = htonl(num_blocks);
+    uint64_t net_block_size = HpcStream::HToNLL(block_size);
+    memcpy(dst, &net_num_blocks, sizeof(uint32_t));
+    memcpy(dst + sizeof(uint32_t), &net_block_size, sizeof(uint64_t));
+    uint64_t offset = data_start;
+    for (i = 0; i < num_blocks; i++)
+    {
+        uint64_t net_size = HpcStream::HToNLL(encoded_size[i]);
+        memcpy(dst + BLOCKS_HEADER_SIZE + i * sizeof(uint64_t), &net_size, sizeof(uint64_t));
+        memmove(dst + offset, dst + data_start + i * max_block, encoded_size[i]);
+        offset += encoded_size[i];
+    }
+    return offset;
+}
+
+bool HpcStream::DecodeBlocks(Codec *codec, const CodecContext& ctx, const uint8_t *src, uint64_t length, uint8_t *dst, uint64_t dst_length)
+{
+    uint32_t i;
+    if (codec == NULL || length < BLOCKS_HEADER_SIZE)
+    {
+        return false;
+    }
+    uint32_t num_blocks;
+    uint64_t block_size;
+    memcpy(&num_blocks, src, sizeof(uint32_t));
+    memcpy(&block_size, src + sizeof(uint32_t), sizeof(uint64_t));
+    num_blocks = ntohl(num_blocks);
+    block_size = HpcStream::NToHLL(block_size);
+    uint64_t offset = BLOCKS_HEADER_SIZE + num_blocks * sizeof(uint64_t);
+    if (offset > length || block_size == 0 || (dst_length + block_size - 1) / block_size != num_blocks)
+    {
+        return false;
+    }
+    std::vector<uint8_t> filtered(ctx.filter != HpcStream::FilterId::NoFilter ? block_size : 0);
+    for (i = 0; i < num_blocks; i++)
+    {
+        uint64_t encoded_size;
+        memcpy(&encoded_size, src + BLOCKS_HEADER_SIZE + i * sizeof(uint64_t), sizeof(uint64_t));
+        encoded_size = HpcStream::NToHLL(encoded_size);
+        uint64_t dst_offset = i * block_size;
+        uint64_t size = std::min(block_size, dst_length - dst_offset);
+        uint8_t *block = ctx.filter != HpcStream::FilterId::NoFilter ? filtered.data() : dst + dst_offset;
+        HpcStream::CodecContext block_ctx = ctx;
+        block_ctx.first = dst_offset / ctx.size;
+        if (encoded_size > length - offset || !codec->Decode(block_ctx, src + offset, encoded_size, block, size))
+        {
+            return false;
+        }
+        if (ctx.filter != HpcStream::FilterId::NoFilter)
+        {
+            HpcStream::RemoveFilter(ctx.filter, block, dst + dst_offset, size / ctx.size, ctx.size);
+        }
+        offset += encoded_size;
+    }
+    return true;
+}
+
+HpcStream::WorkerPool::WorkerPool(int num_threads) :
+    _job_count(0),
+    _next(0),
+    _done(0),
+    _generation(0),
+    _stop(false)
+{
+    int i;
+    // calling thread also runs jobs, so only start num_threads - 1 additional threads
+    for (i = 1; i < num_threads; i++)
+    {
+        _threads.push_back(std::thread(&HpcStream::WorkerPool::Worker, this));
+    }
+}
+
+HpcStream::WorkerPool::~WorkerPool()
+{
+    int i;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+    for (i = 0; i < _threads.size(); i++)
+    {
+        _threads[i].join();
+    }
+}
+
+void HpcStream::WorkerPool::ParallelFor(int count, std::function<void(int)> job)
+{
+    if (_threads.empty() || count <= 1)
+    {
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            job(i);
+        }
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    _job = job;
+    _job_count = count;
+    _next = 0;
+    _done = 0;
+    uint64_t generation = ++_generation;
+    lock.unlock();
+    _cond.notify_all();
+
+    RunJobs(job, count, generation);
+
+    lock.lock();
+    _done_cond.wait(lock, [&] {return _done == _job_count;});
+    _job = nullptr;
+}
+
+void HpcStream::WorkerPool::Worker()
+{
+    uint64_t generation = 0;
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] {return _stop || _generation != generation;});
+        if (_stop)
+        {
+            break;
+        }
+        generation = _generation;
+        // woken after the run finished - nothing left to do
+        if (!_job)
+        {
+            continue;
+        }
+        std::function<void(int)> job = _job;
+        int count = _job_count;
+        lock.unlock();
+
+        RunJobs(job, count, generation);
+    }
+}
+
+void HpcStream::WorkerPool::RunJobs(std::function<void(int)>& job, int count, uint64_t generation)
+{
+    // jobs are only taken from the run this thread joined (a later run resets the counters)
+    while (true)
+    {
+        int i;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_generation != generation || _next >= count)
+            {
+                break;
+            }
+            i = _next++;
+        }
+        job(i);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done++;
+        }
+        _done_cond.notify_all();
+    }
+}
@@ -0,0 +1,432 @@
+#include <vector>
+#include "hpcstream/filter.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HPCSTREAM_AVX2_DISPATCH
+#endif
+
+namespace {
+    // vectorized byte shuffles handle element sizes 2, 4, 8 and 16 - a perfect shuffle (interleaving the first and
+    // second half) of a block rotates the bits of each byte's index left by one, so repeated interleaving transposes
+    // a block of elements into byte planes and back
+    int VectorPasses(uint32_t size)
+    {
+        switch (size)
+        {
+            case 2: return 1;
+            case 4: return 2;
+            case 8: return 3;
+            case 16: return 4;
+            default: return 0;
+        }
+    }
+
+#if defined(__SSE2__)
+    void Interleave(__m128i *v, int n)
+    {
+        int k;
+        __m128i tmp[16];
+        for (k = 0; k < n / 2; k++)
+        {
+            tmp[2 * k] = _mm_unpacklo_epi8(v[k], v[k + n / 2]);
+            tmp[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + n / 2]);
+        }
+        for (k = 0; k < n; k++)
+        {
+            v[k] = tmp[k];
+        }
+    }
+
+    uint64_t ShuffleBytesSse2(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+    {
+        int j, pass;
+        uint64_t i;
+        __m128i v[16];
+        for (i = 0; i + 16 <= count; i += 16)
+        {
+            for (j = 0; j < size; j++)
+            {
+                v[j] = _mm_loadu_si128((const __m128i*)(src + i * size + 16 * j));
+            }
+            for (pass = 0; pass < 4; pass++)
+            {
+                Interleave(v, size);
+            }
+            for (j = 0; j < size; j++)
+            {
+                _mm_storeu_si128((__m128i*)(dst + j * count + i), v[j]);
+            }
+        }
+        return i;
+    }
+
+    uint64_t UnshuffleBytesSse2(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+    {
+        int j, pass;
+        uint64_t i;
+        __m128i v[16];
+        for (i = 0; i + 16 <= count; i += 16)
+        {
+            for (j = 0; j < size; j++)
+            {
+                v[j] = _mm_loadu_si128((const __m128i*)(src + j * count + i));
+            }
+            for (pass = 0; pass < VectorPasses(size); pass++)
+            {
+                Interleave(v, size);
+            }
+            for (j = 0; j < size; j++)
+            {
+                _mm_storeu_si128((__m128i*)(dst + i * size + 16 * j), v[j]);
+            }
+        }
+        return i;
+    }
+#endif
+
+#if defined(__SSE2__)
+    // 16 bit words are reordered first (for 4 and 8 byte elements), then the bytes within each word
+    uint64_t SwapBytesSse2(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+    {
+        uint64_t i;
+        uint64_t length = count * size;
+        for (i = 0; i + 16 <= length; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            if (size == 4)
+            {
+                v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+                v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            }
+            else if (size == 8)
+            {
+                v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+                v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            }
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i*)(dst + i), v);
+        }
+        return i / size;
+    }
+#endif
+
+#ifdef HPCSTREAM_AVX2_DISPATCH
+    // 256 bit unpacks work within 128 bit lanes, so lanes are recombined to interleave the full vectors
+    __attribute__((target("avx2")))
+    void InterleaveAvx2(__m256i *v, int n)
+    {
+        int k;
+        __m256i tmp[16];
+        for (k = 0; k < n / 2; k++)
+        {
+            __m256i lo = _mm256_unpacklo_epi8(v[k], v[k + n / 2]);
+            __m256i hi = _mm256_unpackhi_epi8(v[k], v[k + n / 2]);
+            tmp[2 * k] = _mm256_permute2x128_si256(lo, hi, 0x20);
+            tmp[2 * k + 1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+        }
+        for (k = 0; k < n; k++)
+        {
+            v[k] = tmp[k];
+        }
+    }
+
+    __attribute__((target("avx2")))
+    uint64_t ShuffleBytesAvx2(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+    {
+        int j, pass;
+        uint64_t i;
+        __m256i v[16];
+        for (i = 0; i + 32 <= count; i += 32)
+        {
+            for (j = 0; j < size; j++)
+            {
+                v[j] = _mm256_loadu_si256((const __m256i*)(src + i * size + 32 * j));
+            }
+            for (pass = 0; pass < 5; pass++)
+            {
+                InterleaveAvx2(v, size);
+            }
+            for (j = 0; j < size; j++)
+            {
+                _mm256_storeu_si256((__m256i*)(dst + j * count + i), v[j]);
+            }
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    uint64_t UnshuffleBytesAvx2(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+    {
+        int j, pass;
+        uint64_t i;
+        __m256i v[16];
+        for (i = 0; i + 32 <= count; i += 32)
+        {
+            for (j = 0; j < size; j++)
+            {
+                v[j] = _mm256_loadu_si256((const __m256i*)(src + j * count + i));
+            }
+            for (pass = 0; pass < VectorPasses(size); pass++)
+            {
+                InterleaveAvx2(v, size);
+            }
+            for (j = 0; j < size; j++)
+            {
+                _mm256_storeu_si256((__m256i*)(dst + i * size + 32 * j), v[j]);
+            }
+        }
+        return i;
+    }
+
+    // byte reversal of each element within a 256 bit vector (shuffles work within 128 bit lanes)
+    __attribute__((target("avx2")))
+    uint64_t SwapBytesAvx2(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+    {
+        int k;
+        uint64_t i;
+        uint8_t order[32];
+        for (k = 0; k < 32; k++)
+        {
+            order[k] = (k % 16) - (k % size) + (size - 1 - (k % size));
+        }
+        __m256i mask = _mm256_loadu_si256((const __m256i*)order);
+        uint64_t length = count * size;
+        for (i = 0; i + 32 <= length; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(v, mask));
+        }
+        return i / size;
+    }
+
+    bool HasAvx2()
+    {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2;
+    }
+#endif
+
+    // transpose 8x8 bit matrix (byte r holds row r, least significant bit first)
+    uint64_t TransposeBits(uint64_t x)
+    {
+        uint64_t t;
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+        x = x ^ t ^ (t << 28);
+        return x;
+    }
+
+    // byte plane of 'count' bytes -> 8 bit planes (element i is bit i % 8 of byte i / 8), trailing count % 8 bytes as is
+    void ShuffleBitPlane(const uint8_t *src, uint8_t *dst, uint64_t count)
+    {
+        int b, k;
+        uint64_t i = 0;
+        uint64_t num_bits = count & ~7ULL;
+        uint64_t stride = num_bits / 8;
+#if defined(__SSE2__)
+        // byte sign bits are gathered 16 elements at a time, most significant bit first
+        for (i = 0; i + 16 <= num_bits; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            for (b = 7; b >= 0; b--)
+            {
+                uint16_t mask = _mm_movemask_epi8(v);
+                memcpy(dst + b * stride + i / 8, &mask, sizeof(uint16_t));
+                v = _mm_add_epi8(v, v);
+            }
+        }
+#endif
+        for (; i < num_bits; i += 8)
+        {
+            uint64_t x = 0;
+            for (k = 0; k < 8; k++)
+            {
+                x |= (uint64_t)src[i + k] << (8 * k);
+            }
+            x = TransposeBits(x);
+            for (b = 0; b < 8; b++)
+            {
+                dst[b * stride + i / 8] = (x >> (8 * b)) & 0xFF;
+            }
+        }
+        if (count > num_bits)
+        {
+            memcpy(dst + num_bits, src + num_bits, count - num_bits);
+        }
+    }
+
+    void UnshuffleBitPlane(const uint8_t *src, uint8_t *dst, uint64_t count)
+    {
+        int b, k;
+        uint64_t i;
+        uint64_t num_bits = count & ~7ULL;
+        uint64_t stride = num_bits / 8;
+        for (i = 0; i < num_bits; i += 8)
+        {
+            uint64_t x = 0;
+            for (b = 0; b < 8; b++)
+            {
+                x |= (uint64_t)src[b * stride + i / 8] << (8 * b);
+            }
+            x = TransposeBits(x);
+            for (k = 0; k < 8; k++)
+            {
+                dst[i + k] = (x >> (8 * k)) & 0xFF;
+            }
+        }
+        if (count > num_bits)
+        {
+            memcpy(dst + num_bits, src + num_bits, count - num_bits);
+        }
+    }
+}
+
+void HpcStream::ShuffleBytes(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    uint32_t j;
+    uint64_t i = 0;
+    if (VectorPasses(size) > 0)
+    {
+#ifdef HPCSTREAM_AVX2_DISPATCH
+        if (HasAvx2())
+        {
+            i = ShuffleBytesAvx2(src, dst, count, size);
+        }
+#endif
+#if defined(__SSE2__)
+        if (i == 0)
+        {
+            i = ShuffleBytesSse2(src, dst, count, size);
+        }
+#endif
+    }
+    for (; i < count; i++)
+    {
+        for (j = 0; j < size; j++)
+        {
+            dst[j * count + i] = src[i * size + j];
+        }
+    }
+}
+
+void HpcStream::UnshuffleBytes(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    uint32_t j;
+    uint64_t i = 0;
+    if (VectorPasses(size) > 0)
+    {
+#ifdef HPCSTREAM_AVX2_DISPATCH
+        if (HasAvx2())
+        {
+            i = UnshuffleBytesAvx2(src, dst, count, size);
+        }
+#endif
+#if defined(__SSE2__)
+        if (i == 0)
+        {
+            i = UnshuffleBytesSse2(src, dst, count, size);
+        }
+#endif
+    }
+    for (; i < count; i++)
+    {
+        for (j = 0; j < size; j++)
+        {
+            dst[i * size + j] = src[j * count + i];
+        }
+    }
+}
+
+void HpcStream::ShuffleBits(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    uint32_t j;
+    std::vector<uint8_t> planes(count * size);
+    HpcStream::ShuffleBytes(src, planes.data(), count, size);
+    for (j = 0; j < size; j++)
+    {
+        ShuffleBitPlane(planes.data() + j * count, dst + j * count, count);
+    }
+}
+
+void HpcStream::UnshuffleBits(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    uint32_t j;
+    std::vector<uint8_t> planes(count * size);
+    for (j = 0; j < size; j++)
+    {
+        UnshuffleBitPlane(src + j * count, planes.data() + j * count, count);
+    }
+    HpcStream::UnshuffleBytes(planes.data(), dst, count, size);
+}
+
+void HpcStream::SwapBytes(const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    uint32_t j;
+    uint64_t i = 0;
+    if (size == 2 || size == 4 || size == 8)
+    {
+#ifdef HPCSTREAM_AVX2_DISPATCH
+        if (HasAvx2())
+        {
+            i = SwapBytesAvx2(src, dst, count, size);
+        }
+#endif
+#if defined(__SSE2__)
+        i += SwapBytesSse2(src + i * size, dst + i * size, count - i, size);
+#endif
+    }
+    for (; i < count; i++)
+    {
+        // both bytes of a pair are read before either is written, so swapping in place is fine
+        const uint8_t *s = src + i * size;
+        uint8_t *d = dst + i * size;
+        for (j = 0; j < size / 2; j++)
+        {
+            uint8_t tmp = s[j];
+            d[j] = s[size - 1 - j];
+            d[size - 1 - j] = tmp;
+        }
+        if (size % 2 == 1)
+        {
+            d[size / 2] = s[size / 2];
+        }
+    }
+}
+
+void HpcStream::ApplyFilter(uint8_t id, const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    switch (id)
+    {
+        case FilterId::ByteShuffle:
+            HpcStream::ShuffleBytes(src, dst, count, size);
+            break;
+        case FilterId::BitShuffle:
+            HpcStream::ShuffleBits(src, dst, count, size);
+            break;
+        default:
+            memcpy(dst, src, count * size);
+            break;
+    }
+}
+
+void HpcStream::RemoveFilter(uint8_t id, const uint8_t *src, uint8_t *dst, uint64_t count, uint32_t size)
+{
+    switch (id)
+    {
+        case FilterId::ByteShuffle:
+            HpcStream::UnshuffleBytes(src, dst, count, size);
+            break;
+        case FilterId::BitShuffle:
+            HpcStream::UnshuffleBits(src, dst, count, size);
+            break;
+        default:
+            memcpy(dst, src, count * size);
+            break;
+    }
+}
@@ -1,5 +1,25 @@
 #include "hpcstream.h"
 
+HpcStream::ServerOptions HpcStream::CreateServerOptions()
+{
+    ServerOptions options;
+    options.write_buffers = 1;
+    options.async_write = false;
+    options.step_frames = true;
+    options.codec_threads = 4;
+    options.codec_block_size = 1048576;
+    options.send_queue_depth = 1;
+    options.aggregate = false;
+    options.shm_size = 268435456;
+    options.uring = false;
+    options.zerocopy_threshold = 0;
+    options.bulk_streams = 1;
+    options.stripe_size = 4194304;
+    options.multicast_group = NULL;
+    options.multicast_port = 30000;
+    return options;
+}
+
 uint32_t HpcStream::GetDataTypeSize(DataType type)
 {
     uint32_t size = 0;
@@ -32,6 +52,8 @@ uint64_t HpcStream::HToNLL(uint64_t val)
 {
 #if __BYTE_ORDER == __BIG_ENDIAN
     return val; 
+#elif defined(__GNUC__)
+    return __builtin_bswap64(val);
 #else
     uint64_t rval;
     uint8_t *data = (uint8_t *)&rval;
@@ -53,6 +75,8 @@ uint64_t HpcStream::NToHLL(uint64_t val)
 {
 #if __BYTE_ORDER == __BIG_ENDIAN
     return val;
+#elif defined(__GNUC__)
+    return __builtin_bswap64(val);
 #else
     uint64_t rval;
     uint8_t *data = (uint8_t *)&rval;
@@ -70,3 +94,40 @@ uint64_t HpcStream::NToHLL(uint64_t val)
 #endif
 }
 
+
+void HpcStream::WriteMessageHeader(uint8_t *buffer, MessageType type, uint32_t var, uint64_t step, uint64_t length, uint16_t flags)
+{
+    uint16_t net_flags = htons(flags);
+    uint32_t net_var = htonl(var);
+    uint64_t net_step = HpcStream::HToNLL(step);
+    uint64_t net_length = HpcStream::HToNLL(length);
+    buffer[0] = HPCSTREAM_PROTOCOL_VERSION;
+    buffer[1] = type;
+    memcpy(buffer + 2, &net_flags, sizeof(uint16_t));
+    memcpy(buffer + 4, &net_var, sizeof(uint32_t));
+    memcpy(buffer + 8, &net_step, sizeof(uint64_t));
+    memcpy(buffer + 16, &net_length, sizeof(uint64_t));
+}
+
+bool HpcStream::ReadMessageHeader(const uint8_t *buffer, uint64_t buffer_length, MessageHeader *header)
+{
+    if (buffer_length < HPCSTREAM_HEADER_SIZE || buffer[0] != HPCSTREAM_PROTOCOL_VERSION)
+    {
+        return false;
+    }
+    uint16_t net_flags;
+    uint32_t net_var;
+    uint64_t net_step;
+    uint64_t net_length;
+    memcpy(&net_flags, buffer + 2, sizeof(uint16_t));
+    memcpy(&net_var, buffer + 4, sizeof(uint32_t));
+    memcpy(&net_step, buffer + 8, sizeof(uint64_t));
+    memcpy(&net_length, buffer + 16, sizeof(uint64_t));
+    header->version = buffer[0];
+    header->type = static_cast<MessageType>(buffer[1]);
+    header->flags = ntohs(net_flags);
+    header->var = ntohl(net_var);
+    header->step = HpcStream::NToHLL(net_step);
+    header->length = HpcStream::NToHLL(net_length);
+    return buffer_length - HPCSTREAM_HEADER_SIZE >= header->length;
+}
@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "hpcstream/multicast.h"
+
+#define HPCSTREAM_DATAGRAM_HEADER (sizeof(uint64_t) + 2 * sizeof(uint32_t))
+
+HpcStream::McastSender::McastSender(int fd, const struct sockaddr_in& group) :
+    _fd(fd),
+    _group(group),
+    _next_id(1)
+{
+}
+
+HpcStream::McastSender::~McastSender()
+{
+    close(_fd);
+}
+
+HpcStream::McastSender* HpcStream::McastSender::Create(const char *group, uint16_t port, const uint8_t iface[4])
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_aton(group, &(addr.sin_addr)) == 0 || !IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+    {
+        fprintf(stderr, "[HpcStream] Error: %s is not a multicast group\n", group);
+        return NULL;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    // stays on the local network, and reaches clients on this host too
+    uint8_t ttl = 1;
+    uint8_t loop = 1;
+    int send_buffer = 8388608;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+    struct in_addr iface_addr;
+    memcpy(&iface_addr, iface, 4);
+    if (iface_addr.s_addr != 0)
+    {
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface_addr, sizeof(iface_addr));
+    }
+    return new McastSender(fd, addr);
+}
+
+uint64_t HpcStream::McastSender::Send(const uint8_t *message, uint64_t length, uint64_t step)
+{
+    uint64_t id = _next_id++;
+    SentMessage& sent = _history[id];
+    sent.step = step;
+    sent.data.assign(message, message + length);
+    SendFragments(id, sent.data, std::vector<uint32_t>());
+    return id;
+}
+
+bool HpcStream::McastSender::Resend(uint64_t id, const std::vector<uint32_t>& fragments)
+{
+    std::map<uint64_t, SentMessage>::iterator sent = _history.find(id);
+    if (sent == _history.end())
+    {
+        return false;
+    }
+    SendFragments(id, sent->second.data, fragments);
+    return true;
+}
+
+void HpcStream::McastSender::Forget(uint64_t step)
+{
+    std::map<uint64_t, SentMessage>::iterator sent = _history.begin();
+    while (sent != _history.end())
+    {
+        if (sent->second.step < step)
+        {
+            sent = _history.erase(sent);
+        }
+        else
+        {
+            sent++;
+        }
+    }
+}
+
+void HpcStream::McastSender::SendFragments(uint64_t id, const std::vector<uint8_t>& data, const std::vector<uint32_t>& fragments)
+{
+    // fragments (all of them if none are listed) go out in batches of one system call each
+    const uint32_t batch_size = 64;
+    uint32_t i;
+    uint32_t count = std::max((data.size() + HPCSTREAM_DATAGRAM_PAYLOAD - 1) / HPCSTREAM_DATAGRAM_PAYLOAD, (size_t)1);
+    uint32_t total = fragments.empty() ? count : fragments.size();
+    uint8_t headers[batch_size][HPCSTREAM_DATAGRAM_HEADER];
+    struct iovec iov[batch_size][2];
+    struct mmsghdr msgs[batch_size];
+    uint64_t net_id = HpcStream::HToNLL(id);
+    uint32_t net_count = htonl(count);
+    for (i = 0; i < total; )
+    {
+        uint32_t batch = 0;
+        memset(msgs, 0, sizeof(msgs));
+        while (i < total && batch < batch_size)
+        {
+            uint32_t fragment = fragments.empty() ? i : fragments[i];
+            i++;
+            if (fragment >= count)
+            {
+                continue;
+            }
+            uint64_t offset = (uint64_t)fragment * HPCSTREAM_DATAGRAM_PAYLOAD;
+            uint32_t net_fragment = htonl(fragment);
+            memcpy(headers[batch], &net_id, sizeof(uint64_t));
+            memcpy(headers[batch] + sizeof(uint64_t), &net_fragment, sizeof(uint32_t));
+            memcpy(headers[batch] + sizeof(uint64_t) + sizeof(uint32_t), &net_count, sizeof(uint32_t));
+            iov[batch][0].iov_base = headers[batch];
+            iov[batch][0].iov_len = HPCSTREAM_DATAGRAM_HEADER;
+            iov[batch][1].iov_base = const_cast<uint8_t*>(data.data()) + offset;
+            iov[batch][1].iov_len = std::min((uint64_t)HPCSTREAM_DATAGRAM_PAYLOAD, data.size() - offset);
+            msgs[batch].msg_hdr.msg_name = &_group;
+            msgs[batch].msg_hdr.msg_namelen = sizeof(_group);
+            msgs[batch].msg_hdr.msg_iov = iov[batch];
+            msgs[batch].msg_hdr.msg_iovlen = 2;
+            batch++;
+        }
+        uint32_t done = 0;
+        while (done < batch)
+        {
+            int rc = sendmmsg(_fd, msgs + done, batch - done, 0);
+            if (rc < 0 && errno != EINTR)
+            {
+                // lost datagrams are asked for again by the clients
+                break;
+            }
+            done += std::max(rc, 0);
+        }
+    }
+}
+
+HpcStream::McastReceiver::McastReceiver(int fd) :
+    _fd(fd),
+    _next_id(1),
+    _unclaimed(0)
+{
+}
+
+HpcStream::McastReceiver::~McastReceiver()
+{
+    Skip(UINT64_MAX - 1);
+    close(_fd);
+}
+
+HpcStream::McastReceiver* HpcStream::McastReceiver::Join(const std::string& group, uint16_t port, const std::string& iface)
+{
+    struct ip_mreq membership;
+    if (inet_aton(group.c_str(), &(membership.imr_multiaddr)) == 0)
+    {
+        return NULL;
+    }
+    if (inet_aton(iface.c_str(), &(membership.imr_interface)) == 0)
+    {
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    // several clients on one host share the port - a large buffer holds a step's datagrams until they are read
+    int reuse = 1;
+    int receive_buffer = 67108864;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = membership.imr_multiaddr;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    return new McastReceiver(fd);
+}
+
+uint8_t* HpcStream::McastReceiver::Receive(uint64_t id, uint64_t length, int timeout, std::vector<uint32_t>& missing)
+{
+    uint32_t i;
+    uint32_t count = std::max((length + HPCSTREAM_DATAGRAM_PAYLOAD - 1) / HPCSTREAM_DATAGRAM_PAYLOAD, (uint64_t)1);
+    if (id < _next_id)
+    {
+        return NULL;
+    }
+    std::map<uint64_t, Partial>::iterator found = _partial.find(id);
+    if (found != _partial.end() && found->second.count != count)
+    {
+        // datagrams claiming another fragment count than the server announced
+        Forget(found);
+        found = _partial.end();
+    }
+    if (found == _partial.end())
+    {
+        _partial[id] = {new uint8_t[(uint64_t)count * HPCSTREAM_DATAGRAM_PAYLOAD], count, count, std::vector<bool>(count, false), true};
+    }
+    else if (!found->second.claimed)
+    {
+        found->second.claimed = true;
+        _unclaimed -= (uint64_t)count * HPCSTREAM_DATAGRAM_PAYLOAD;
+    }
+    while (_partial[id].remaining > 0)
+    {
+        struct pollfd pfd = {_fd, POLLIN, 0};
+        int rc = poll(&pfd, 1, timeout);
+        if (rc == 0 || (rc < 0 && errno != EINTR))
+        {
+            break;
+        }
+        ReadDatagrams();
+    }
+    Partial& partial = _partial[id];
+    missing.clear();
+    if (partial.remaining > 0)
+    {
+        for (i = 0; i < partial.count; i++)
+        {
+            if (!partial.have[i])
+            {
+                missing.push_back(i);
+            }
+        }
+        return NULL;
+    }
+    uint8_t *message = partial.data;
+    _partial.erase(id);
+    Skip(id);
+    return message;
+}
+
+void HpcStream::McastReceiver::Skip(uint64_t id)
+{
+    std::map<uint64_t, Partial>::iterator partial = _partial.begin();
+    while (partial != _partial.end() && partial->first <= id)
+    {
+        Forget(partial++);
+    }
+    _next_id = std::max(_next_id, id + 1);
+}
+
+void HpcStream::McastReceiver::Forget(std::map<uint64_t, Partial>::iterator partial)
+{
+    if (!partial->second.claimed)
+    {
+        _unclaimed -= (uint64_t)partial->second.count * HPCSTREAM_DATAGRAM_PAYLOAD;
+    }
+    delete[] partial->second.data;
+    _partial.erase(partial);
+}
+
+void HpcStream::McastReceiver::ReadDatagrams()
+{
+    // datagrams of messages already received (or given up on) are dropped, later ones kept until asked for - within a
+    // window of ids and a byte budget, since nothing checked their fragment count yet
+    uint8_t datagram[HPCSTREAM_DATAGRAM_HEADER + HPCSTREAM_DATAGRAM_PAYLOAD];
+    ssize_t size;
+    while ((size = recv(_fd, datagram, sizeof(datagram), MSG_DONTWAIT)) >= (ssize_t)HPCSTREAM_DATAGRAM_HEADER)
+    {
+        uint64_t id = HpcStream::NToHLL(*((uint64_t*)datagram));
+        uint32_t fragment = ntohl(*((uint32_t*)(datagram + sizeof(uint64_t))));
+        uint32_t count = ntohl(*((uint32_t*)(datagram + sizeof(uint64_t) + sizeof(uint32_t))));
+        if (id < _next_id || id >= _next_id + HPCSTREAM_MULTICAST_WINDOW || count == 0 || fragment >= count)
+        {
+            continue;
+        }
+        std::map<uint64_t, Partial>::iterator partial = _partial.find(id);
+        if (partial == _partial.end())
+        {
+            uint64_t size = (uint64_t)count * HPCSTREAM_DATAGRAM_PAYLOAD;
+            if (_unclaimed + size > HPCSTREAM_MULTICAST_UNCLAIMED)
+            {
+                continue;
+            }
+            _unclaimed += size;
+            partial = _partial.insert(std::make_pair(id, (Partial){new uint8_t[size], count, count, std::vector<bool>(count, false), false})).first;
+        }
+        if (fragment < partial->second.count && !partial->second.have[fragment])
+        {
+            memcpy(partial->second.data + (uint64_t)fragment * HPCSTREAM_DATAGRAM_PAYLOAD, datagram + HPCSTREAM_DATAGRAM_HEADER,
+                   size - HPCSTREAM_DATAGRAM_HEADER);
+            partial->second.have[fragment] = true;
+            partial->second.remaining--;
+        }
+    }
+}
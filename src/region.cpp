@@ -0,0 +1,476 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "hpcstream/region.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HPCSTREAM_AVX2_DISPATCH
+#endif
+
+namespace {
+    // vectorized comparisons check 64 bytes per iteration and return the number of bytes checked (or -1 on a difference)
+#if defined(__SSE2__)
+    int64_t BytesDifferSse2(const uint8_t *a, const uint8_t *b, uint64_t length)
+    {
+        int j;
+        uint64_t i;
+        for (i = 0; i + 64 <= length; i += 64)
+        {
+            __m128i eq = _mm_set1_epi8(-1);
+            for (j = 0; j < 4; j++)
+            {
+                __m128i va = _mm_loadu_si128((const __m128i*)(a + i + 16 * j));
+                __m128i vb = _mm_loadu_si128((const __m128i*)(b + i + 16 * j));
+                eq = _mm_and_si128(eq, _mm_cmpeq_epi8(va, vb));
+            }
+            if (_mm_movemask_epi8(eq) != 0xFFFF)
+            {
+                return -1;
+            }
+        }
+        return i;
+    }
+#endif
+
+#ifdef HPCSTREAM_AVX2_DISPATCH
+    __attribute__((target("avx2")))
+    int64_t BytesDifferAvx2(const uint8_t *a, const uint8_t *b, uint64_t length)
+    {
+        uint64_t i;
+        for (i = 0; i + 64 <= length; i += 64)
+        {
+            __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+            __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 32)), _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+            __m256i x = _mm256_or_si256(x0, x1);
+            if (!_mm256_testz_si256(x, x))
+            {
+                return -1;
+            }
+        }
+        return i;
+    }
+
+    bool HasAvx2()
+    {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2;
+    }
+#endif
+
+    template <typename T>
+    double Load(const uint8_t *src)
+    {
+        T val;
+        memcpy(&val, src, sizeof(T));
+        return static_cast<double>(val);
+    }
+
+    template <typename T>
+    void Store(uint8_t *dst, double val, bool integer)
+    {
+        T typed = static_cast<T>(integer ? std::round(val) : val);
+        memcpy(dst, &typed, sizeof(T));
+    }
+
+    double LoadElement(HpcStream::DataType type, const uint8_t *src)
+    {
+        switch (type)
+        {
+            case HpcStream::DataType::Uint8: return Load<uint8_t>(src);
+            case HpcStream::DataType::Uint16: return Load<uint16_t>(src);
+            case HpcStream::DataType::Uint32:
+            case HpcStream::DataType::ArraySize: return Load<uint32_t>(src);
+            case HpcStream::DataType::Uint64: return Load<uint64_t>(src);
+            case HpcStream::DataType::Int8: return Load<int8_t>(src);
+            case HpcStream::DataType::Int16: return Load<int16_t>(src);
+            case HpcStream::DataType::Int32: return Load<int32_t>(src);
+            case HpcStream::DataType::Int64: return Load<int64_t>(src);
+            case HpcStream::DataType::Float: return Load<float>(src);
+            case HpcStream::DataType::Double: return Load<double>(src);
+        }
+        return 0.0;
+    }
+
+    void StoreElement(HpcStream::DataType type, uint8_t *dst, double val)
+    {
+        switch (type)
+        {
+            case HpcStream::DataType::Uint8: Store<uint8_t>(dst, val, true); break;
+            case HpcStream::DataType::Uint16: Store<uint16_t>(dst, val, true); break;
+            case HpcStream::DataType::Uint32:
+            case HpcStream::DataType::ArraySize: Store<uint32_t>(dst, val, true); break;
+            case HpcStream::DataType::Uint64: Store<uint64_t>(dst, val, true); break;
+            case HpcStream::DataType::Int8: Store<int8_t>(dst, val, true); break;
+            case HpcStream::DataType::Int16: Store<int16_t>(dst, val, true); break;
+            case HpcStream::DataType::Int32: Store<int32_t>(dst, val, true); break;
+            case HpcStream::DataType::Int64: Store<int64_t>(dst, val, true); break;
+            case HpcStream::DataType::Float: Store<float>(dst, val, false); break;
+            case HpcStream::DataType::Double: Store<double>(dst, val, false); break;
+        }
+    }
+
+    uint64_t CeilDiv(uint64_t a, uint64_t b)
+    {
+        return (a + b - 1) / b;
+    }
+
+    void WriteUint32(uint8_t *dst, uint32_t val)
+    {
+        uint32_t net_val = htonl(val);
+        memcpy(dst, &net_val, sizeof(uint32_t));
+    }
+
+    uint32_t ReadUint32(const uint8_t *src)
+    {
+        uint32_t net_val;
+        memcpy(&net_val, src, sizeof(uint32_t));
+        return ntohl(net_val);
+    }
+}
+
+bool HpcStream::BytesDiffer(const uint8_t *a, const uint8_t *b, uint64_t length)
+{
+    int64_t i = 0;
+#ifdef HPCSTREAM_AVX2_DISPATCH
+    if (HasAvx2())
+    {
+        i = BytesDifferAvx2(a, b, length);
+    }
+#endif
+#if defined(__SSE2__)
+    if (i == 0)
+    {
+        i = BytesDifferSse2(a, b, length);
+    }
+#endif
+    if (i < 0)
+    {
+        return true;
+    }
+    return memcmp(a + i, b + i, length - i) != 0;
+}
+
+void HpcStream::ForEachBoxRow(uint32_t dims, const uint32_t *l_size, uint32_t size, const uint32_t *box_offset, const uint32_t *box_size,
+                              std::function<void(uint64_t, uint64_t)> row)
+{
+    uint32_t d;
+    for (d = 0; d < dims; d++)
+    {
+        if (box_size[d] == 0)
+        {
+            return;
+        }
+    }
+    // counter over all but the first dimension
+    std::vector<uint32_t> coord(dims, 0);
+    uint64_t row_bytes = (uint64_t)box_size[0] * size;
+    bool done = false;
+    while (!done)
+    {
+        uint64_t index = 0;
+        uint64_t stride = 1;
+        for (d = 0; d < dims; d++)
+        {
+            index += (uint64_t)(box_offset[d] + coord[d]) * stride;
+            stride *= l_size[d];
+        }
+        row(index * size, row_bytes);
+        done = true;
+        for (d = 1; d < dims && done; d++)
+        {
+            if (++coord[d] < box_size[d])
+            {
+                done = false;
+            }
+            else
+            {
+                coord[d] = 0;
+            }
+        }
+    }
+}
+
+void HpcStream::CopyBox(const uint8_t *src, uint32_t dims, const uint32_t *l_size, uint32_t size, const uint32_t *box_offset, const uint32_t *box_size, uint8_t *dst)
+{
+    uint64_t offset = 0;
+    ForEachBoxRow(dims, l_size, size, box_offset, box_size, [&](uint64_t start, uint64_t length) {
+        memcpy(dst + offset, src + start, length);
+        offset += length;
+    });
+}
+
+bool HpcStream::IntersectBoxes(uint32_t dims, const uint32_t *a_offset, const uint32_t *a_size, const uint32_t *b_offset, const uint32_t *b_size,
+                               uint32_t *offset, uint32_t *size)
+{
+    uint32_t d;
+    bool overlap = true;
+    for (d = 0; d < dims; d++)
+    {
+        uint64_t start = std::max(a_offset[d], b_offset[d]);
+        uint64_t end = std::min((uint64_t)a_offset[d] + a_size[d], (uint64_t)b_offset[d] + b_size[d]);
+        offset[d] = start;
+        size[d] = end > start ? end - start : 0;
+        overlap &= size[d] > 0;
+    }
+    if (!overlap)
+    {
+        for (d = 0; d < dims; d++)
+        {
+            size[d] = 0;
+        }
+    }
+    return overlap;
+}
+
+void HpcStream::SubsampledBox(uint32_t dims, const uint32_t *l_offset, const uint32_t *box_offset, const uint32_t *box_size, const uint32_t *factor,
+                              uint32_t *offset, uint32_t *size)
+{
+    uint32_t d;
+    for (d = 0; d < dims; d++)
+    {
+        uint64_t start = (uint64_t)l_offset[d] + box_offset[d];
+        uint64_t k = std::max(factor[d], 1u);
+        offset[d] = CeilDiv(start, k);
+        size[d] = CeilDiv(start + box_size[d], k) - offset[d];
+    }
+}
+
+void HpcStream::SubsampleBox(const uint8_t *src, HpcStream::DataType type, uint32_t dims, const uint32_t *l_size, const uint32_t *l_offset,
+                             const uint32_t *box_offset, const uint32_t *box_size, const uint32_t *factor, SampleFilter filter, uint8_t *dst)
+{
+    uint32_t d;
+    uint32_t size = HpcStream::GetDataTypeSize(type);
+    std::vector<uint32_t> sample_offset(dims);
+    std::vector<uint32_t> sample_size(dims);
+    HpcStream::SubsampledBox(dims, l_offset, box_offset, box_size, factor, sample_offset.data(), sample_size.data());
+    for (d = 0; d < dims; d++)
+    {
+        if (sample_size[d] == 0)
+        {
+            return;
+        }
+    }
+    // window of elements (local indices within the box) and their weights for each sample, per dimension
+    std::vector<std::vector<uint32_t> > first(dims);
+    std::vector<std::vector<std::vector<double> > > weights(dims);
+    std::vector<uint64_t> stride(dims);
+    uint64_t total_stride = 1;
+    for (d = 0; d < dims; d++)
+    {
+        uint32_t i;
+        int64_t k = std::max(factor[d], 1u);
+        int64_t box_start = (int64_t)l_offset[d] + box_offset[d];
+        int64_t box_end = box_start + box_size[d];
+        stride[d] = total_stride;
+        total_stride *= l_size[d];
+        first[d].resize(sample_size[d]);
+        weights[d].resize(sample_size[d]);
+        for (i = 0; i < sample_size[d]; i++)
+        {
+            int64_t pos = ((int64_t)sample_offset[d] + i) * k;
+            int64_t start = pos;
+            int64_t end = pos + 1;
+            if (filter == SampleFilter::Box)
+            {
+                end = pos + k;
+            }
+            else if (filter == SampleFilter::Linear)
+            {
+                start = pos - k + 1;
+                end = pos + k;
+            }
+            start = std::max(start, box_start);
+            end = std::min(end, box_end);
+            first[d][i] = start - l_offset[d];
+            double total = 0.0;
+            int64_t p;
+            for (p = start; p < end; p++)
+            {
+                double w = filter == SampleFilter::Linear ? 1.0 - (double)std::abs(p - pos) / k : 1.0;
+                weights[d][i].push_back(w);
+                total += w;
+            }
+            for (p = 0; p < weights[d][i].size(); p++)
+            {
+                weights[d][i][p] /= total;
+            }
+        }
+    }
+    // visit samples (first dimension fastest), summing the weighted elements of each sample's window
+    std::vector<uint32_t> sample(dims, 0);
+    std::vector<uint32_t> window(dims);
+    uint64_t out = 0;
+    bool done = false;
+    while (!done)
+    {
+        if (filter == SampleFilter::Nearest)
+        {
+            uint64_t index = 0;
+            for (d = 0; d < dims; d++)
+            {
+                index += first[d][sample[d]] * stride[d];
+            }
+            memcpy(dst + out * size, src + index * size, size);
+        }
+        else
+        {
+            double sum = 0.0;
+            bool window_done = false;
+            std::fill(window.begin(), window.end(), 0);
+            while (!window_done)
+            {
+                uint64_t index = 0;
+                double w = 1.0;
+                for (d = 0; d < dims; d++)
+                {
+                    index += (first[d][sample[d]] + window[d]) * stride[d];
+                    w *= weights[d][sample[d]][window[d]];
+                }
+                sum += w * LoadElement(type, src + index * size);
+                window_done = true;
+                for (d = 0; d < dims && window_done; d++)
+                {
+                    if (++window[d] < weights[d][sample[d]].size())
+                    {
+                        window_done = false;
+                    }
+                    else
+                    {
+                        window[d] = 0;
+                    }
+                }
+            }
+            StoreElement(type, dst + out * size, sum);
+        }
+        out++;
+        done = true;
+        for (d = 0; d < dims && done; d++)
+        {
+            if (++sample[d] < sample_size[d])
+            {
+                done = false;
+            }
+            else
+            {
+                sample[d] = 0;
+            }
+        }
+    }
+}
+
+uint64_t HpcStream::MaxDeltaTilesSize(uint32_t dims, const uint32_t *l_size, uint32_t size, uint32_t tile_size)
+{
+    uint32_t d;
+    uint64_t num_tiles = 1;
+    uint64_t length = 1;
+    for (d = 0; d < dims; d++)
+    {
+        num_tiles *= (l_size[d] + tile_size - 1) / tile_size;
+        length *= l_size[d];
+    }
+    return sizeof(uint32_t) + num_tiles * 2 * dims * sizeof(uint32_t) + length * size;
+}
+
+uint64_t HpcStream::EncodeDeltaTiles(const uint8_t *val, uint8_t *prev, uint32_t dims, const uint32_t *l_size, uint32_t size, uint32_t tile_size, uint8_t *dst)
+{
+    uint32_t d;
+    uint32_t num_changed = 0;
+    uint64_t offset = sizeof(uint32_t);
+    std::vector<uint32_t> tile(dims, 0);
+    std::vector<uint32_t> tile_offset(dims);
+    std::vector<uint32_t> tile_extent(dims);
+    bool done = false;
+    while (!done)
+    {
+        for (d = 0; d < dims; d++)
+        {
+            tile_offset[d] = tile[d] * tile_size;
+            tile_extent[d] = std::min(tile_size, l_size[d] - tile_offset[d]);
+        }
+        bool changed = false;
+        ForEachBoxRow(dims, l_size, size, tile_offset.data(), tile_extent.data(), [&](uint64_t start, uint64_t length) {
+            changed = changed || HpcStream::BytesDiffer(val + start, prev + start, length);
+        });
+        if (changed)
+        {
+            for (d = 0; d < dims; d++)
+            {
+                WriteUint32(dst + offset + d * sizeof(uint32_t), tile_offset[d]);
+                WriteUint32(dst + offset + (dims + d) * sizeof(uint32_t), tile_extent[d]);
+            }
+            offset += 2 * dims * sizeof(uint32_t);
+            ForEachBoxRow(dims, l_size, size, tile_offset.data(), tile_extent.data(), [&](uint64_t start, uint64_t length) {
+                memcpy(dst + offset, val + start, length);
+                memcpy(prev + start, val + start, length);
+                offset += length;
+            });
+            num_changed++;
+        }
+        // next tile (first dimension fastest)
+        done = true;
+        for (d = 0; d < dims && done; d++)
+        {
+            if (++tile[d] * tile_size < l_size[d])
+            {
+                done = false;
+            }
+            else
+            {
+                tile[d] = 0;
+            }
+        }
+    }
+    WriteUint32(dst, num_changed);
+    return offset;
+}
+
+bool HpcStream::ApplyDeltaTiles(const uint8_t *src, uint64_t length, uint8_t *val, uint32_t dims, const uint32_t *l_size, uint32_t size, bool swap_bytes)
+{
+    uint32_t i, d;
+    if (length < sizeof(uint32_t))
+    {
+        return false;
+    }
+    uint32_t num_tiles = ReadUint32(src);
+    uint64_t offset = sizeof(uint32_t);
+    std::vector<uint32_t> tile_offset(dims);
+    std::vector<uint32_t> tile_extent(dims);
+    for (i = 0; i < num_tiles; i++)
+    {
+        if (length - offset < 2 * dims * sizeof(uint32_t))
+        {
+            return false;
+        }
+        uint64_t tile_bytes = size;
+        for (d = 0; d < dims; d++)
+        {
+            tile_offset[d] = ReadUint32(src + offset + d * sizeof(uint32_t));
+            tile_extent[d] = ReadUint32(src + offset + (dims + d) * sizeof(uint32_t));
+            if ((uint64_t)tile_offset[d] + tile_extent[d] > l_size[d])
+            {
+                return false;
+            }
+            tile_bytes *= tile_extent[d];
+        }
+        offset += 2 * dims * sizeof(uint32_t);
+        if (length - offset < tile_bytes)
+        {
+            return false;
+        }
+        ForEachBoxRow(dims, l_size, size, tile_offset.data(), tile_extent.data(), [&](uint64_t start, uint64_t row_length) {
+            if (swap_bytes)
+            {
+                HpcStream::SwapBytes(src + offset, val + start, row_length / size, size);
+            }
+            else
+            {
+                memcpy(val + start, src + offset, row_length);
+            }
+            offset += row_length;
+        });
+    }
+    return offset == length;
+}
@@ -1,10 +1,37 @@
 #include "hpcstream/server.h"
 
-HpcStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm) :
-    _num_connections(0),
+HpcStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm, const HpcStream::ServerOptions& options) :
+    _num_senders(0),
     _ip_address_list(NULL),
     _port_list(NULL),
-    _server(NULL)
+    _group_size_list(NULL),
+    _num_rails(1),
+    _shm_size(options.shm_size),
+    _shm_count(0),
+    _uring(NULL),
+    _bulk_listener(-1),
+    _bulk_port(0),
+    _zerocopy_threshold(options.zerocopy_threshold),
+    _bulk_streams(std::max(options.bulk_streams, 1u)),
+    _stripe_size(std::max(options.stripe_size, (uint64_t)4096)),
+    _next_bulk_send(1),
+    _mcast(NULL),
+    _mcast_port(0),
+    _mcast_step(0),
+    _num_connections(0),
+    _server(NULL),
+    _num_write_buffers(std::max(options.write_buffers, 1u)),
+    _async_write(options.async_write),
+    _step_frames(options.step_frames),
+    _send_queue_depth(options.send_queue_depth),
+    _dropped_frames(0),
+    _write_count(0),
+    _write_complete(0),
+    _progress_stop(false),
+    _size_deps_built(false),
+    _codec_threads(std::max(options.codec_threads, 1)),
+    _codec_block_size(std::max(options.codec_block_size, (uint64_t)8)),
+    _codec_pool(NULL)
 {
     MPI_Comm_dup(comm, &_comm);
     int rc = MPI_Comm_rank(_comm, &_rank);
@@ -13,44 +40,112 @@ HpcStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_ma
         fprintf(stderr, "Error obtaining MPI task ID information\n");
     }
 
-    NetSocket::ServerOptions options = NetSocket::CreateServerOptions();
-    options.flags |= NetSocket::GeneralFlags::TcpNoDelay;
-    int i;
-    int num_ports = port_max - port_min + 1;
-    uint16_t *port_options = new uint16_t[num_ports];
-    for (i = 0; i < num_ports; i++)
+    // with aggregation, ranks sharing a node send through the node's lowest rank - otherwise every rank sends its own block
+    if (options.aggregate)
+    {
+        MPI_Comm_split_type(_comm, MPI_COMM_TYPE_SHARED, _rank, MPI_INFO_NULL, &_group_comm);
+    }
+    else
+    {
+        MPI_Comm_split(_comm, _rank, 0, &_group_comm);
+    }
+    MPI_Comm_rank(_group_comm, &_group_rank);
+    MPI_Comm_size(_group_comm, &_group_size);
+    // scalars differ per rank of a group, so they are sent with the group's values rather than in step frames
+    if (_group_size > 1)
     {
-        port_options[i] = port_min + i;
+        _step_frames = false;
     }
-    std::shuffle(port_options, port_options + num_ports, std::default_random_engine(time(0)));
-    i = 0;
-    _port = port_options[0];
-    bool address_in_use = true;
-    while (address_in_use && _port <= port_max)
+    MPI_Comm sender_comm;
+    MPI_Comm_split(_comm, _group_rank == 0 ? 0 : MPI_UNDEFINED, _rank, &sender_comm);
+
+    _port = 0;
+    if (_group_rank == 0)
     {
-        try
+        NetSocket::ServerOptions ns_options = NetSocket::CreateServerOptions();
+        ns_options.flags |= NetSocket::GeneralFlags::TcpNoDelay;
+        int i;
+        int num_ports = port_max - port_min + 1;
+        uint16_t *port_options = new uint16_t[num_ports];
+        for (i = 0; i < num_ports; i++)
         {
-            _server = new NetSocket::Server(_port, options);
-            address_in_use = false;
+            port_options[i] = port_min + i;
         }
-        catch (std::exception& e)
+        std::shuffle(port_options, port_options + num_ports, std::default_random_engine(time(0)));
+        i = 0;
+        _port = port_options[0];
+        bool address_in_use = true;
+        while (address_in_use && _port <= port_max)
         {
-            i++;
-            _port = port_options[i];
+            try
+            {
+                _server = new NetSocket::Server(_port, ns_options);
+                address_in_use = false;
+            }
+            catch (std::exception& e)
+            {
+                i++;
+                _port = port_options[i];
+            }
         }
-    }
-    delete[] port_options;
+        delete[] port_options;
 
-    uint8_t ip_address[4];
-    GetIpAddress(iface, ip_address);
-    uint16_t net_port = htons(_port);
-    if (_rank == 0)
-    {
-        _ip_address_list = new uint8_t[4 * _num_ranks];
-        _port_list = new uint16_t[_num_ranks];
+        // every interface listed (comma separated) is a rail - senders advertise the address of each, the first is used
+        // where one address is needed (senders with fewer rails repeat their first)
+        std::vector<std::string> ifaces;
+        std::istringstream iface_list(iface);
+        std::string iface_name;
+        while (std::getline(iface_list, iface_name, ','))
+        {
+            ifaces.push_back(iface_name);
+        }
+        _num_rails = std::max((int)ifaces.size(), 1);
+        MPI_Allreduce(MPI_IN_PLACE, &_num_rails, 1, MPI_INT, MPI_MAX, sender_comm);
+        _rail_addresses.assign(4 * _num_rails, 0);
+        for (i = 0; i < _num_rails; i++)
+        {
+            if (i < ifaces.size())
+            {
+                GetIpAddress(ifaces[i].c_str(), _rail_addresses.data() + 4 * i);
+            }
+            else
+            {
+                memcpy(_rail_addresses.data() + 4 * i, _rail_addresses.data(), 4);
+            }
+        }
+        memcpy(_ip_address, _rail_addresses.data(), 4);
+        uint16_t net_port = htons(_port);
+        uint32_t net_group_size = htonl(_group_size);
+        MPI_Comm_size(sender_comm, &_num_senders);
+        if (_rank == 0)
+        {
+            _ip_address_list = new uint8_t[4 * _num_rails * _num_senders];
+            _port_list = new uint16_t[_num_senders];
+            _group_size_list = new uint32_t[_num_senders];
+        }
+        MPI_Gather(_rail_addresses.data(), 4 * _num_rails, MPI_UINT8_T, _ip_address_list, 4 * _num_rails, MPI_UINT8_T, 0, sender_comm);
+        MPI_Gather(&net_port, 1, MPI_UINT16_T, _port_list, 1, MPI_UINT16_T, 0, sender_comm);
+        MPI_Gather(&net_group_size, 1, MPI_UINT32_T, _group_size_list, 1, MPI_UINT32_T, 0, sender_comm);
+        int sender_rank;
+        MPI_Comm_rank(sender_comm, &sender_rank);
+        MPI_Comm_free(&sender_comm);
+
+        if (options.uring)
+        {
+            OpenBulkListener();
+        }
+        else if (options.zerocopy_threshold > 0 && _rank == 0)
+        {
+            fprintf(stderr, "[HpcStream] Warning: zero-copy sends need the io_uring data socket (ServerOptions::uring)\n");
+        }
+        // each sender multicasts on its own port of the group
+        if (options.multicast_group != NULL)
+        {
+            _mcast_port = options.multicast_port + sender_rank;
+            _mcast = HpcStream::McastSender::Create(options.multicast_group, _mcast_port, _ip_address);
+            _mcast_group = options.multicast_group;
+        }
     }
-    MPI_Gather(ip_address, 4, MPI_UINT8_T, _ip_address_list, 4, MPI_UINT8_T, 0, _comm);
-    MPI_Gather(&net_port, 1, MPI_UINT16_T, _port_list, 1, MPI_UINT16_T, 0, _comm);
 
     // data storage checks - little endian, ieee 754
     uint32_t int_test = 0x00000001;
@@ -73,7 +168,58 @@ HpcStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_ma
 
 HpcStream::Server::~Server()
 {
-    // TODO: stop server
+    if (_progress_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _progress_stop = true;
+        }
+        _cond.notify_all();
+        WakeProgressThread();
+        _progress_thread.join();
+        {
+            std::lock_guard<std::mutex> lock(_events->mutex);
+            _events->stop = true;
+        }
+        // event thread waits in NetSocket - a connection of our own gets it out
+        int wake_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in wake_addr;
+        memset(&wake_addr, 0, sizeof(wake_addr));
+        wake_addr.sin_family = AF_INET;
+        wake_addr.sin_port = htons(_port);
+        wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool woken = wake_fd >= 0 && connect(wake_fd, (struct sockaddr*)&wake_addr, sizeof(wake_addr)) == 0;
+        if (woken)
+        {
+            _event_thread.join();
+        }
+        else
+        {
+            fprintf(stderr, "[HpcStream] Warning: could not wake event thread, leaving it running\n");
+            _event_thread.detach();
+        }
+        if (wake_fd >= 0)
+        {
+            close(wake_fd);
+        }
+        if (!woken)
+        {
+            // detached thread still uses the socket server
+            _server = NULL;
+        }
+    }
+    delete _codec_pool;
+    delete _uring;
+    delete _mcast;
+    for (auto const& hello : _bulk_hellos)
+    {
+        close(hello.fd);
+    }
+    if (_bulk_listener >= 0)
+    {
+        close(_bulk_listener);
+    }
+    delete _server;
 }
 
 char* HpcStream::Server::GetMasterIpAddress()
@@ -105,10 +251,11 @@ uint16_t HpcStream::Server::GetMasterPort()
     return port;
 }
 
-void HpcStream::Server::DefineVar(std::string name, HpcStream::DataType base_type, std::string global_size, std::string local_size, std::string local_offset)
+HpcStream::VarHandle HpcStream::Server::DefineVar(std::string name, HpcStream::DataType base_type, std::string global_size, std::string local_size, std::string local_offset, uint8_t codec, uint8_t filter)
 {
     int i;
     SharedVar var;
+    var.name = name;
     var.type = base_type;
     int dim_a = std::count(global_size.begin(), global_size.end(), ',') + 1;
     int dim_b = std::count(local_size.begin(), local_size.end(), ',') + 1;
@@ -118,7 +265,7 @@ void HpcStream::Server::DefineVar(std::string name, HpcStream::DataType base_typ
         (!global_size.empty() && !local_size.empty() && !local_offset.empty())))
     {
         fprintf(stderr, "[HpcStream] Error: global and local dimensions do not match (%s)\n", name.c_str());
-        return;
+        return HPCSTREAM_INVALID_HANDLE;
     }
     var.dims = dim_a;
     var.gs_vars = ParseVarCounts(global_size);
@@ -146,15 +293,9 @@ void HpcStream::Server::DefineVar(std::string name, HpcStream::DataType base_typ
             var.size = 8;
             break; 
     }
-    uint32_t name_len = name.length();
     if (var.gs_vars.size() == 0)
     {
         var.length = 1;
-        var.send_buf = new uint8_t[sizeof(uint32_t) + name_len + var.size];
-        var.val = var.send_buf + sizeof(uint32_t) + name_len; //new uint8_t[var.size];
-        memcpy(var.send_buf, &name_len, sizeof(uint32_t));
-        memcpy(var.send_buf + sizeof(uint32_t), name.c_str(), name_len);
-        memset(var.val, 0, var.size);
         var.g_size = NULL;
         var.l_size = NULL;
         var.l_offset = NULL;
@@ -162,8 +303,6 @@ void HpcStream::Server::DefineVar(std::string name, HpcStream::DataType base_typ
     else
     {
         var.length = 0;
-        //var.val = NULL;
-        var.send_buf = NULL;
         var.g_size = new uint32_t[var.dims];
         var.l_size = new uint32_t[var.dims];
         var.l_offset = new uint32_t[var.dims];
@@ -171,337 +310,1633 @@ void HpcStream::Server::DefineVar(std::string name, HpcStream::DataType base_typ
         memset(var.l_size, 0, var.dims * sizeof(uint32_t));
         memset(var.l_offset, 0, var.dims * sizeof(uint32_t));
     }
+    var.send_buf = NULL;
+    var.val = NULL;
+    var.slot = 0;
     var.updated = false;
+    var.resize_pending = false;
+    // codecs only apply to arrays - scalars are packed into step frames
+    var.codec = var.gs_vars.size() > 0 ? codec : (uint8_t)HpcStream::CodecId::NoCodec;
+    if (var.codec != HpcStream::CodecId::NoCodec && HpcStream::GetCodec(var.codec) == NULL)
+    {
+        fprintf(stderr, "[HpcStream] Error: no codec registered with id %u (%s)\n", var.codec, name.c_str());
+        var.codec = HpcStream::CodecId::NoCodec;
+    }
+    // values gathered from the ranks of a group are sent as they are
+    if (var.codec != HpcStream::CodecId::NoCodec && _group_size > 1)
+    {
+        fprintf(stderr, "[HpcStream] Warning: codec ignored for values aggregated across ranks (%s)\n", name.c_str());
+        var.codec = HpcStream::CodecId::NoCodec;
+    }
+    // lossy quantization needs floating point values
+    if (var.codec == HpcStream::CodecId::Quantize && base_type != DataType::Float && base_type != DataType::Double)
+    {
+        fprintf(stderr, "[HpcStream] Error: quantize codec requires Float or Double values (%s)\n", name.c_str());
+        var.codec = HpcStream::CodecId::NoCodec;
+    }
+    // filters only help a codec that follows them (and would break the quantize codec's prediction)
+    var.filter = var.codec != HpcStream::CodecId::NoCodec && var.codec != HpcStream::CodecId::Quantize ? filter : (uint8_t)HpcStream::FilterId::NoFilter;
+    if (filter != HpcStream::FilterId::NoFilter && var.filter == HpcStream::FilterId::NoFilter)
+    {
+        fprintf(stderr, "[HpcStream] Warning: filter ignored for variable without a lossless codec (%s)\n", name.c_str());
+    }
+    var.error_mode = HpcStream::ErrorMode::Relative;
+    var.error_bound = 1e-4;
+    var.tile_size = 0;
+    var.prev_val = NULL;
+    var.prev_valid = false;
+
+    VarHandle handle;
+    std::map<std::string, VarHandle>::iterator existing = _var_handles.find(name);
+    if (existing != _var_handles.end())
+    {
+        handle = existing->second;
+        FreeVarBuffers(handle);
+        _vars[handle] = var;
+    }
+    else
+    {
+        handle = _vars.size();
+        _vars.push_back(var);
+        _var_handles[name] = handle;
+    }
+    _size_deps_built = false;
+    if (var.length > 0)
+    {
+        AllocateSendBuffers(handle);
+        for (i = 0; i < _num_write_buffers; i++)
+        {
+            memset(_vars[handle].send_bufs[i] + HPCSTREAM_HEADER_SIZE, 0, var.size);
+        }
+    }
+    return handle;
+}
 
-    _vars[name] = var;
+HpcStream::VarHandle HpcStream::Server::GetVarHandle(std::string name)
+{
+    std::map<std::string, VarHandle>::iterator it = _var_handles.find(name);
+    if (it == _var_handles.end())
+    {
+        fprintf(stderr, "[HpcStream] Error: no variable named %s\n", name.c_str());
+        return HPCSTREAM_INVALID_HANDLE;
+    }
+    return it->second;
 }
 
 void HpcStream::Server::VarDefinitionsComplete(StreamBehavior behavior, int initial_wait_count)
 {
     _stream_behavior = behavior;
+    if (behavior == StreamBehavior::DropFrames)
+    {
+        ReserveQueuedSlots();
+    }
     GenerateVarsBuffer();
+    BuildSizeDependencies();
+    if (_codec_pool == NULL && std::any_of(_vars.begin(), _vars.end(), [](const SharedVar& x) {return x.codec != HpcStream::CodecId::NoCodec;}))
+    {
+        _codec_pool = new HpcStream::WorkerPool(_codec_threads);
+    }
 
-    while (_num_connections < initial_wait_count)
+    while (_server != NULL && _num_connections < initial_wait_count)
     {
         NetSocket::Server::Event event = _server->WaitForNextEvent();
-        if (!HandleNewConnection(event))
+        ProcessEvent(event);
+    }
+
+    if (_async_write && _server != NULL)
+    {
+        _events = std::make_shared<EventQueue>();
+        _events->wake = false;
+        _events->stop = false;
+        _event_thread = std::thread(&HpcStream::Server::ReadEvents, _server, _events);
+        if (_uring != NULL)
         {
-            if (event.type != NetSocket::Server::EventType::SendFinished)
-            {
-                if (event.type == NetSocket::Server::EventType::ReceiveBinary)
-                {
-                    delete[] event.binary_data;
-                }
-                fprintf(stderr, "unexpected event while connecting to clients\n");
-            }
+            _uring->OnComplete([this] {WakeProgressThread();});
         }
+        _progress_thread = std::thread(&HpcStream::Server::ProgressThread, this);
+    }
+}
+
+void HpcStream::Server::SetErrorBound(std::string name, HpcStream::ErrorMode mode, double bound)
+{
+    VarHandle handle = GetVarHandle(name);
+    if (handle != HPCSTREAM_INVALID_HANDLE)
+    {
+        SetErrorBound(handle, mode, bound);
+    }
+}
+
+void HpcStream::Server::SetErrorBound(VarHandle handle, HpcStream::ErrorMode mode, double bound)
+{
+    SharedVar& var = _vars[handle];
+    if (var.codec != HpcStream::CodecId::Quantize)
+    {
+        fprintf(stderr, "[HpcStream] Warning: error bound ignored for variable without the quantize codec (%s)\n", var.name.c_str());
     }
+    var.error_mode = mode;
+    var.error_bound = std::max(bound, 0.0);
+}
+
+void HpcStream::Server::SetDeltaTiles(std::string name, uint32_t tile_size)
+{
+    VarHandle handle = GetVarHandle(name);
+    if (handle != HPCSTREAM_INVALID_HANDLE)
+    {
+        SetDeltaTiles(handle, tile_size);
+    }
+}
+
+void HpcStream::Server::SetDeltaTiles(VarHandle handle, uint32_t tile_size)
+{
+    int i;
+    SharedVar& var = _vars[handle];
+    if (var.gs_vars.size() == 0)
+    {
+        fprintf(stderr, "[HpcStream] Warning: delta tiles ignored for scalar variable (%s)\n", var.name.c_str());
+        return;
+    }
+    if (_group_size > 1)
+    {
+        fprintf(stderr, "[HpcStream] Warning: delta tiles ignored for values aggregated across ranks (%s)\n", var.name.c_str());
+        return;
+    }
+    for (i = 0; i < var.send_bufs.size(); i++)
+    {
+        WaitForPendingSends(handle, i);
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    var.tile_size = tile_size;
+    AllocateDeltaBuffers(handle);
 }
 
 void HpcStream::Server::SetValue(std::string name, void *value)
 {
-    if (_vars[name].length == 0)
+    VarHandle handle = GetVarHandle(name);
+    if (handle != HPCSTREAM_INVALID_HANDLE)
+    {
+        SetValue(handle, value);
+    }
+}
+
+void HpcStream::Server::SetValue(VarHandle handle, void *value)
+{
+    SharedVar& var = _vars[handle];
+    if (var.resize_pending)
+    {
+        ResizeArray(handle);
+    }
+    if (var.length == 0)
     {
         fprintf(stderr, "[HpcStream] Error: cannot set value without initializing sizes\n");
         return;
     }
-    memcpy(_vars[name].val, value, _vars[name].size * _vars[name].length);
-    if (_vars[name].dims == 1 && _vars[name].length == 1 && _vars[name].type == HpcStream::DataType::ArraySize)
+    // values are sent without copying, so write into the next ring slot once no step is still using it
+    if (!var.updated)
     {
-        int i;
-        for (auto& x : _vars)
+        int next = (var.slot + 1) % _num_write_buffers;
+        WaitForPendingSends(handle, next);
+        var.slot = next;
+        var.send_buf = var.send_bufs[next];
+        var.val = var.send_buf + HPCSTREAM_HEADER_SIZE;
+    }
+    memcpy(var.val, value, var.size * var.length);
+    var.enc_sizes[var.slot] = -1;
+    // if array size, copy value to dependent arrays (buffers are resized once all sizes are known)
+    if (var.dims == 1 && var.length == 1 && var.type == HpcStream::DataType::ArraySize)
+    {
+        if (!_size_deps_built)
         {
-            uint32_t pos = find(x.second.gs_vars.begin(), x.second.gs_vars.end(), name) - x.second.gs_vars.begin();
-            if (pos < x.second.gs_vars.size())
-            {
-                x.second.g_size[pos] = *((uint32_t*)_vars[name].val);
-            }
-            pos = find(x.second.ls_vars.begin(), x.second.ls_vars.end(), name) - x.second.ls_vars.begin();
-            if (pos < x.second.ls_vars.size())
-            {
-                x.second.l_size[pos] = *((uint32_t*)_vars[name].val);
-                bool non_zero = true;
-                uint32_t length = 1;
-                for (i = 0; i < x.second.dims; i++)
-                {
-                    non_zero &= x.second.l_size[i] != 0;
-                    length *= x.second.l_size[i];
-                }
-                if (non_zero)
-                {
-                    uint32_t name_len = x.first.length();
-                    if (x.second.send_buf != NULL) delete[] x.second.send_buf;
-                    //if (x.second.val != NULL) delete[] x.second.val;
-                    x.second.length = length;
-                    x.second.send_buf = new uint8_t[sizeof(uint32_t) + name_len + (x.second.size * x.second.length)];
-                    x.second.val = x.second.send_buf + sizeof(uint32_t) + name_len;
-                    memcpy(x.second.send_buf, &name_len, sizeof(uint32_t));
-                    memcpy(x.second.send_buf + sizeof(uint32_t), x.first.c_str(), name_len);
-                    //x.second.val = new uint8_t[x.second.size * x.second.length];
-                }
-            }
-            pos = find(x.second.lo_vars.begin(), x.second.lo_vars.end(), name) - x.second.lo_vars.begin();
-            if (pos < x.second.lo_vars.size())
+            BuildSizeDependencies();
+        }
+        uint32_t size_val = *((uint32_t*)var.val);
+        for (auto const& dep : var.size_deps)
+        {
+            SharedVar& x = _vars[dep.var];
+            switch (dep.role)
             {
-                x.second.l_offset[pos] = *((uint32_t*)_vars[name].val);
+                case SizeRole::GlobalSize:
+                    x.g_size[dep.dim] = size_val;
+                    break;
+                case SizeRole::LocalSize:
+                    if (x.l_size[dep.dim] != size_val)
+                    {
+                        x.l_size[dep.dim] = size_val;
+                        x.resize_pending = true;
+                    }
+                    break;
+                case SizeRole::LocalOffset:
+                    x.l_offset[dep.dim] = size_val;
+                    break;
             }
         }
     }
-    _vars[name].updated = true;
+    var.updated = true;
 }
 
-void HpcStream::Server::Write()
+HpcStream::Server::WriteRequest HpcStream::Server::Write()
 {
-    bool new_conn = false;
-    for (auto const& c : _connections)
+    int pass;
+    Step step;
+    VarHandle h;
+    for (h = 0; h < _vars.size(); h++)
+    {
+        if (_vars[h].resize_pending)
+        {
+            ResizeArray(h);
+        }
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_async_write)
     {
-        new_conn |= c.second.is_new;
+        // only block if this step would lap the ring of write buffers
+        _cond.wait(lock, [&] {return _write_count - _write_complete < _num_write_buffers;});
     }
-    for (auto& x : _vars)
+    step.id = ++_write_count;
+    // scalars first (so clients know array sizes), then arrays - each slot is held until the step is sent
+    for (pass = 0; pass < 2; pass++)
     {
-        if ((x.second.updated || new_conn) && x.second.gs_vars.size() == 0)
+        for (h = 0; h < _vars.size(); h++)
         {
-            //uint32_t name_len = x.first.length();
-            uint32_t send_size = sizeof(uint32_t) + x.first.length() + (x.second.size * x.second.length);
-            //uint8_t *send_buffer = new uint8_t[send_size];
-            //memcpy(send_buffer, &name_len, sizeof(uint32_t));
-            //memcpy(send_buffer + sizeof(uint32_t), x.first.c_str(), name_len);
-            //memcpy(send_buffer + sizeof(uint32_t) + name_len, x.second.val, x.second.size * x.second.length);
-            for (auto const& c : _connections)
+            SharedVar& x = _vars[h];
+            if ((x.gs_vars.size() > 0) == (pass == 1) && x.length > 0)
             {
-                if (c.second.is_new || x.second.updated)
+                uint64_t payload_size = x.size * x.length;
+                StepVar sv = {h, x.slot, HPCSTREAM_HEADER_SIZE + payload_size, x.updated, NULL, std::vector<uint32_t>(), std::vector<uint32_t>()};
+                if (x.gs_vars.size() > 0)
+                {
+                    // SetValue() of an ArraySize variable may change sizes and offsets before the step is sent
+                    sv.l_size.assign(x.l_size, x.l_size + x.dims);
+                    sv.l_offset.assign(x.l_offset, x.l_offset + x.dims);
+                }
+                if (x.updated)
                 {
-                    //c.second.client->Send(send_buffer, send_size, NetSocket::CopyMode::MemCopy);
-                    c.second.client->Send(x.second.send_buf, send_size, NetSocket::CopyMode::ZeroCopy);
+                    HpcStream::WriteMessageHeader(x.send_bufs[x.slot], MessageType::VarData, h, step.id, payload_size);
                 }
+                x.sends_pending[x.slot]++;
+                x.updated = false;
+                step.vars.push_back(sv);
             }
-            //delete[] send_buffer;
-            x.second.updated = false;
         }
     }
-    for (auto& x : _vars)
+    if (_group_size > 1)
     {
-        if ((x.second.updated || new_conn) && x.second.gs_vars.size() > 0)
+        // values are gathered to the rank sending for the group, which is the only one with connections
+        lock.unlock();
+        if (!GatherGroup(step))
         {
-            uint32_t name_len = x.first.length();
-            uint32_t send_size = sizeof(uint32_t) + name_len + (x.second.size * x.second.length);
-            uint8_t *send_buffer = new uint8_t[send_size];
-            memcpy(send_buffer, &name_len, sizeof(uint32_t));
-            memcpy(send_buffer + sizeof(uint32_t), x.first.c_str(), name_len);
-            memcpy(send_buffer + sizeof(uint32_t) + name_len, x.second.val, x.second.size * x.second.length);
-            for (auto const& c : _connections)
-            {
-                if (c.second.is_new || x.second.updated)
-                {
-                    c.second.client->Send(send_buffer, send_size, NetSocket::CopyMode::MemCopy);
-                    //c.second.client->Send(send_buffer, send_size, NetSocket::CopyMode::ZeroCopy);
-                }
-            }
-            delete[] send_buffer;
-            x.second.updated = false;
+            return step.id;
         }
+        lock.lock();
     }
-    uint8_t done = 255;
-    for (auto& c : _connections)
+    if (_async_write)
+    {
+        _step_queue.push_back(step);
+        lock.unlock();
+        _cond.notify_all();
+        WakeProgressThread();
+    }
+    else
+    {
+        lock.unlock();
+        SendStep(step);
+    }
+    return step.id;
+}
+
+bool HpcStream::Server::TestWrite(WriteRequest request)
+{
+    if (!_async_write && _server != NULL)
     {
-        c.second.client->Send(&done, 1, NetSocket::CopyMode::MemCopy);
-        if (c.second.is_new)
+        ReapBulk();
+        NetSocket::Server::Event event = _server->PollForNextEvent();
+        while (event.type != NetSocket::Server::EventType::None)
         {
-            c.second.is_new = false;
+            ProcessEvent(event);
+            event = _server->PollForNextEvent();
         }
     }
+    return _write_complete >= request;
 }
 
-void HpcStream::Server::AdvanceTimeStep()
+void HpcStream::Server::WaitWrite(WriteRequest request)
 {
-    if (_stream_behavior == StreamBehavior::WaitForAll)
+    if (_async_write)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] {return _write_complete >= request;});
+    }
+    else
     {
-        bool all_ready_to_advance = false;
-        std::map<std::string, bool> client_ready_to_advance;
-        for (auto const& c : _connections)
+        while (_write_complete < request)
         {
-            client_ready_to_advance[c.first] = false;
+            NetSocket::Server::Event event = NextEvent();
+            ProcessEvent(event);
         }
-        std::string event_client_id;
-        while (!all_ready_to_advance)
+    }
+}
+
+uint64_t HpcStream::Server::GetDroppedFrameCount()
+{
+    return _dropped_frames;
+}
+
+void HpcStream::Server::AdvanceTimeStep()
+{
+    if (_async_write || _server == NULL)
+    {
+        // progress thread handles client events - only Write() blocks, when the buffer ring is full
+        // ranks sending through their group's sender have no client events (Write() paces them instead)
+        return;
+    }
+    if (_stream_behavior == StreamBehavior::WaitForAll)
+    {
+        while (!ReadyForNextStep())
         {
-            NetSocket::Server::Event event = _server->WaitForNextEvent();
-            if (event.type != NetSocket::Server::EventType::None)
-            {
-                event_client_id = event.client->Endpoint();
-            }
-            if (!HandleNewConnection(event))
-            {
-                switch (event.type)
-                {
-                    case NetSocket::Server::EventType::ReceiveBinary:
-                        if (client_ready_to_advance.find(event_client_id) != client_ready_to_advance.end()
-                            && !client_ready_to_advance[event_client_id]
-                            && _connections[event_client_id].state == ClientState::Streaming
-                            && event.data_length == 1
-                            && reinterpret_cast<uint8_t*>(event.binary_data)[0] == 255)
-                        {
-                            client_ready_to_advance[event_client_id] = true;
-                            all_ready_to_advance = std::all_of(client_ready_to_advance.begin(), client_ready_to_advance.end(),
-                                                               [](std::pair<std::string, bool> p) {return p.second;});
-                        }
-                        delete[] event.binary_data;
-                        break;
-                    default:
-                        break;
-                }
-            }
+            NetSocket::Server::Event event = NextEvent();
+            ProcessEvent(event);
         }
     }
     else {
+        ReapBulk();
         NetSocket::Server::Event event = _server->PollForNextEvent();
         while (event.type != NetSocket::Server::EventType::None)
         {
-            if (!HandleNewConnection(event))
-            {
-                switch (event.type)
-                {
-                    case NetSocket::Server::EventType::ReceiveBinary:
-                        delete[] event.binary_data;
-                        break;
-                    default:
-                        break;
-                }
-            }
+            ProcessEvent(event);
             event = _server->PollForNextEvent();
         }
     }
 }
 
-void HpcStream::Server::GenerateVarsBuffer()
+void HpcStream::Server::BuildSizeDependencies()
 {
-    int i;
-    _vars_buffer_size = 0;
-    for (auto const& x : _vars)
+    int role;
+    uint32_t i;
+    VarHandle h;
+    for (h = 0; h < _vars.size(); h++)
     {
-        _vars_buffer_size += x.first.length();
-        _vars_buffer_size += sizeof(DataType) + 3 * sizeof(uint32_t) + sizeof(int64_t);
-        if (x.second.length == 0)
-        {
-            for (i = 0; i < x.second.dims; i++)
-            {
-                _vars_buffer_size += 3 * sizeof(uint32_t);
-                _vars_buffer_size += x.second.gs_vars[i].length();
-                _vars_buffer_size += x.second.ls_vars[i].length();
-                _vars_buffer_size += x.second.lo_vars[i].length();
-            }
-        }
+        _vars[h].size_deps.clear();
     }
-    _vars_buffer = new uint8_t[_vars_buffer_size];
-    uint32_t vars_offset = 0;
-    for (auto const& x : _vars)
+    for (h = 0; h < _vars.size(); h++)
     {
-        uint32_t name_len = htonl(static_cast<uint32_t>(x.first.length()));
-        memcpy(_vars_buffer + vars_offset, &name_len, sizeof(uint32_t));
-        vars_offset += sizeof(uint32_t);
-        memcpy(_vars_buffer + vars_offset, x.first.c_str(), x.first.length());
-        vars_offset += x.first.length();
-        uint32_t net_dims = htonl(x.second.dims);
-        memcpy(_vars_buffer + vars_offset, &net_dims, sizeof(uint32_t));
-        vars_offset += sizeof(uint32_t);
-        memcpy(_vars_buffer + vars_offset, &x.second.type, sizeof(uint8_t));
-        vars_offset += sizeof(uint8_t);
-        uint32_t net_size = htonl(x.second.size);
-        memcpy(_vars_buffer + vars_offset, &net_size, sizeof(uint32_t));
-        vars_offset += sizeof(uint32_t);
-        int64_t net_length = HpcStream::HToNLL(x.second.length);
-        memcpy(_vars_buffer + vars_offset, &net_length, sizeof(int64_t));
-        vars_offset += sizeof(int64_t);
-        if (x.second.length == 0)
+        const std::vector<std::string> *count_vars[3] = {&(_vars[h].gs_vars), &(_vars[h].ls_vars), &(_vars[h].lo_vars)};
+        for (role = 0; role < 3; role++)
         {
-            uint32_t len;
-            for (i = 0; i < x.second.dims; i++)
-            {
-                len = htonl(static_cast<uint32_t>(x.second.gs_vars[i].length()));
-                memcpy(_vars_buffer + vars_offset, &len, sizeof(uint32_t));
-                vars_offset += sizeof(uint32_t);
-                memcpy(_vars_buffer + vars_offset, x.second.gs_vars[i].c_str(), x.second.gs_vars[i].length());
-                vars_offset += x.second.gs_vars[i].length();
-            }
-            for (i = 0; i < x.second.dims; i++)
-            {
-                len = htonl(static_cast<uint32_t>(x.second.ls_vars[i].length()));
-                memcpy(_vars_buffer + vars_offset, &len, sizeof(uint32_t));
-                vars_offset += sizeof(uint32_t);
-                memcpy(_vars_buffer + vars_offset, x.second.ls_vars[i].c_str(), x.second.ls_vars[i].length());
-                vars_offset += x.second.ls_vars[i].length();
-            }
-            for (i = 0; i < x.second.dims; i++)
+            for (i = 0; i < count_vars[role]->size(); i++)
             {
-                len = htonl(static_cast<uint32_t>(x.second.lo_vars[i].length()));
-                memcpy(_vars_buffer + vars_offset, &len, sizeof(uint32_t));
-                vars_offset += sizeof(uint32_t);
-                memcpy(_vars_buffer + vars_offset, x.second.lo_vars[i].c_str(), x.second.lo_vars[i].length());
-                vars_offset += x.second.lo_vars[i].length();
+                std::map<std::string, VarHandle>::iterator it = _var_handles.find((*count_vars[role])[i]);
+                if (it == _var_handles.end() || _vars[it->second].type != HpcStream::DataType::ArraySize)
+                {
+                    fprintf(stderr, "[HpcStream] Error: %s is not an ArraySize variable (%s)\n", (*count_vars[role])[i].c_str(), _vars[h].name.c_str());
+                    continue;
+                }
+                _vars[it->second].size_deps.push_back({h, static_cast<SizeRole>(role), i});
             }
         }
     }
+    _size_deps_built = true;
 }
 
-bool HpcStream::Server::HandleNewConnection(NetSocket::Server::Event& event)
+void HpcStream::Server::ResizeArray(VarHandle handle)
 {
-    bool new_connection_event = false;
-    std::string event_client_id;
-    if (event.type != NetSocket::Server::EventType::None)
+    int i;
+    SharedVar& var = _vars[handle];
+    int64_t length = 1;
+    for (i = 0; i < var.dims; i++)
     {
-        event_client_id = event.client->Endpoint();
+        length *= var.l_size[i];
     }
-    switch (event.type)
+    var.resize_pending = false;
+    // only allocate once all local sizes are non-zero
+    if (length > 0 && (var.send_bufs.empty() || length != var.length))
     {
-        case NetSocket::Server::EventType::Connect:
-            _connections[event_client_id] = {0, ClientState::Connecting, event.client, 0, 0, true, false};
-            if (_rank == 0)
-            {
-                // send server ip addresses and ports for all ranks
-                _connections[event_client_id].client->Send(&_endianness, 1, NetSocket::CopyMode::ZeroCopy);
-                _connections[event_client_id].client->Send(_ip_address_list, 4 * _num_ranks, NetSocket::CopyMode::ZeroCopy);
-                _connections[event_client_id].client->Send(_port_list, _num_ranks * sizeof(uint16_t), NetSocket::CopyMode::ZeroCopy);
-            }
-            new_connection_event = true;
-            break;
-        case NetSocket::Server::EventType::Disconnect:
-            // TODO: handle disconnect
-            new_connection_event = true;
-            break;
-        case NetSocket::Server::EventType::ReceiveString:
-            fprintf(stderr, "[HpcStream] Error: received unknown string message from %s\n", event_client_id.c_str());
-            new_connection_event = true;
-            break;
-        case NetSocket::Server::EventType::ReceiveBinary:
-            if (_connections[event_client_id].state == ClientState::Connecting)
-            {
-                _connections[event_client_id].state = ClientState::Handshake;
-                 //verify client handshake data is as expected
-                if (event.data_length == 21 && ntohl(*((uint32_t*)event.binary_data)) == _num_ranks)
-                {
-                    // store client data
-                    _connections[event_client_id].id = HpcStream::NToHLL(*((uint64_t*)((uint32_t*)event.binary_data + 1)));
-                    _connections[event_client_id].remote_rank = ntohl(*((uint32_t*)event.binary_data + 3));
-                    _connections[event_client_id].num_remote_ranks = ntohl(*((uint32_t*)event.binary_data + 4));
-                    _connections[event_client_id].has_same_endianness = ((uint8_t*)event.binary_data)[20] == _endianness;
-                    // send variable definitions
-                    _connections[event_client_id].client->Send(_vars_buffer, _vars_buffer_size, NetSocket::CopyMode::ZeroCopy);
-                }
-                else
-                {
-                    // TODO: terminate client connection
-                }
+        var.length = length;
+        AllocateSendBuffers(handle);
+    }
+}
+
+void HpcStream::Server::FreeVarBuffers(VarHandle handle)
+{
+    // everything a variable's definition allocated, once no send uses its ring slots
+    int i;
+    SharedVar& var = _vars[handle];
+    for (i = 0; i < var.send_bufs.size(); i++)
+    {
+        WaitForPendingSends(handle, i);
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (i = 0; i < var.send_bufs.size(); i++)
+    {
+        _send_buf_owners.erase(var.send_bufs[i]);
+        delete[] var.send_bufs[i];
+    }
+    for (i = 0; i < var.enc_bufs.size(); i++)
+    {
+        _send_buf_owners.erase(var.enc_bufs[i]);
+        delete[] var.enc_bufs[i];
+    }
+    for (i = 0; i < var.delta_bufs.size(); i++)
+    {
+        _send_buf_owners.erase(var.delta_bufs[i]);
+        delete[] var.delta_bufs[i];
+    }
+    var.send_bufs.clear();
+    var.enc_bufs.clear();
+    var.delta_bufs.clear();
+    delete[] var.prev_val;
+    delete[] var.g_size;
+    delete[] var.l_size;
+    delete[] var.l_offset;
+    var.prev_val = NULL;
+    var.g_size = NULL;
+    var.l_size = NULL;
+    var.l_offset = NULL;
+    var.send_buf = NULL;
+    var.val = NULL;
+}
+
+void HpcStream::Server::AllocateSendBuffers(VarHandle handle)
+{
+    int i;
+    SharedVar& var = _vars[handle];
+    uint64_t payload_size = var.size * var.length;
+    for (i = 0; i < var.send_bufs.size(); i++)
+    {
+        WaitForPendingSends(handle, i);
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (i = 0; i < var.send_bufs.size(); i++)
+    {
+        _send_buf_owners.erase(var.send_bufs[i]);
+        delete[] var.send_bufs[i];
+    }
+    for (i = 0; i < var.enc_bufs.size(); i++)
+    {
+        _send_buf_owners.erase(var.enc_bufs[i]);
+        delete[] var.enc_bufs[i];
+    }
+    var.send_bufs.assign(_num_write_buffers, NULL);
+    var.sends_pending.assign(_num_write_buffers, 0);
+    var.enc_bufs.clear();
+    var.enc_sizes.assign(_num_write_buffers, 0);
+    for (i = 0; i < _num_write_buffers; i++)
+    {
+        var.send_bufs[i] = new uint8_t[HPCSTREAM_HEADER_SIZE + payload_size];
+        HpcStream::WriteMessageHeader(var.send_bufs[i], MessageType::VarData, handle, 0, payload_size);
+        _send_buf_owners[var.send_bufs[i]] = {handle, i};
+    }
+    if (var.codec != HpcStream::CodecId::NoCodec)
+    {
+        uint64_t max_size = HpcStream::MaxEncodedBlocksSize(HpcStream::GetCodec(var.codec), payload_size, CodecBlockSize(var));
+        var.enc_bufs.assign(_num_write_buffers, NULL);
+        var.enc_sizes.assign(_num_write_buffers, -1);
+        for (i = 0; i < _num_write_buffers; i++)
+        {
+            var.enc_bufs[i] = new uint8_t[HPCSTREAM_HEADER_SIZE + max_size];
+            _send_buf_owners[var.enc_bufs[i]] = {handle, i};
+        }
+    }
+    AllocateDeltaBuffers(handle);
+    var.slot = 0;
+    var.send_buf = var.send_bufs[0];
+    var.val = var.send_buf + HPCSTREAM_HEADER_SIZE;
+}
+
+void HpcStream::Server::AllocateDeltaBuffers(VarHandle handle)
+{
+    // called with _mutex held, once no sends use the variable's buffers
+    int i;
+    SharedVar& var = _vars[handle];
+    for (i = 0; i < var.delta_bufs.size(); i++)
+    {
+        _send_buf_owners.erase(var.delta_bufs[i]);
+        delete[] var.delta_bufs[i];
+    }
+    delete[] var.prev_val;
+    var.delta_bufs.clear();
+    var.prev_val = NULL;
+    // connections receive the whole value again before deltas are sent
+    var.prev_valid = false;
+    if (var.tile_size > 0 && var.length > 0)
+    {
+        uint64_t max_size = HpcStream::MaxDeltaTilesSize(var.dims, var.l_size, var.size, var.tile_size);
+        var.prev_val = new uint8_t[var.size * var.length];
+        var.delta_bufs.assign(_num_write_buffers, NULL);
+        for (i = 0; i < _num_write_buffers; i++)
+        {
+            var.delta_bufs[i] = new uint8_t[HPCSTREAM_HEADER_SIZE + max_size];
+            _send_buf_owners[var.delta_bufs[i]] = {handle, i};
+        }
+    }
+}
+
+void HpcStream::Server::SendStep(Step& step)
+{
+    // when dropping frames, connections still sending an earlier step queue this one - a full queue drops its oldest
+    // step (latest frame wins), so a slow client never holds more than a bounded number of steps
+    std::vector<Connection*> targets;
+    for (auto& c : _connections)
+    {
+        if (_stream_behavior == StreamBehavior::DropFrames && c.second.state == ClientState::Streaming && c.second.sending_step != 0)
+        {
+            QueueStep(c.second, step);
+        }
+        else
+        {
+            targets.push_back(&(c.second));
+        }
+    }
+    DeliverStep(step, targets, false);
+}
+
+void HpcStream::Server::QueueStep(Connection& c, const Step& step)
+{
+    int i;
+    // queued steps hold their ring slots (or the group's values) until sent or dropped
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (i = 0; i < step.vars.size(); i++)
+        {
+            if (step.vars[i].blocks != NULL)
+            {
+                _shared_bufs[step.vars[i].blocks]++;
+            }
+            else
+            {
+                _vars[step.vars[i].var].sends_pending[step.vars[i].slot]++;
+            }
+        }
+    }
+    c.queued.push_back(step);
+    while (c.queued.size() > _send_queue_depth)
+    {
+        // variables updated in a dropped step are sent whole with the next step the connection receives
+        Step& dropped = c.queued.front();
+        for (i = 0; i < dropped.vars.size(); i++)
+        {
+            if (dropped.vars[i].updated)
+            {
+                c.refresh[dropped.vars[i].var] = true;
+            }
+        }
+        ReleaseQueuedStep(dropped);
+        c.queued.pop_front();
+        c.dropped++;
+        _dropped_frames++;
+    }
+    _cond.notify_all();
+}
+
+void HpcStream::Server::ReserveQueuedSlots()
+{
+    // slow clients hold their sending and queued steps' slots - one more keeps SetValue() from waiting on the network
+    int i;
+    VarHandle h;
+    if (_num_write_buffers >= _send_queue_depth + 2)
+    {
+        return;
+    }
+    _num_write_buffers = _send_queue_depth + 2;
+    for (h = 0; h < _vars.size(); h++)
+    {
+        if (!_vars[h].send_bufs.empty())
+        {
+            std::vector<uint8_t> value(_vars[h].val, _vars[h].val + _vars[h].size * _vars[h].length);
+            AllocateSendBuffers(h);
+            for (i = 0; i < _num_write_buffers; i++)
+            {
+                memcpy(_vars[h].send_bufs[i] + HPCSTREAM_HEADER_SIZE, value.data(), value.size());
+            }
+        }
+    }
+}
+
+void HpcStream::Server::ReleaseQueuedStep(const Step& step)
+{
+    int i;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (i = 0; i < step.vars.size(); i++)
+    {
+        if (step.vars[i].blocks != NULL)
+        {
+            ReleaseBuffer(step.vars[i].blocks);
+        }
+        else
+        {
+            _vars[step.vars[i].var].sends_pending[step.vars[i].slot]--;
+        }
+    }
+}
+
+void HpcStream::Server::SendQueuedStep(Connection& c)
+{
+    // connection finished sending its step (data sockets included) - send the latest one it has queued since
+    if (c.sending_step == 0 || !c.step_end_sent || c.bulk_pending > 0)
+    {
+        return;
+    }
+    c.sending_step = 0;
+    if (!c.queued.empty())
+    {
+        Step next = c.queued.front();
+        c.queued.pop_front();
+        DeliverStep(next, std::vector<Connection*>(1, &c), true);
+    }
+}
+
+void HpcStream::Server::DeliverStep(Step& step, const std::vector<Connection*>& targets, bool late)
+{
+    int i;
+    // variables are sent straight from their ring slot (message header followed by value), shared by every connection
+    // in step frame mode, scalars are instead packed into the frame that ends the step
+    // messages multicast once per step (and kept for clients to ask for again for a few more)
+    if (_mcast != NULL)
+    {
+        _mcast_step = std::max(_mcast_step, step.id);
+        _mcast->Forget(_mcast_step - std::min(_mcast_step, (WriteRequest)HPCSTREAM_MULTICAST_HISTORY));
+    }
+    for (i = 0; i < step.vars.size(); i++)
+    {
+        StepVar& sv = step.vars[i];
+        _mcast_sent.clear();
+        if (sv.blocks != NULL)
+        {
+            // values of every rank in the group, sent whole (the step's own hold on them is released here)
+            for (Connection *c : targets)
+            {
+                if (SendsVar(*c, sv.var, sv.updated) && !SendShared(*c, sv.blocks, sv.send_size) && !SendMulticast(*c, sv.blocks, sv.send_size)
+                    && !SendBulk(*c, sv.blocks, sv.send_size))
+                {
+                    ShareBuffer(*c, sv.blocks, sv.send_size);
+                }
+            }
+            if (late)
+            {
+                ReleaseBuffer(sv.blocks);
+            }
+            else if (_shared_bufs.find(sv.blocks) == _shared_bufs.end())
+            {
+                delete[] sv.blocks;
+            }
+            continue;
+        }
+        int num_sends = 0;
+        bool framed = _step_frames && _vars[sv.var].gs_vars.size() == 0;
+        // connections only receive subscribed variables - whole values for new subscribers, updates for the rest
+        // and only the part of an array that intersects the client's region, if it set one
+        bool whole_wanted = false;
+        bool update_wanted = false;
+        bool crop_wanted = false;
+        std::vector<uint32_t> box;
+        for (Connection *c : targets)
+        {
+            if (SendsVar(*c, sv.var, sv.updated) && CropBox(*c, sv, box))
+            {
+                crop_wanted = true;
+            }
+            else if (SendsVar(*c, sv.var, sv.updated))
+            {
+                whole_wanted |= SendsWholeVar(*c, sv.var);
+                update_wanted |= !SendsWholeVar(*c, sv.var);
+            }
+        }
+        if ((whole_wanted || update_wanted || crop_wanted || sv.updated) && !framed)
+        {
+            SharedVar& x = _vars[sv.var];
+            uint8_t *buf = x.send_bufs[sv.slot];
+            uint64_t send_size = sv.send_size;
+            // connections holding the previous value only receive the tiles that changed since (steps sent late from a
+            // connection's queue carry whole values, as the previous value has moved on)
+            uint8_t *delta_buf = NULL;
+            uint64_t delta_size = 0;
+            if (x.tile_size > 0 && sv.updated && !late)
+            {
+                delta_size = CreateDeltaMessage(sv, step.id, update_wanted);
+                if (delta_size > 0 && delta_size < send_size)
+                {
+                    delta_buf = x.delta_bufs[sv.slot];
+                }
+            }
+            // slot is encoded once (on first send) and the encoded copy shared by every connection
+            if (x.codec != HpcStream::CodecId::NoCodec && (whole_wanted || (update_wanted && delta_buf == NULL)))
+            {
+                if (x.enc_sizes[sv.slot] < 0)
+                {
+                    EncodeSlot(sv);
+                }
+                if (x.enc_sizes[sv.slot] > 0)
+                {
+                    buf = x.enc_bufs[sv.slot];
+                    send_size = x.enc_sizes[sv.slot];
+                }
+            }
+            // cropped copies are shared by connections with the same box
+            std::map<std::vector<uint32_t>, std::pair<uint8_t*, uint64_t> > cropped;
+            for (Connection *c : targets)
+            {
+                if (SendsVar(*c, sv.var, sv.updated) && CropBox(*c, sv, box))
+                {
+                    std::map<std::vector<uint32_t>, std::pair<uint8_t*, uint64_t> >::iterator crop = cropped.find(box);
+                    if (crop == cropped.end())
+                    {
+                        std::pair<uint8_t*, uint64_t> message;
+                        message.first = CreateCroppedMessage(sv, step.id, box, &(message.second));
+                        crop = cropped.insert(std::make_pair(box, message)).first;
+                    }
+                    if (!SendShared(*c, crop->second.first, crop->second.second) && !SendMulticast(*c, crop->second.first, crop->second.second)
+                        && !SendBulk(*c, crop->second.first, crop->second.second))
+                    {
+                        ShareBuffer(*c, crop->second.first, crop->second.second);
+                    }
+                }
+                else if (SendsVar(*c, sv.var, sv.updated))
+                {
+                    uint8_t *message = buf;
+                    uint64_t message_size = send_size;
+                    if (!SendsWholeVar(*c, sv.var) && delta_buf != NULL)
+                    {
+                        message = delta_buf;
+                        message_size = delta_size;
+                    }
+                    if (!SendShared(*c, message, message_size) && !SendMulticast(*c, message, message_size) && !SendBulk(*c, message, message_size))
+                    {
+                        SendMessage(*c, message, message_size);
+                        num_sends++;
+                    }
+                }
+            }
+            for (auto const& crop : cropped)
+            {
+                if (_shared_bufs.find(crop.second.first) == _shared_bufs.end())
+                {
+                    delete[] crop.second.first;
+                }
+            }
+        }
+        if (!framed)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _vars[sv.var].sends_pending[sv.slot] += num_sends - 1;
+            }
+            _cond.notify_all();
+        }
+    }
+    // end of step message - step is complete once every one is sent (and acknowledged if waiting for all)
+    // connections that need the same scalars share a step frame
+    // a step sent late from a connection's queue joins the progress of its first delivery, if still in flight
+    StepProgress& progress = _steps_in_flight[step.id];
+    std::map<std::vector<bool>, std::pair<uint8_t*, uint32_t> > end_msgs;
+    uint8_t *step_end = NULL;
+    if (!_step_frames)
+    {
+        step_end = new uint8_t[HPCSTREAM_HEADER_SIZE];
+        HpcStream::WriteMessageHeader(step_end, MessageType::StepEnd, 0, step.id, 0);
+        _step_markers[step_end] = step.id;
+    }
+    for (Connection *c : targets)
+    {
+        if (c->state == ClientState::Streaming)
+        {
+            std::pair<uint8_t*, uint32_t> end_msg(step_end, HPCSTREAM_HEADER_SIZE);
+            if (_step_frames)
+            {
+                std::vector<bool> scalars(step.vars.size(), false);
+                for (i = 0; i < step.vars.size(); i++)
+                {
+                    scalars[i] = _vars[step.vars[i].var].gs_vars.size() == 0 && SendsVar(*c, step.vars[i].var, step.vars[i].updated);
+                }
+                std::map<std::vector<bool>, std::pair<uint8_t*, uint32_t> >::iterator frame = end_msgs.find(scalars);
+                if (frame == end_msgs.end())
+                {
+                    end_msg.first = CreateStepFrame(step, scalars, &(end_msg.second));
+                    end_msgs[scalars] = end_msg;
+                    _step_markers[end_msg.first] = step.id;
+                }
+                else
+                {
+                    end_msg = frame->second;
+                }
+            }
+            ShareBuffer(*c, end_msg.first, end_msg.second);
+            progress.markers_pending++;
+            if (_stream_behavior == StreamBehavior::WaitForAll)
+            {
+                c->unacked.push_back(step.id);
+                progress.acks_pending++;
+            }
+            else
+            {
+                c->sending_step = step.id;
+                c->step_end_sent = false;
+            }
+            c->is_new = false;
+            for (i = 0; i < step.vars.size(); i++)
+            {
+                c->refresh[step.vars[i].var] = false;
+            }
+        }
+    }
+    if (_step_frames)
+    {
+        for (i = 0; i < step.vars.size(); i++)
+        {
+            if (_vars[step.vars[i].var].gs_vars.size() == 0)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _vars[step.vars[i].var].sends_pending[step.vars[i].slot]--;
+            }
+        }
+        _cond.notify_all();
+    }
+    if (step_end != NULL && _shared_bufs.find(step_end) == _shared_bufs.end())
+    {
+        _step_markers.erase(step_end);
+        delete[] step_end;
+    }
+    if (progress.markers_pending == 0 && progress.acks_pending == 0)
+    {
+        CompleteStep(step.id);
+    }
+}
+
+bool HpcStream::Server::SendsVar(const Connection& c, VarHandle handle, bool updated)
+{
+    return c.state == ClientState::Streaming && c.subscribed[handle] && (updated || SendsWholeVar(c, handle));
+}
+
+bool HpcStream::Server::SendsWholeVar(const Connection& c, VarHandle handle)
+{
+    return c.is_new || c.refresh[handle];
+}
+
+bool HpcStream::Server::CropBox(const Connection& c, const StepVar& sv, std::vector<uint32_t>& box)
+{
+    // box within the local block (offsets, then sizes), subsampling factors and filter - false if the client needs
+    // the whole block at full resolution
+    uint32_t i;
+    SharedVar& x = _vars[sv.var];
+    const uint32_t *l_size = sv.l_size.data();
+    const uint32_t *l_offset = sv.l_offset.data();
+    std::map<VarHandle, std::vector<uint32_t> >::const_iterator region = c.regions.find(sv.var);
+    std::map<VarHandle, std::vector<uint32_t> >::const_iterator sample = c.samples.find(sv.var);
+    if ((region == c.regions.end() && sample == c.samples.end()) || x.gs_vars.size() == 0)
+    {
+        return false;
+    }
+    box.assign(3 * x.dims + 1, 1);
+    box[3 * x.dims] = HpcStream::SampleFilter::Nearest;
+    bool whole = true;
+    for (i = 0; i < x.dims; i++)
+    {
+        box[i] = 0;
+        box[x.dims + i] = l_size[i];
+    }
+    if (region != c.regions.end())
+    {
+        HpcStream::IntersectBoxes(x.dims, region->second.data(), region->second.data() + x.dims, l_offset, l_size, box.data(), box.data() + x.dims);
+        for (i = 0; i < x.dims; i++)
+        {
+            whole &= box[x.dims + i] == l_size[i];
+            box[i] -= std::min(box[i], l_offset[i]);
+        }
+    }
+    if (sample != c.samples.end())
+    {
+        std::copy(sample->second.begin(), sample->second.end(), box.begin() + 2 * x.dims);
+        for (i = 0; i < x.dims; i++)
+        {
+            whole &= box[2 * x.dims + i] <= 1;
+        }
+    }
+    return !whole;
+}
+
+uint8_t* HpcStream::Server::CreateCroppedMessage(const StepVar& sv, WriteRequest step_id, const std::vector<uint32_t>& box, uint64_t *message_size)
+{
+    // payload: [uint32 global offset per dim][uint32 size per dim][values within the box] - offsets and sizes of a
+    // subsampled box count samples, so clients see a global array reduced by the subsampling factors
+    uint32_t i;
+    SharedVar& x = _vars[sv.var];
+    std::vector<uint32_t> sample_offset(x.dims);
+    std::vector<uint32_t> sample_size(x.dims);
+    HpcStream::SubsampledBox(x.dims, sv.l_offset.data(), box.data(), box.data() + x.dims, box.data() + 2 * x.dims, sample_offset.data(), sample_size.data());
+    bool subsampled = false;
+    uint64_t length = 1;
+    for (i = 0; i < x.dims; i++)
+    {
+        length *= sample_size[i];
+        subsampled |= box[2 * x.dims + i] > 1;
+    }
+    uint64_t payload_size = 2 * x.dims * sizeof(uint32_t) + length * x.size;
+    uint8_t *message = new uint8_t[HPCSTREAM_HEADER_SIZE + payload_size];
+    HpcStream::WriteMessageHeader(message, MessageType::VarData, sv.var, step_id, payload_size, MessageFlags::Cropped);
+    for (i = 0; i < x.dims; i++)
+    {
+        uint32_t net_offset = htonl(sample_offset[i]);
+        uint32_t net_size = htonl(sample_size[i]);
+        memcpy(message + HPCSTREAM_HEADER_SIZE + i * sizeof(uint32_t), &net_offset, sizeof(uint32_t));
+        memcpy(message + HPCSTREAM_HEADER_SIZE + (x.dims + i) * sizeof(uint32_t), &net_size, sizeof(uint32_t));
+    }
+    uint8_t *values = message + HPCSTREAM_HEADER_SIZE + 2 * x.dims * sizeof(uint32_t);
+    if (length > 0 && subsampled)
+    {
+        HpcStream::SubsampleBox(x.send_bufs[sv.slot] + HPCSTREAM_HEADER_SIZE, x.type, x.dims, sv.l_size.data(), sv.l_offset.data(), box.data(), box.data() + x.dims,
+                                box.data() + 2 * x.dims, static_cast<HpcStream::SampleFilter>(box[3 * x.dims]), values);
+    }
+    else if (length > 0)
+    {
+        HpcStream::CopyBox(x.send_bufs[sv.slot] + HPCSTREAM_HEADER_SIZE, x.dims, sv.l_size.data(), x.size, box.data(), box.data() + x.dims, values);
+    }
+    *message_size = HPCSTREAM_HEADER_SIZE + payload_size;
+    return message;
+}
+
+void HpcStream::Server::EncodeSlot(const StepVar& sv)
+{
+    SharedVar& var = _vars[sv.var];
+    int slot = sv.slot;
+    uint64_t payload_size = sv.send_size - HPCSTREAM_HEADER_SIZE;
+    HpcStream::CodecContext ctx = {var.type, var.size, var.filter, var.dims, sv.l_size.data(), 0, var.error_bound};
+    if (var.codec == HpcStream::CodecId::Quantize && var.error_mode == HpcStream::ErrorMode::Relative)
+    {
+        ctx.error_bound *= HpcStream::ValueRange(var.type, var.send_bufs[slot] + HPCSTREAM_HEADER_SIZE, payload_size / var.size);
+    }
+    HpcStream::MessageHeader header;
+    HpcStream::ReadMessageHeader(var.send_bufs[slot], HPCSTREAM_HEADER_SIZE + payload_size, &header);
+    uint64_t enc_size = HpcStream::EncodeBlocks(HpcStream::GetCodec(var.codec), ctx, var.send_bufs[slot] + HPCSTREAM_HEADER_SIZE,
+                                                payload_size, CodecBlockSize(var), var.enc_bufs[slot] + HPCSTREAM_HEADER_SIZE, _codec_pool);
+    // fall back to the raw value if encoding did not make it any smaller
+    if (enc_size < payload_size)
+    {
+        HpcStream::WriteMessageHeader(var.enc_bufs[slot], MessageType::VarData, sv.var, header.step, enc_size, MessageFlags::Encoded);
+        var.enc_sizes[slot] = HPCSTREAM_HEADER_SIZE + enc_size;
+    }
+    else
+    {
+        var.enc_sizes[slot] = 0;
+    }
+}
+
+uint64_t HpcStream::Server::CreateDeltaMessage(const StepVar& sv, WriteRequest step_id, bool delta_wanted)
+{
+    // compares the slot with the previously sent value, which is then brought up to date - returns 0 if no delta was made
+    SharedVar& var = _vars[sv.var];
+    uint8_t *val = var.send_bufs[sv.slot] + HPCSTREAM_HEADER_SIZE;
+    if (!var.prev_valid || !delta_wanted)
+    {
+        memcpy(var.prev_val, val, sv.send_size - HPCSTREAM_HEADER_SIZE);
+        var.prev_valid = true;
+        return 0;
+    }
+    uint64_t delta_size = HpcStream::EncodeDeltaTiles(val, var.prev_val, var.dims, sv.l_size.data(), var.size, var.tile_size,
+                                                      var.delta_bufs[sv.slot] + HPCSTREAM_HEADER_SIZE);
+    HpcStream::WriteMessageHeader(var.delta_bufs[sv.slot], MessageType::VarData, sv.var, step_id, delta_size, MessageFlags::Delta);
+    return HPCSTREAM_HEADER_SIZE + delta_size;
+}
+
+uint64_t HpcStream::Server::CodecBlockSize(const SharedVar& var)
+{
+    // blocks hold whole elements
+    return std::max(_codec_block_size - (_codec_block_size % var.size), (uint64_t)var.size);
+}
+
+bool HpcStream::Server::GatherGroup(Step& step)
+{
+    // each rank packs [uint8 updated][uint64 length][value] per variable (length 0 without local elements), and the
+    // group's sender turns them into one message per variable: [uint32 block count][uint64 length per block][values]
+    // returns whether this rank sends the step
+    int i, r;
+    VarHandle h;
+    std::vector<int> step_index(_vars.size(), -1);
+    for (i = 0; i < step.vars.size(); i++)
+    {
+        step_index[step.vars[i].var] = i;
+    }
+    std::vector<uint8_t> pack;
+    for (h = 0; h < _vars.size(); h++)
+    {
+        SharedVar& x = _vars[h];
+        int idx = step_index[h];
+        uint64_t length = idx >= 0 ? x.size * x.length : 0;
+        uint64_t net_length = HpcStream::HToNLL(length);
+        pack.push_back(idx >= 0 && step.vars[idx].updated);
+        pack.insert(pack.end(), (uint8_t*)&net_length, (uint8_t*)&net_length + sizeof(uint64_t));
+        if (length > 0)
+        {
+            uint8_t *val = x.send_bufs[step.vars[idx].slot] + HPCSTREAM_HEADER_SIZE;
+            pack.insert(pack.end(), val, val + length);
+        }
+    }
+    // packs may pass 2 GiB - sizes are gathered as 64 bit and the packs sent in chunks MPI counts can hold
+    uint64_t pack_size = pack.size();
+    std::vector<uint64_t> pack_sizes(_group_size, 0);
+    std::vector<uint64_t> displacements(_group_size, 0);
+    MPI_Gather(&pack_size, 1, MPI_UINT64_T, pack_sizes.data(), 1, MPI_UINT64_T, 0, _group_comm);
+    for (r = 1; r < _group_size; r++)
+    {
+        displacements[r] = displacements[r - 1] + pack_sizes[r - 1];
+    }
+    std::vector<uint8_t> group(_group_rank == 0 ? displacements[_group_size - 1] + pack_sizes[_group_size - 1] : 0);
+    uint64_t sent;
+    if (_group_rank == 0)
+    {
+        memcpy(group.data(), pack.data(), pack_size);
+        for (r = 1; r < _group_size; r++)
+        {
+            for (sent = 0; sent < pack_sizes[r]; sent += HPCSTREAM_MPI_CHUNK)
+            {
+                int count = std::min<uint64_t>(pack_sizes[r] - sent, HPCSTREAM_MPI_CHUNK);
+                MPI_Recv(group.data() + displacements[r] + sent, count, MPI_UINT8_T, r, 0, _group_comm, MPI_STATUS_IGNORE);
+            }
+        }
+    }
+    else
+    {
+        for (sent = 0; sent < pack_size; sent += HPCSTREAM_MPI_CHUNK)
+        {
+            int count = std::min<uint64_t>(pack_size - sent, HPCSTREAM_MPI_CHUNK);
+            MPI_Send(pack.data() + sent, count, MPI_UINT8_T, 0, 0, _group_comm);
+        }
+    }
+    // values are copied, so ring slots are free again
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (i = 0; i < step.vars.size(); i++)
+        {
+            _vars[step.vars[i].var].sends_pending[step.vars[i].slot]--;
+        }
+        if (_group_rank != 0)
+        {
+            _write_complete = step.id;
+        }
+    }
+    _cond.notify_all();
+    if (_group_rank != 0)
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> updated(_vars.size() * _group_size);
+    std::vector<uint64_t> lengths(_vars.size() * _group_size);
+    std::vector<const uint8_t*> values(_vars.size() * _group_size);
+    for (r = 0; r < _group_size; r++)
+    {
+        const uint8_t *block = group.data() + displacements[r];
+        for (h = 0; h < _vars.size(); h++)
+        {
+            uint64_t net_length;
+            memcpy(&net_length, block + 1, sizeof(uint64_t));
+            updated[h * _group_size + r] = block[0];
+            lengths[h * _group_size + r] = HpcStream::NToHLL(net_length);
+            values[h * _group_size + r] = block + 1 + sizeof(uint64_t);
+            block += 1 + sizeof(uint64_t) + lengths[h * _group_size + r];
+        }
+    }
+    int pass;
+    step.vars.clear();
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (h = 0; h < _vars.size(); h++)
+        {
+            if ((_vars[h].gs_vars.size() > 0) != (pass == 1))
+            {
+                continue;
+            }
+            bool any_updated = false;
+            uint64_t payload_size = sizeof(uint32_t) + _group_size * sizeof(uint64_t);
+            for (r = 0; r < _group_size; r++)
+            {
+                any_updated |= updated[h * _group_size + r] != 0;
+                payload_size += lengths[h * _group_size + r];
+            }
+            if (payload_size == sizeof(uint32_t) + _group_size * sizeof(uint64_t))
+            {
+                continue;
+            }
+            uint8_t *message = new uint8_t[HPCSTREAM_HEADER_SIZE + payload_size];
+            HpcStream::WriteMessageHeader(message, MessageType::VarData, h, step.id, payload_size, MessageFlags::Blocks);
+            uint32_t net_count = htonl(_group_size);
+            memcpy(message + HPCSTREAM_HEADER_SIZE, &net_count, sizeof(uint32_t));
+            uint64_t offset = HPCSTREAM_HEADER_SIZE + sizeof(uint32_t) + _group_size * sizeof(uint64_t);
+            for (r = 0; r < _group_size; r++)
+            {
+                uint64_t net_length = HpcStream::HToNLL(lengths[h * _group_size + r]);
+                memcpy(message + HPCSTREAM_HEADER_SIZE + sizeof(uint32_t) + r * sizeof(uint64_t), &net_length, sizeof(uint64_t));
+                memcpy(message + offset, values[h * _group_size + r], lengths[h * _group_size + r]);
+                offset += lengths[h * _group_size + r];
+            }
+            StepVar sv = {h, _vars[h].slot, HPCSTREAM_HEADER_SIZE + payload_size, any_updated, message, std::vector<uint32_t>(), std::vector<uint32_t>()};
+            step.vars.push_back(sv);
+        }
+    }
+    return true;
+}
+
+uint8_t* HpcStream::Server::CreateStepFrame(Step& step, const std::vector<bool>& scalars, uint32_t *frame_size)
+{
+    // frame payload: [var id][value] for each included scalar, applied by clients after the step's arrays arrive
+    int i;
+    uint64_t payload_size = 0;
+    for (i = 0; i < step.vars.size(); i++)
+    {
+        if (scalars[i])
+        {
+            payload_size += sizeof(uint32_t) + _vars[step.vars[i].var].size;
+        }
+    }
+    uint8_t *frame = new uint8_t[HPCSTREAM_HEADER_SIZE + payload_size];
+    HpcStream::WriteMessageHeader(frame, MessageType::StepFrame, 0, step.id, payload_size);
+    uint64_t offset = HPCSTREAM_HEADER_SIZE;
+    for (i = 0; i < step.vars.size(); i++)
+    {
+        SharedVar& x = _vars[step.vars[i].var];
+        if (scalars[i])
+        {
+            uint32_t net_id = htonl(step.vars[i].var);
+            memcpy(frame + offset, &net_id, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+            memcpy(frame + offset, x.send_bufs[step.vars[i].slot] + HPCSTREAM_HEADER_SIZE, x.size);
+            offset += x.size;
+        }
+    }
+    *frame_size = HPCSTREAM_HEADER_SIZE + payload_size;
+    return frame;
+}
+
+void HpcStream::Server::SendMessage(Connection& c, uint8_t *buffer, uint64_t size)
+{
+    // sent without copying - messages NetSocket cannot take at once go in pieces, and the SendFinished of the last piece
+    // stands for the whole message (pieces to one client are sent in order)
+    uint64_t offset = 0;
+    while (size - offset > HPCSTREAM_SEND_CHUNK)
+    {
+        c.client->Send(buffer + offset, HPCSTREAM_SEND_CHUNK, NetSocket::CopyMode::ZeroCopy);
+        offset += HPCSTREAM_SEND_CHUNK;
+    }
+    c.client->Send(buffer + offset, static_cast<uint32_t>(size - offset), NetSocket::CopyMode::ZeroCopy);
+    c.sends.insert(std::make_pair(buffer + offset, buffer));
+}
+
+void HpcStream::Server::ShareBuffer(Connection& c, uint8_t *buffer, uint64_t size)
+{
+    // per-step messages are built once and sent to every connection that needs them without copying - each send holds
+    // a reference, so memory grows with the data rather than with the number of clients
+    SendMessage(c, buffer, size);
+    _shared_bufs[buffer]++;
+}
+
+HpcStream::Server::WriteRequest HpcStream::Server::FinishSend(uint8_t *message)
+{
+    // releases the hold of one send of the message - returns its step if it ended one (0 otherwise)
+    WriteRequest step_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::map<uint8_t*, BufferOwner>::iterator owner = _send_buf_owners.find(message);
+        if (owner != _send_buf_owners.end())
+        {
+            _vars[owner->second.var].sends_pending[owner->second.slot]--;
+        }
+    }
+    _cond.notify_all();
+    std::map<uint8_t*, WriteRequest>::iterator marker = _step_markers.find(message);
+    if (marker != _step_markers.end())
+    {
+        step_id = marker->second;
+        std::map<WriteRequest, StepProgress>::iterator progress = _steps_in_flight.find(step_id);
+        progress->second.markers_pending--;
+        if (progress->second.markers_pending == 0 && progress->second.acks_pending == 0)
+        {
+            CompleteStep(progress->first);
+        }
+    }
+    ReleaseBuffer(message);
+    return step_id;
+}
+
+void HpcStream::Server::ReleaseBuffer(uint8_t *buffer)
+{
+    // freed with the last send that references it
+    std::map<uint8_t*, int>::iterator shared = _shared_bufs.find(buffer);
+    if (shared != _shared_bufs.end() && --(shared->second) == 0)
+    {
+        _step_markers.erase(buffer);
+        _shared_bufs.erase(shared);
+        delete[] buffer;
+    }
+}
+
+void HpcStream::Server::CompleteStep(WriteRequest id)
+{
+    _steps_in_flight.erase(id);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (id > _write_complete)
+        {
+            _write_complete = id;
+        }
+    }
+    _cond.notify_all();
+}
+
+void HpcStream::Server::ProgressThread()
+{
+    while (true)
+    {
+        ReapBulk();
+        Step step;
+        bool have_step = false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_step_queue.empty() && ReadyForNextStep())
+            {
+                step = _step_queue.front();
+                _step_queue.pop_front();
+                have_step = true;
+            }
+            else if (_progress_stop)
+            {
+                // stopping - steps the clients have no room for are dropped rather than waited on
+                for (const Step& dropped : _step_queue)
+                {
+                    for (const StepVar& sv : dropped.vars)
+                    {
+                        if (sv.blocks != NULL)
+                        {
+                            delete[] sv.blocks;
+                        }
+                        else
+                        {
+                            _vars[sv.var].sends_pending[sv.slot]--;
+                        }
+                    }
+                }
+                _step_queue.clear();
+                break;
+            }
+        }
+        if (have_step)
+        {
+            SendStep(step);
+            continue;
+        }
+        // sleeps until a client event, a queued step or a data socket completion
+        NetSocket::Server::Event event;
+        bool have_event = false;
+        {
+            std::unique_lock<std::mutex> lock(_events->mutex);
+            _events->cond.wait(lock, [&] {return _events->wake || !_events->events.empty();});
+            _events->wake = false;
+            if (!_events->events.empty())
+            {
+                event = _events->events.front();
+                _events->events.pop_front();
+                have_event = true;
+            }
+        }
+        if (have_event)
+        {
+            ProcessEvent(event);
+        }
+    }
+}
+
+void HpcStream::Server::WakeProgressThread()
+{
+    if (_events)
+    {
+        std::lock_guard<std::mutex> lock(_events->mutex);
+        _events->wake = true;
+        _events->cond.notify_all();
+    }
+}
+
+void HpcStream::Server::ReadEvents(NetSocket::Server *server, std::shared_ptr<EventQueue> queue)
+{
+    // hands client events to the progress thread - only uses the queue, so it may outlive the server
+    while (true)
+    {
+        NetSocket::Server::Event event = server->WaitForNextEvent();
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (queue->stop)
+        {
+            if (event.type == NetSocket::Server::EventType::ReceiveBinary)
+            {
+                delete[] reinterpret_cast<uint8_t*>(event.binary_data);
+            }
+            return;
+        }
+        queue->events.push_back(event);
+        queue->cond.notify_all();
+    }
+}
+
+bool HpcStream::Server::ReadyForNextStep()
+{
+    if (_stream_behavior == StreamBehavior::DropFrames)
+    {
+        return true;
+    }
+    // each client grants a window of steps the server may send before the oldest is released
+    return std::all_of(_connections.begin(), _connections.end(),
+                       [](const std::pair<const std::string, Connection>& p) {return p.second.unacked.size() < p.second.window;});
+}
+
+void HpcStream::Server::GenerateVarsBuffer()
+{
+    int i;
+    _vars_buffer_size = 0;
+    for (auto const& x : _vars)
+    {
+        _vars_buffer_size += x.name.length();
+        _vars_buffer_size += sizeof(DataType) + 2 * sizeof(uint8_t) + 4 * sizeof(uint32_t) + sizeof(int64_t);
+        if (x.length == 0)
+        {
+            for (i = 0; i < x.dims; i++)
+            {
+                _vars_buffer_size += 3 * sizeof(uint32_t);
+                _vars_buffer_size += x.gs_vars[i].length();
+                _vars_buffer_size += x.ls_vars[i].length();
+                _vars_buffer_size += x.lo_vars[i].length();
+            }
+        }
+    }
+    _vars_buffer = new uint8_t[_vars_buffer_size];
+    uint32_t vars_offset = 0;
+    VarHandle h;
+    for (h = 0; h < _vars.size(); h++)
+    {
+        SharedVar& x = _vars[h];
+        uint32_t name_len = htonl(static_cast<uint32_t>(x.name.length()));
+        memcpy(_vars_buffer + vars_offset, &name_len, sizeof(uint32_t));
+        vars_offset += sizeof(uint32_t);
+        memcpy(_vars_buffer + vars_offset, x.name.c_str(), x.name.length());
+        vars_offset += x.name.length();
+        // variable id used in message headers is the variable's handle
+        uint32_t net_id = htonl(h);
+        memcpy(_vars_buffer + vars_offset, &net_id, sizeof(uint32_t));
+        vars_offset += sizeof(uint32_t);
+        uint32_t net_dims = htonl(x.dims);
+        memcpy(_vars_buffer + vars_offset, &net_dims, sizeof(uint32_t));
+        vars_offset += sizeof(uint32_t);
+        memcpy(_vars_buffer + vars_offset, &x.type, sizeof(uint8_t));
+        vars_offset += sizeof(uint8_t);
+        memcpy(_vars_buffer + vars_offset, &x.codec, sizeof(uint8_t));
+        vars_offset += sizeof(uint8_t);
+        memcpy(_vars_buffer + vars_offset, &x.filter, sizeof(uint8_t));
+        vars_offset += sizeof(uint8_t);
+        uint32_t net_size = htonl(x.size);
+        memcpy(_vars_buffer + vars_offset, &net_size, sizeof(uint32_t));
+        vars_offset += sizeof(uint32_t);
+        int64_t net_length = HpcStream::HToNLL(x.length);
+        memcpy(_vars_buffer + vars_offset, &net_length, sizeof(int64_t));
+        vars_offset += sizeof(int64_t);
+        if (x.length == 0)
+        {
+            uint32_t len;
+            for (i = 0; i < x.dims; i++)
+            {
+                len = htonl(static_cast<uint32_t>(x.gs_vars[i].length()));
+                memcpy(_vars_buffer + vars_offset, &len, sizeof(uint32_t));
+                vars_offset += sizeof(uint32_t);
+                memcpy(_vars_buffer + vars_offset, x.gs_vars[i].c_str(), x.gs_vars[i].length());
+                vars_offset += x.gs_vars[i].length();
+            }
+            for (i = 0; i < x.dims; i++)
+            {
+                len = htonl(static_cast<uint32_t>(x.ls_vars[i].length()));
+                memcpy(_vars_buffer + vars_offset, &len, sizeof(uint32_t));
+                vars_offset += sizeof(uint32_t);
+                memcpy(_vars_buffer + vars_offset, x.ls_vars[i].c_str(), x.ls_vars[i].length());
+                vars_offset += x.ls_vars[i].length();
+            }
+            for (i = 0; i < x.dims; i++)
+            {
+                len = htonl(static_cast<uint32_t>(x.lo_vars[i].length()));
+                memcpy(_vars_buffer + vars_offset, &len, sizeof(uint32_t));
+                vars_offset += sizeof(uint32_t);
+                memcpy(_vars_buffer + vars_offset, x.lo_vars[i].c_str(), x.lo_vars[i].length());
+                vars_offset += x.lo_vars[i].length();
+            }
+        }
+    }
+}
+
+NetSocket::Server::Event HpcStream::Server::NextEvent()
+{
+    // while data socket sends are unfinished, they and NetSocket are checked every millisecond
+    if (_uring != NULL && _uring->Pending())
+    {
+        _uring->Wait(1);
+        ReapBulk();
+        return _server->PollForNextEvent();
+    }
+    return _server->WaitForNextEvent();
+}
+
+void HpcStream::Server::ProcessEvent(NetSocket::Server::Event& event)
+{
+    if (HandleNewConnection(event))
+    {
+        return;
+    }
+    std::string event_client_id;
+    std::map<std::string, Connection>::iterator conn;
+    uint8_t *sent;
+    WriteRequest step_id;
+    std::multimap<uint8_t*, uint8_t*>::iterator send;
+    std::map<WriteRequest, StepProgress>::iterator progress;
+    HpcStream::MessageHeader header;
+    switch (event.type)
+    {
+        case NetSocket::Server::EventType::ReceiveBinary:
+            event_client_id = event.client->Endpoint();
+            conn = _connections.find(event_client_id);
+            if (conn == _connections.end()
+                || !HpcStream::ReadMessageHeader(reinterpret_cast<uint8_t*>(event.binary_data), event.data_length, &header))
+            {
+                fprintf(stderr, "[HpcStream] Error: received malformed message from %s\n", event_client_id.c_str());
+            }
+            else if (header.type == MessageType::Subscribe)
+            {
+                UpdateSubscriptions(event_client_id, conn->second, reinterpret_cast<uint8_t*>(event.binary_data) + HPCSTREAM_HEADER_SIZE, header.length);
+            }
+            else if (header.type == MessageType::Region)
+            {
+                UpdateRegion(conn->second, header.var, reinterpret_cast<uint8_t*>(event.binary_data) + HPCSTREAM_HEADER_SIZE, header.length);
+            }
+            else if (header.type == MessageType::Subsample)
+            {
+                UpdateSubsampling(conn->second, header.var, reinterpret_cast<uint8_t*>(event.binary_data) + HPCSTREAM_HEADER_SIZE, header.length);
+            }
+            else if (header.type == MessageType::ShmOpen && conn->second.shm != NULL)
+            {
+                // client mapped the ring - values go through it from now on
+                conn->second.shm_ready = true;
+                conn->second.shm->Unlink();
+            }
+            else if (header.type == MessageType::BulkOpen && conn->second.bulk_token != 0)
+            {
+                // client connected its data sockets - large values go over them once all are matched
+                conn->second.bulk_reported = std::chrono::steady_clock::now();
+                AcceptBulkSockets();
+            }
+            else if (header.type == MessageType::McastOpen && _mcast != NULL)
+            {
+                // client joined the group - values it shares with other clients are multicast from now on
+                if (header.length >= sizeof(uint8_t) && reinterpret_cast<uint8_t*>(event.binary_data)[HPCSTREAM_HEADER_SIZE] != 0)
+                {
+                    conn->second.mcast_ready = true;
+                }
+                else
+                {
+                    OfferBulkSocket(conn->second);
+                }
+            }
+            else if (header.type == MessageType::McastNack && _mcast != NULL)
+            {
+                ResendMulticast(reinterpret_cast<uint8_t*>(event.binary_data) + HPCSTREAM_HEADER_SIZE, header.length);
+            }
+            else if (header.type == MessageType::Refresh && header.var < _vars.size())
+            {
+                // client lost the variable's value - the next step it receives carries it whole
+                conn->second.refresh[header.var] = true;
+            }
+            else if (header.type == MessageType::StepWindow)
+            {
+                UpdateStepWindow(conn->second, reinterpret_cast<uint8_t*>(event.binary_data) + HPCSTREAM_HEADER_SIZE, header.length);
+            }
+            else if (conn->second.state == ClientState::Streaming && header.type == MessageType::StepAck)
+            {
+                // releasing a step returns the credit of every step up to it
+                while (!conn->second.unacked.empty() && conn->second.unacked.front() <= header.step)
+                {
+                    progress = _steps_in_flight.find(conn->second.unacked.front());
+                    conn->second.unacked.pop_front();
+                    if (progress != _steps_in_flight.end())
+                    {
+                        progress->second.acks_pending--;
+                        if (progress->second.acks_pending == 0 && progress->second.markers_pending == 0)
+                        {
+                            CompleteStep(progress->first);
+                        }
+                    }
+                }
+            }
+            delete[] event.binary_data;
+            break;
+        case NetSocket::Server::EventType::SendFinished:
+            // release the hold of a send on its message (ring slot, shared buffer or step marker) - only sends still
+            // listed for the connection, those of removed connections were released with them
+            conn = _connections.find(event.client->Endpoint());
+            if (conn == _connections.end())
+            {
+                break;
+            }
+            send = conn->second.sends.find(reinterpret_cast<uint8_t*>(event.binary_data));
+            if (send == conn->second.sends.end())
+            {
+                break;
+            }
+            sent = send->second;
+            conn->second.sends.erase(send);
+            step_id = FinishSend(sent);
+            if (step_id != 0 && conn->second.sending_step == step_id)
+            {
+                conn->second.step_end_sent = true;
+                SendQueuedStep(conn->second);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+bool HpcStream::Server::HandleNewConnection(NetSocket::Server::Event& event)
+{
+    bool new_connection_event = false;
+    std::string event_client_id;
+    std::map<std::string, Connection>::iterator conn;
+    if (event.type != NetSocket::Server::EventType::None)
+    {
+        event_client_id = event.client->Endpoint();
+    }
+    switch (event.type)
+    {
+        case NetSocket::Server::EventType::Connect:
+            _connections[event_client_id] = {0, ClientState::Connecting, event.client, 0, 0, true, false, std::deque<WriteRequest>(), 1, std::vector<bool>(), std::vector<bool>(_vars.size(), false),
+                                             std::map<VarHandle, std::vector<uint32_t> >(), std::map<VarHandle, std::vector<uint32_t> >(),
+                                             0, false, std::deque<Step>(), 0, std::multimap<uint8_t*, uint8_t*>(), NULL, false, std::vector<int>(), false, 0,
+                                             std::chrono::steady_clock::time_point(), 0, false};
+            if (_rank == 0)
+            {
+                // send server ip addresses and ports for all ranks
+                _connections[event_client_id].client->Send(&_endianness, 1, NetSocket::CopyMode::ZeroCopy);
+                _connections[event_client_id].client->Send(_ip_address_list, 4 * _num_rails * _num_senders, NetSocket::CopyMode::ZeroCopy);
+                _connections[event_client_id].client->Send(_port_list, _num_senders * sizeof(uint16_t), NetSocket::CopyMode::ZeroCopy);
+                _connections[event_client_id].client->Send(_group_size_list, _num_senders * sizeof(uint32_t), NetSocket::CopyMode::ZeroCopy);
+            }
+            new_connection_event = true;
+            break;
+        case NetSocket::Server::EventType::Disconnect:
+            RemoveConnection(event_client_id);
+            new_connection_event = true;
+            break;
+        case NetSocket::Server::EventType::ReceiveString:
+            fprintf(stderr, "[HpcStream] Error: received unknown string message from %s\n", event_client_id.c_str());
+            new_connection_event = true;
+            break;
+        case NetSocket::Server::EventType::ReceiveBinary:
+            // clients removed before their events were processed are ignored
+            conn = _connections.find(event_client_id);
+            if (conn == _connections.end())
+            {
+                delete[] event.binary_data;
+                new_connection_event = true;
+            }
+            else if (conn->second.state == ClientState::Connecting)
+            {
+                Connection& c = conn->second;
+                c.state = ClientState::Handshake;
+                 //verify client handshake data is as expected
+                if (event.data_length == HPCSTREAM_HANDSHAKE_SIZE && ntohl(*((uint32_t*)event.binary_data)) == _num_senders
+                    && ((uint8_t*)event.binary_data)[21] == HPCSTREAM_PROTOCOL_VERSION)
+                {
+                    // store client data
+                    c.id = HpcStream::NToHLL(*((uint64_t*)((uint32_t*)event.binary_data + 1)));
+                    c.remote_rank = ntohl(*((uint32_t*)event.binary_data + 3));
+                    c.num_remote_ranks = ntohl(*((uint32_t*)event.binary_data + 4));
+                    c.has_same_endianness = ((uint8_t*)event.binary_data)[20] == _endianness;
+                    // send variable definitions
+                    c.client->Send(_vars_buffer, _vars_buffer_size, NetSocket::CopyMode::ZeroCopy);
+                    OfferSharedMemory(event_client_id, c);
+                    if (!OfferMulticast(c))
+                    {
+                        OfferBulkSocket(c);
+                    }
+                }
+                else
+                {
+                    fprintf(stderr, "[HpcStream] Error: unexpected handshake from %s (protocol version %u required)\n",
+                            event_client_id.c_str(), HPCSTREAM_PROTOCOL_VERSION);
+                    // TODO: terminate client connection
+                }
                 delete[] event.binary_data;
                 new_connection_event = true;
             }
             break;
         case NetSocket::Server::EventType::SendFinished:
-            // once variable definitions are sent, increment verified connections 
+            // once variable definitions are sent (and the client has subscribed), increment verified connections
             if (event.binary_data == _vars_buffer)
             {
-                _connections[event_client_id].state = ClientState::Streaming;
-                printf("[rank %d] client %d (%s) connected and verified\n", _rank, _num_connections, event_client_id.c_str());
-                _num_connections++;
+                conn = _connections.find(event_client_id);
+                if (conn != _connections.end() && conn->second.subscribed.empty())
+                {
+                    conn->second.state = ClientState::Subscribing;
+                }
+                else if (conn != _connections.end())
+                {
+                    StartStreaming(event_client_id, conn->second);
+                }
                 new_connection_event = true;
             }
             break;
@@ -511,6 +1946,515 @@ bool HpcStream::Server::HandleNewConnection(NetSocket::Server::Event& event)
     return new_connection_event;
 }
 
+void HpcStream::Server::RemoveConnection(const std::string& client_id)
+{
+    // steps stop waiting on the client: its acks are released, queued steps dropped and unfinished sends let go of
+    // their buffers (NetSocket may never report them finished once the socket is closed)
+    std::map<std::string, Connection>::iterator conn = _connections.find(client_id);
+    if (conn == _connections.end())
+    {
+        return;
+    }
+    Connection& c = conn->second;
+    while (!c.unacked.empty())
+    {
+        std::map<WriteRequest, StepProgress>::iterator progress = _steps_in_flight.find(c.unacked.front());
+        c.unacked.pop_front();
+        if (progress != _steps_in_flight.end())
+        {
+            progress->second.acks_pending--;
+            if (progress->second.acks_pending == 0 && progress->second.markers_pending == 0)
+            {
+                CompleteStep(progress->first);
+            }
+        }
+    }
+    while (!c.queued.empty())
+    {
+        ReleaseQueuedStep(c.queued.front());
+        c.queued.pop_front();
+    }
+    for (auto const& send : c.sends)
+    {
+        FinishSend(send.second);
+    }
+    c.sends.clear();
+    _cond.notify_all();
+    if (c.state == ClientState::Streaming)
+    {
+        _num_connections--;
+    }
+    delete c.shm;
+    // sends still on the data sockets fail, releasing what they hold as they are reaped
+    for (int fd : c.bulk_fds)
+    {
+        if (fd >= 0)
+        {
+            _uring->Close(fd);
+        }
+    }
+    printf("[rank %d] client (%s) disconnected\n", _rank, client_id.c_str());
+    _connections.erase(conn);
+}
+
+void HpcStream::Server::OfferSharedMemory(const std::string& client_id, Connection& c)
+{
+    // clients connecting from one of this node's addresses (or loopback) are offered a shared-memory ring - the server
+    // keeps using the socket until the client reports that it mapped the ring
+    int i;
+    struct in_addr addr;
+    std::string host = client_id.substr(0, client_id.rfind(':'));
+    bool same_node = false;
+    if (_shm_size == 0 || inet_aton(host.c_str(), &addr) == 0)
+    {
+        return;
+    }
+    for (i = 0; i < _num_rails; i++)
+    {
+        same_node |= memcmp(&addr, _rail_addresses.data() + 4 * i, 4) == 0;
+    }
+    if (!same_node && (ntohl(addr.s_addr) >> 24) != 127)
+    {
+        return;
+    }
+    std::ostringstream name;
+    name << "/hpcstream-" << getpid() << "-" << _rank << "-" << _shm_count++;
+    c.shm = HpcStream::ShmRing::Create(name.str(), _shm_size);
+    if (c.shm == NULL)
+    {
+        return;
+    }
+    // payload: [ring name]
+    uint64_t payload_size = c.shm->Name().length();
+    std::vector<uint8_t> offer(HPCSTREAM_HEADER_SIZE + payload_size);
+    HpcStream::WriteMessageHeader(offer.data(), MessageType::ShmOpen, 0, 0, payload_size);
+    memcpy(offer.data() + HPCSTREAM_HEADER_SIZE, c.shm->Name().c_str(), payload_size);
+    c.client->Send(offer.data(), offer.size(), NetSocket::CopyMode::MemCopy);
+}
+
+bool HpcStream::Server::SendShared(Connection& c, const uint8_t *message, uint64_t size)
+{
+    // copies the message into the client's ring and sends only its position - returns false (send through the socket)
+    // for clients without a ring, small messages, or when the ring is full
+    uint64_t position;
+    if (!c.shm_ready || size < 4096 || !c.shm->Write(message, size, &position))
+    {
+        return false;
+    }
+    // payload: [uint64 ring position][uint64 message length]
+    uint8_t ref[HPCSTREAM_HEADER_SIZE + 2 * sizeof(uint64_t)];
+    uint64_t net_position = HpcStream::HToNLL(position);
+    uint64_t net_size = HpcStream::HToNLL(size);
+    HpcStream::WriteMessageHeader(ref, MessageType::ShmRef, 0, 0, 2 * sizeof(uint64_t));
+    memcpy(ref + HPCSTREAM_HEADER_SIZE, &net_position, sizeof(uint64_t));
+    memcpy(ref + HPCSTREAM_HEADER_SIZE + sizeof(uint64_t), &net_size, sizeof(uint64_t));
+    c.client->Send(ref, sizeof(ref), NetSocket::CopyMode::MemCopy);
+    return true;
+}
+
+void HpcStream::Server::OpenBulkListener()
+{
+    // data sockets listen on a port picked by the system - clients learn it from the offer
+    _uring = HpcStream::UringSender::Create(64);
+    if (_uring == NULL)
+    {
+        fprintf(stderr, "[HpcStream] Warning: io_uring not available, values are sent through the socket\n");
+        return;
+    }
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
+    _bulk_listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (_bulk_listener < 0 || bind(_bulk_listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(_bulk_listener, 64) != 0
+        || getsockname(_bulk_listener, (struct sockaddr*)&addr, &addr_len) != 0)
+    {
+        fprintf(stderr, "[HpcStream] Warning: could not open data socket, values are sent through the socket\n");
+        if (_bulk_listener >= 0)
+        {
+            close(_bulk_listener);
+            _bulk_listener = -1;
+        }
+        delete _uring;
+        _uring = NULL;
+        return;
+    }
+    fcntl(_bulk_listener, F_SETFL, fcntl(_bulk_listener, F_GETFL) | O_NONBLOCK);
+    _bulk_port = ntohs(addr.sin_port);
+}
+
+void HpcStream::Server::OfferBulkSocket(Connection& c)
+{
+    // clients without a shared-memory ring or multicast group get data sockets once all of them connected
+    if (_bulk_listener < 0 || c.shm != NULL || c.mcast_ready || c.bulk_token != 0)
+    {
+        return;
+    }
+    std::random_device rd;
+    while (c.bulk_token == 0)
+    {
+        c.bulk_token = ((uint64_t)rd() << 32) | rd();
+    }
+    c.bulk_fds.assign(_bulk_streams, -1);
+    // payload: [uint16 port][uint64 token][uint32 stream count][uint64 stripe size]
+    uint8_t offer[HPCSTREAM_HEADER_SIZE + sizeof(uint16_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t)];
+    uint8_t *payload = offer + HPCSTREAM_HEADER_SIZE;
+    uint16_t net_port = htons(_bulk_port);
+    uint64_t net_token = HpcStream::HToNLL(c.bulk_token);
+    uint32_t net_streams = htonl(_bulk_streams);
+    uint64_t net_stripe_size = HpcStream::HToNLL(_stripe_size);
+    HpcStream::WriteMessageHeader(offer, MessageType::BulkOpen, 0, 0, sizeof(offer) - HPCSTREAM_HEADER_SIZE);
+    memcpy(payload, &net_port, sizeof(uint16_t));
+    memcpy(payload + sizeof(uint16_t), &net_token, sizeof(uint64_t));
+    memcpy(payload + sizeof(uint16_t) + sizeof(uint64_t), &net_streams, sizeof(uint32_t));
+    memcpy(payload + sizeof(uint16_t) + sizeof(uint64_t) + sizeof(uint32_t), &net_stripe_size, sizeof(uint64_t));
+    c.client->Send(offer, sizeof(offer), NetSocket::CopyMode::MemCopy);
+}
+
+void HpcStream::Server::AcceptBulkSockets()
+{
+    // clients connect and send [uint64 token][uint32 stream] before reporting it - read as it arrives, never waited on
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool offered = std::any_of(_connections.begin(), _connections.end(),
+                               [](const std::pair<const std::string, Connection>& p) {return !p.second.bulk_ready && !p.second.bulk_fds.empty();});
+    if (!offered && _bulk_hellos.empty())
+    {
+        return;
+    }
+    int fd;
+    while (offered && (fd = accept4(_bulk_listener, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        BulkHello hello;
+        hello.fd = fd;
+        hello.received = 0;
+        hello.accepted = now;
+        _bulk_hellos.push_back(hello);
+    }
+    std::vector<BulkHello>::iterator hello = _bulk_hellos.begin();
+    while (hello != _bulk_hellos.end())
+    {
+        ssize_t size = recv(hello->fd, hello->data + hello->received, sizeof(hello->data) - hello->received, MSG_DONTWAIT);
+        bool closed = size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+        hello->received += std::max(size, (ssize_t)0);
+        Connection *owner = NULL;
+        uint32_t stream = 0;
+        if (hello->received == sizeof(hello->data))
+        {
+            uint64_t token = HpcStream::NToHLL(*((uint64_t*)hello->data));
+            stream = ntohl(*((uint32_t*)(hello->data + sizeof(uint64_t))));
+            for (auto& conn : _connections)
+            {
+                if (conn.second.bulk_token == token && stream < conn.second.bulk_fds.size() && conn.second.bulk_fds[stream] < 0)
+                {
+                    owner = &(conn.second);
+                }
+            }
+        }
+        if (owner != NULL)
+        {
+            // io_uring sends expect a blocking socket
+            fcntl(hello->fd, F_SETFL, fcntl(hello->fd, F_GETFL) & ~O_NONBLOCK);
+            owner->bulk_fds[stream] = hello->fd;
+            hello = _bulk_hellos.erase(hello);
+        }
+        else if (closed || hello->received == sizeof(hello->data) || now - hello->accepted > std::chrono::seconds(5))
+        {
+            close(hello->fd);
+            hello = _bulk_hellos.erase(hello);
+        }
+        else
+        {
+            hello++;
+        }
+    }
+    for (auto& conn : _connections)
+    {
+        Connection& c = conn.second;
+        if (c.bulk_ready || c.bulk_fds.empty())
+        {
+            continue;
+        }
+        if (std::find(c.bulk_fds.begin(), c.bulk_fds.end(), -1) == c.bulk_fds.end())
+        {
+            c.bulk_ready = true;
+        }
+        else if (c.bulk_reported != std::chrono::steady_clock::time_point() && now - c.bulk_reported > std::chrono::seconds(5))
+        {
+            fprintf(stderr, "[HpcStream] Warning: data sockets of %s did not connect, values are sent through the socket\n", conn.first.c_str());
+            for (int fd : c.bulk_fds)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+            c.bulk_fds.clear();
+        }
+    }
+}
+
+bool HpcStream::Server::SendBulk(Connection& c, const uint8_t *message, uint64_t size)
+{
+    // stripes go round-robin over the data sockets and only the length through the socket - false for small messages
+    if (!c.bulk_ready || size < 4096)
+    {
+        return false;
+    }
+    uint8_t *buffer = const_cast<uint8_t*>(message);
+    uint64_t offset;
+    uint32_t stream = 0;
+    uint32_t stripes = 0;
+    bool zerocopy = _zerocopy_threshold > 0 && size >= _zerocopy_threshold;
+    for (offset = 0; offset < size; offset += _stripe_size)
+    {
+        _bulk_sends[_next_bulk_send] = {buffer, c.client->Endpoint()};
+        _uring->Send(c.bulk_fds[stream], message + offset, std::min(_stripe_size, size - offset), zerocopy, _next_bulk_send++);
+        stream = (stream + 1) % c.bulk_fds.size();
+        stripes++;
+    }
+    // each stripe holds the message until reaped
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::map<uint8_t*, BufferOwner>::iterator owner = _send_buf_owners.find(buffer);
+        if (owner != _send_buf_owners.end())
+        {
+            _vars[owner->second.var].sends_pending[owner->second.slot] += stripes;
+        }
+        else
+        {
+            _shared_bufs[buffer] += stripes;
+        }
+    }
+    c.bulk_pending += stripes;
+    // payload: [uint64 message length]
+    uint8_t ref[HPCSTREAM_HEADER_SIZE + sizeof(uint64_t)];
+    uint64_t net_size = HpcStream::HToNLL(size);
+    HpcStream::WriteMessageHeader(ref, MessageType::BulkRef, 0, 0, sizeof(uint64_t));
+    memcpy(ref + HPCSTREAM_HEADER_SIZE, &net_size, sizeof(uint64_t));
+    c.client->Send(ref, sizeof(ref), NetSocket::CopyMode::MemCopy);
+    return true;
+}
+
+void HpcStream::Server::ReapBulk()
+{
+    // releases what completed data socket sends held - clients whose data sockets failed are left to disconnect
+    std::vector<HpcStream::UringSender::Completion> done;
+    // data sockets still connecting are picked up wherever sends are reaped
+    AcceptBulkSockets();
+    if (_uring == NULL || !_uring->Reap(done))
+    {
+        return;
+    }
+    for (auto const& d : done)
+    {
+        std::map<uint64_t, BulkSend>::iterator send = _bulk_sends.find(d.tag);
+        if (send == _bulk_sends.end())
+        {
+            continue;
+        }
+        uint8_t *message = send->second.message;
+        std::map<std::string, Connection>::iterator conn = _connections.find(send->second.client_id);
+        _bulk_sends.erase(send);
+        FinishSend(message);
+        if (conn == _connections.end())
+        {
+            continue;
+        }
+        Connection& c = conn->second;
+        c.bulk_pending--;
+        if (d.failed && c.bulk_ready)
+        {
+            fprintf(stderr, "[HpcStream] Error: lost data socket of %s\n", conn->first.c_str());
+            for (int fd : c.bulk_fds)
+            {
+                if (fd >= 0)
+                {
+                    _uring->Close(fd);
+                }
+            }
+            c.bulk_fds.clear();
+            c.bulk_ready = false;
+        }
+        SendQueuedStep(c);
+    }
+}
+
+bool HpcStream::Server::OfferMulticast(Connection& c)
+{
+    // clients without a shared-memory ring are offered the sender's multicast group - they reply whether they joined
+    if (_mcast == NULL || c.shm != NULL)
+    {
+        return false;
+    }
+    // payload: [uint16 port][group address]
+    uint64_t payload_size = sizeof(uint16_t) + _mcast_group.length();
+    std::vector<uint8_t> offer(HPCSTREAM_HEADER_SIZE + payload_size);
+    uint16_t net_port = htons(_mcast_port);
+    HpcStream::WriteMessageHeader(offer.data(), MessageType::McastOpen, 0, 0, payload_size);
+    memcpy(offer.data() + HPCSTREAM_HEADER_SIZE, &net_port, sizeof(uint16_t));
+    memcpy(offer.data() + HPCSTREAM_HEADER_SIZE + sizeof(uint16_t), _mcast_group.c_str(), _mcast_group.length());
+    c.client->Send(offer.data(), offer.size(), NetSocket::CopyMode::MemCopy);
+    return true;
+}
+
+bool HpcStream::Server::SendMulticast(Connection& c, const uint8_t *message, uint64_t size)
+{
+    // multicasts the message the first time a client of the group needs it this step, then sends only its id to each
+    // - returns false (send through the socket) for clients outside the group and small messages
+    if (!c.mcast_ready || size < 4096)
+    {
+        return false;
+    }
+    std::map<const uint8_t*, uint64_t>::iterator sent = _mcast_sent.find(message);
+    if (sent == _mcast_sent.end())
+    {
+        sent = _mcast_sent.insert(std::make_pair(message, _mcast->Send(message, size, _mcast_step))).first;
+    }
+    // payload: [uint64 message id][uint64 message length]
+    uint8_t ref[HPCSTREAM_HEADER_SIZE + 2 * sizeof(uint64_t)];
+    uint64_t net_id = HpcStream::HToNLL(sent->second);
+    uint64_t net_size = HpcStream::HToNLL(size);
+    // header names the variable, so a client that loses the message can ask for it again
+    HpcStream::MessageHeader header;
+    HpcStream::ReadMessageHeader(message, size, &header);
+    HpcStream::WriteMessageHeader(ref, MessageType::McastRef, header.var, header.step, 2 * sizeof(uint64_t));
+    memcpy(ref + HPCSTREAM_HEADER_SIZE, &net_id, sizeof(uint64_t));
+    memcpy(ref + HPCSTREAM_HEADER_SIZE + sizeof(uint64_t), &net_size, sizeof(uint64_t));
+    c.client->Send(ref, sizeof(ref), NetSocket::CopyMode::MemCopy);
+    return true;
+}
+
+void HpcStream::Server::ResendMulticast(const uint8_t *nack, uint64_t length)
+{
+    // payload: [uint64 message id][uint32 fragment] for each fragment a client is missing - multicast again, other
+    // clients drop what they already have
+    uint64_t i;
+    if (length < sizeof(uint64_t))
+    {
+        return;
+    }
+    uint64_t id = HpcStream::NToHLL(*((uint64_t*)nack));
+    std::vector<uint32_t> fragments;
+    for (i = sizeof(uint64_t); i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+    {
+        fragments.push_back(ntohl(*((uint32_t*)(nack + i))));
+    }
+    if (!fragments.empty() && !_mcast->Resend(id, fragments))
+    {
+        fprintf(stderr, "[HpcStream] Warning: multicast message %llu is no longer held\n", (unsigned long long)id);
+    }
+}
+
+void HpcStream::Server::UpdateSubscriptions(const std::string& client_id, Connection& c, const uint8_t *ids, uint64_t length)
+{
+    // payload: [var id] for each subscribed variable - replaces the previous subscription set
+    uint64_t i;
+    std::vector<bool> subscribed(_vars.size(), false);
+    for (i = 0; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+    {
+        uint32_t net_id;
+        memcpy(&net_id, ids + i, sizeof(uint32_t));
+        VarHandle h = ntohl(net_id);
+        if (h < _vars.size())
+        {
+            subscribed[h] = true;
+        }
+    }
+    // newly subscribed variables are sent whole on the next step, since the client's copy is out of date
+    bool first = c.subscribed.empty();
+    for (i = 0; !first && i < _vars.size(); i++)
+    {
+        c.refresh[i] = c.refresh[i] || (subscribed[i] && !c.subscribed[i]);
+    }
+    c.subscribed = subscribed;
+    if (first && c.state == ClientState::Subscribing)
+    {
+        StartStreaming(client_id, c);
+    }
+}
+
+void HpcStream::Server::UpdateRegion(Connection& c, VarHandle handle, const uint8_t *box, uint64_t length)
+{
+    // payload: [uint32 global offset per dim][uint32 size per dim] - empty payload clears the region
+    // (values aggregated across ranks are sent whole, clients keep the part they need)
+    uint32_t i;
+    if (handle >= _vars.size() || _vars[handle].gs_vars.size() == 0 || _group_size > 1)
+    {
+        return;
+    }
+    SharedVar& x = _vars[handle];
+    if (length == 2 * x.dims * sizeof(uint32_t))
+    {
+        std::vector<uint32_t> region(2 * x.dims);
+        for (i = 0; i < 2 * x.dims; i++)
+        {
+            uint32_t net_val;
+            memcpy(&net_val, box + i * sizeof(uint32_t), sizeof(uint32_t));
+            region[i] = ntohl(net_val);
+        }
+        c.regions[handle] = region;
+    }
+    else
+    {
+        c.regions.erase(handle);
+    }
+    // client's copy no longer covers what it needs (or no longer matches the server's previous value)
+    c.refresh[handle] = true;
+}
+
+void HpcStream::Server::UpdateSubsampling(Connection& c, VarHandle handle, const uint8_t *sample, uint64_t length)
+{
+    // payload: [uint32 factor per dim][uint8 filter] - factors of 1 in every dimension clear subsampling
+    // (not offered for values aggregated across ranks)
+    uint32_t i;
+    if (handle >= _vars.size() || _vars[handle].gs_vars.size() == 0 || _group_size > 1)
+    {
+        return;
+    }
+    SharedVar& x = _vars[handle];
+    bool subsampled = false;
+    std::vector<uint32_t> factors(x.dims + 1);
+    for (i = 0; i < x.dims && length == x.dims * sizeof(uint32_t) + sizeof(uint8_t); i++)
+    {
+        uint32_t net_val;
+        memcpy(&net_val, sample + i * sizeof(uint32_t), sizeof(uint32_t));
+        factors[i] = std::max(ntohl(net_val), 1u);
+        subsampled |= factors[i] > 1;
+    }
+    if (subsampled)
+    {
+        factors[x.dims] = sample[x.dims * sizeof(uint32_t)];
+        c.samples[handle] = factors;
+    }
+    else
+    {
+        c.samples.erase(handle);
+    }
+    c.refresh[handle] = true;
+}
+
+void HpcStream::Server::UpdateStepWindow(Connection& c, const uint8_t *window, uint64_t length)
+{
+    // payload: [uint32 steps the server may send ahead of the client's last released step]
+    uint32_t net_window;
+    if (length != sizeof(uint32_t))
+    {
+        return;
+    }
+    memcpy(&net_window, window, sizeof(uint32_t));
+    c.window = std::max(ntohl(net_window), 1u);
+    _cond.notify_all();
+}
+
+void HpcStream::Server::StartStreaming(const std::string& client_id, Connection& c)
+{
+    c.state = ClientState::Streaming;
+    printf("[rank %d] client %d (%s) connected and verified\n", _rank, _num_connections, client_id.c_str());
+    _num_connections++;
+}
+
 void HpcStream::Server::GetIpAddress(const char *iface, uint8_t ip_address[4])
 {
     struct ifaddrs *interfaces = NULL;
@@ -534,6 +2478,24 @@ void HpcStream::Server::GetIpAddress(const char *iface, uint8_t ip_address[4])
     freeifaddrs(interfaces);
 }
 
+void HpcStream::Server::WaitForPendingSends(VarHandle handle, int slot)
+{
+    SharedVar& var = _vars[handle];
+    if (_async_write)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] {return var.sends_pending[slot] == 0;});
+    }
+    else
+    {
+        while (var.sends_pending[slot] > 0)
+        {
+            NetSocket::Server::Event event = NextEvent();
+            ProcessEvent(event);
+        }
+    }
+}
+
 std::vector<std::string> HpcStream::Server::ParseVarCounts(std::string counts)
 {
     std::vector<std::string> count_vars;
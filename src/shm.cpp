@@ -0,0 +1,125 @@
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hpcstream/shm.h"
+
+HpcStream::ShmRing::ShmRing(const std::string& name, void *map, uint64_t map_size, bool linked) :
+    _name(name),
+    _header(reinterpret_cast<Header*>(map)),
+    _data(reinterpret_cast<uint8_t*>(map) + sizeof(Header)),
+    _map_size(map_size),
+    _linked(linked)
+{
+}
+
+HpcStream::ShmRing::~ShmRing()
+{
+    munmap(_header, _map_size);
+    Unlink();
+}
+
+HpcStream::ShmRing* HpcStream::ShmRing::Create(const std::string& name, uint64_t capacity)
+{
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "[HpcStream] Error: could not create shared memory %s\n", name.c_str());
+        return NULL;
+    }
+    uint64_t map_size = sizeof(Header) + capacity;
+    void *map = MAP_FAILED;
+    // pages are reserved up front - writing to a sparse ring raises SIGBUS once /dev/shm is full
+    if (posix_fallocate(fd, 0, map_size) != 0)
+    {
+        fprintf(stderr, "[HpcStream] Warning: could not reserve %llu bytes of shared memory, using the socket\n", (unsigned long long)map_size);
+        close(fd);
+        shm_unlink(name.c_str());
+        return NULL;
+    }
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "[HpcStream] Error: could not map shared memory %s\n", name.c_str());
+        shm_unlink(name.c_str());
+        return NULL;
+    }
+    Header *header = new (map) Header;
+    header->capacity = capacity;
+    header->write_pos.store(0);
+    header->read_pos.store(0);
+    return new ShmRing(name, map, map_size, true);
+}
+
+HpcStream::ShmRing* HpcStream::ShmRing::Open(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat info;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > (off_t)sizeof(Header))
+    {
+        map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED || reinterpret_cast<Header*>(map)->capacity + sizeof(Header) != (uint64_t)info.st_size)
+    {
+        if (map != MAP_FAILED) munmap(map, info.st_size);
+        return NULL;
+    }
+    return new ShmRing(name, map, info.st_size, false);
+}
+
+const std::string& HpcStream::ShmRing::Name()
+{
+    return _name;
+}
+
+void HpcStream::ShmRing::Unlink()
+{
+    if (_linked)
+    {
+        shm_unlink(_name.c_str());
+        _linked = false;
+    }
+}
+
+bool HpcStream::ShmRing::Write(const uint8_t *message, uint64_t length, uint64_t *position)
+{
+    // messages are kept contiguous - one that would wrap starts over at the beginning of the ring
+    uint64_t capacity = _header->capacity;
+    uint64_t start = _header->write_pos.load(std::memory_order_relaxed);
+    uint64_t read = _header->read_pos.load(std::memory_order_acquire);
+    if (start % capacity + length > capacity)
+    {
+        start += capacity - (start % capacity);
+    }
+    if (length > capacity || start + length - read > capacity)
+    {
+        return false;
+    }
+    memcpy(_data + (start % capacity), message, length);
+    _header->write_pos.store(start + length, std::memory_order_release);
+    *position = start;
+    return true;
+}
+
+const uint8_t* HpcStream::ShmRing::Data(uint64_t position, uint64_t length)
+{
+    uint64_t capacity = _header->capacity;
+    if (length > capacity || position % capacity + length > capacity || position + length > _header->write_pos.load(std::memory_order_acquire))
+    {
+        return NULL;
+    }
+    return _data + (position % capacity);
+}
+
+void HpcStream::ShmRing::Release(uint64_t position)
+{
+    _header->read_pos.store(position, std::memory_order_release);
+}
@@ -0,0 +1,347 @@
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "hpcstream/uring.h"
+
+namespace {
+    int UringSetup(uint32_t entries, struct io_uring_params *params)
+    {
+        return syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int UringEnter(int ring_fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+    {
+        return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+    }
+}
+
+HpcStream::UringSender::UringSender() :
+    _ring_fd(-1),
+    _sq_map(MAP_FAILED),
+    _cq_map(MAP_FAILED),
+    _sq_map_size(0),
+    _cq_map_size(0),
+    _sqes(reinterpret_cast<struct io_uring_sqe*>(MAP_FAILED)),
+    _sqes_size(0),
+    _zerocopy(true),
+    _next_id(0),
+    _completions_due(0)
+{
+}
+
+HpcStream::UringSender::~UringSender()
+{
+    if (_thread.joinable())
+    {
+        // a no-op marked with the largest id stops the reaping thread
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            uint32_t tail = *_sq_tail;
+            uint32_t slot = tail & *_sq_mask;
+            memset(&(_sqes[slot]), 0, sizeof(struct io_uring_sqe));
+            _sqes[slot].opcode = IORING_OP_NOP;
+            _sqes[slot].user_data = UINT64_MAX;
+            _sq_array[slot] = slot;
+            __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+            UringEnter(_ring_fd, 1, 0, 0);
+        }
+        _thread.join();
+    }
+    if (_sqes != MAP_FAILED) munmap(_sqes, _sqes_size);
+    if (_cq_map != MAP_FAILED && _cq_map != _sq_map) munmap(_cq_map, _cq_map_size);
+    if (_sq_map != MAP_FAILED) munmap(_sq_map, _sq_map_size);
+    if (_ring_fd >= 0) close(_ring_fd);
+}
+
+HpcStream::UringSender* HpcStream::UringSender::Create(uint32_t entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    UringSender *uring = new UringSender();
+    uring->_ring_fd = UringSetup(entries, &params);
+    if (uring->_ring_fd < 0)
+    {
+        delete uring;
+        return NULL;
+    }
+    // submission and completion rings share one mapping on kernels that support it
+    uring->_sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->_cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        uring->_sq_map_size = std::max(uring->_sq_map_size, uring->_cq_map_size);
+    }
+    uring->_sq_map = mmap(NULL, uring->_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->_ring_fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        uring->_cq_map = uring->_sq_map;
+    }
+    else
+    {
+        uring->_cq_map = mmap(NULL, uring->_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->_ring_fd, IORING_OFF_CQ_RING);
+    }
+    uring->_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->_sqes = reinterpret_cast<struct io_uring_sqe*>(mmap(NULL, uring->_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                               uring->_ring_fd, IORING_OFF_SQES));
+    if (uring->_sq_map == MAP_FAILED || uring->_cq_map == MAP_FAILED || uring->_sqes == MAP_FAILED)
+    {
+        delete uring;
+        return NULL;
+    }
+    uint8_t *sq = reinterpret_cast<uint8_t*>(uring->_sq_map);
+    uint8_t *cq = reinterpret_cast<uint8_t*>(uring->_cq_map);
+    uring->_sq_head = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+    uring->_sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+    uring->_sq_mask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+    uring->_sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+    uring->_sq_entries = params.sq_entries;
+    uring->_cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+    uring->_cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+    uring->_cq_mask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+    uring->_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    uring->_thread = std::thread(&HpcStream::UringSender::ReapThread, uring);
+    return uring;
+}
+
+void HpcStream::UringSender::OnComplete(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _on_complete = callback;
+}
+
+void HpcStream::UringSender::Send(int fd, const uint8_t *data, uint64_t length, bool zerocopy, uint64_t tag)
+{
+    std::function<void()> callback;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t id = _next_id++;
+        _sends[id] = {fd, data, length, 0, zerocopy, false, false, 0, tag};
+        _queues[fd].push_back(id);
+        SubmitReady();
+        if (!_done.empty())
+        {
+            callback = _on_complete;
+        }
+    }
+    _cond.notify_all();
+    if (callback)
+    {
+        callback();
+    }
+}
+
+void HpcStream::UringSender::Close(int fd)
+{
+    std::function<void()> callback;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        shutdown(fd, SHUT_RDWR);
+        std::deque<uint64_t>& queue = _queues[fd];
+        if (!queue.empty() && _sends[queue.front()].in_flight)
+        {
+            // the send in flight still refers to the socket by its number
+            uint64_t id = queue.front();
+            queue.pop_front();
+            FailQueue(fd);
+            queue.push_back(id);
+            _closing.insert(fd);
+        }
+        else
+        {
+            FailQueue(fd);
+            _queues.erase(fd);
+            close(fd);
+        }
+        if (!_done.empty())
+        {
+            callback = _on_complete;
+        }
+    }
+    _cond.notify_all();
+    if (callback)
+    {
+        callback();
+    }
+}
+
+bool HpcStream::UringSender::Reap(std::vector<Completion>& done)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    done.insert(done.end(), _done.begin(), _done.end());
+    _done.clear();
+    return !done.empty();
+}
+
+bool HpcStream::UringSender::Pending()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return !_sends.empty() || !_done.empty();
+}
+
+void HpcStream::UringSender::Wait(int timeout)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait_for(lock, std::chrono::milliseconds(timeout), [&] {return !_done.empty() || _sends.empty();});
+}
+
+void HpcStream::UringSender::SubmitReady()
+{
+    // called with _mutex held - one send in flight per socket
+    for (auto& q : _queues)
+    {
+        if (_completions_due >= _sq_entries)
+        {
+            break;
+        }
+        if (!q.second.empty() && !_sends[q.second.front()].in_flight && !Submit(q.second.front()))
+        {
+            FailQueue(q.first);
+        }
+    }
+}
+
+bool HpcStream::UringSender::Submit(uint64_t id)
+{
+    PendingSend& send = _sends[id];
+    uint32_t tail = *_sq_tail;
+    uint32_t slot = tail & *_sq_mask;
+    struct io_uring_sqe *sqe = &(_sqes[slot]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = send.zerocopy && _zerocopy ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+    sqe->fd = send.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(send.data + send.sent);
+    sqe->len = static_cast<uint32_t>(std::min(send.length - send.sent, (uint64_t)1 << 30));
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = id;
+    _sq_array[slot] = slot;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int rc;
+    do
+    {
+        rc = UringEnter(_ring_fd, 1, 0, 0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc != 1)
+    {
+        fprintf(stderr, "[HpcStream] Error: io_uring submission failed (%s)\n", strerror(errno));
+        __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+    send.in_flight = true;
+    _completions_due++;
+    return true;
+}
+
+void HpcStream::UringSender::FailQueue(int fd)
+{
+    // a socket that failed takes the sends queued after it along
+    std::deque<uint64_t> queue;
+    queue.swap(_queues[fd]);
+    for (uint64_t id : queue)
+    {
+        _sends[id].failed = true;
+        Finish(id);
+    }
+}
+
+void HpcStream::UringSender::Finish(uint64_t id)
+{
+    // completes once sent (or failed) and the kernel let go of the buffer
+    std::map<uint64_t, PendingSend>::iterator send = _sends.find(id);
+    if (send != _sends.end() && !send->second.in_flight && send->second.notifs == 0
+        && (send->second.failed || send->second.sent == send->second.length))
+    {
+        _done.push_back({send->second.tag, send->second.failed});
+        _sends.erase(send);
+    }
+}
+
+void HpcStream::UringSender::ReapThread()
+{
+    bool stop = false;
+    while (!stop)
+    {
+        int rc = UringEnter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (rc < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "[HpcStream] Error: io_uring wait failed (%s)\n", strerror(errno));
+            return;
+        }
+        std::function<void()> callback;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            uint32_t head = *_cq_head;
+            while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe cqe = _cqes[head & *_cq_mask];
+                head++;
+                if (cqe.user_data == UINT64_MAX)
+                {
+                    stop = true;
+                    continue;
+                }
+                _completions_due--;
+                std::map<uint64_t, PendingSend>::iterator entry = _sends.find(cqe.user_data);
+                if (entry == _sends.end())
+                {
+                    continue;
+                }
+                PendingSend& send = entry->second;
+                int fd = send.fd;
+                // zero-copy sends complete again once the buffer is released
+                if (cqe.flags & IORING_CQE_F_NOTIF)
+                {
+                    send.notifs--;
+                    Finish(cqe.user_data);
+                    continue;
+                }
+                send.in_flight = false;
+                if (cqe.flags & IORING_CQE_F_MORE)
+                {
+                    send.notifs++;
+                    _completions_due++;
+                }
+                if ((cqe.res == -EOPNOTSUPP || cqe.res == -EINVAL) && send.zerocopy)
+                {
+                    // kernel without zero-copy sends - the rest go through the socket buffer
+                    send.zerocopy = false;
+                    _zerocopy = false;
+                }
+                else if (cqe.res > 0)
+                {
+                    // short sends continue where they left off
+                    send.sent += cqe.res;
+                    if (send.sent == send.length)
+                    {
+                        _queues[fd].pop_front();
+                        Finish(cqe.user_data);
+                    }
+                }
+                else if (cqe.res != -EAGAIN && cqe.res != -EINTR)
+                {
+                    FailQueue(fd);
+                }
+                if (_closing.erase(fd) > 0)
+                {
+                    FailQueue(fd);
+                    _queues.erase(fd);
+                    close(fd);
+                }
+            }
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+            SubmitReady();
+            if (!_done.empty())
+            {
+                callback = _on_complete;
+            }
+        }
+        _cond.notify_all();
+        if (callback)
+        {
+            callback();
+        }
+    }
+}